@@ -10,8 +10,23 @@
 ////                                                                 ////
 ////    can_set_baud - Sets the baud rate control registers*         ////
 ////                                                                 ////
+////     can_set_bit_timing - Solves bit timing for a clock and rate ////
+////                                                                 ////
+////     can_autobaud - Finds bit rate of the bus in Listen mode     ////
+////                                                                 ////
 ////    can_set_mode - Sets the CAN module into a specific mode*     ////
 ////                                                                 ////
+////     can_set_mode_timeout - Sets mode and returns polls it took  ////
+////                                                                 ////
+////     can_request_mode - Requests mode without waiting for it     ////
+////                                                                 ////
+////     can_error_state - Returns error state from COMSTAT          ////
+////                                                                 ////
+////     can_tx_pending - Returns transmit buffers with a frame      ////
+////                      waiting                                    ////
+////                                                                 ////
+////     can_tx_requeue - Requests transmit buffers be sent again    ////
+////                                                                 ////
 ////     can_set_functional_mode - Sets the function mode            ////
 ////                                                                 ////
 ////    can_set_id - Sets the standard and extended ID*              ////
@@ -36,6 +51,9 @@
 ////    can_tbe - Returns true if the transmit buffer is ready to    ////
 ////              send more data*                                    ////
 ////                                                                 ////
+////    can_tx_free - Returns bitmap of free transmit buffers, which ////
+////                  can_putd() uses without testing them again     ////
+////                                                                 ////
 ////    can_abort - Aborts all pending transmissions*                ////
 ////                                                                 ////
 ////    can_enable_b_transfer - enables buffer as transmitter        ////
@@ -60,6 +78,9 @@
 ////                                                                 ////
 ////     can_fifo_getd - retrive data in FIFO mode (2)               ////
 ////                                                                 ////
+////     can_fifo_getd_fast - retrive data in FIFO mode (2) with an  ////
+////                          unrolled copy of all 8 data bytes      ////
+////                                                                 ////
 ////     can_t0_putd                                                 ////
 ////     can_t1_putd                                                 ////
 ////     can_t2_putd                                                 ////
@@ -117,8 +138,11 @@
 
 //macros
 #define can_kbhit() (RXB0CON.rxful || RXB1CON.rxful || (B0CONR.rxful && !BSEL0.b0txen) || (B1CONR.rxful && !BSEL0.b1txen) || (B2CONR.rxful && !BSEL0.b2txen) || (B3CONR.rxful && !BSEL0.b3txen) || (B4CONR.rxful && !BSEL0.b4txen) || (B5CONR.rxful && !BSEL0.b5txen))
-#define can_tbe() (!TXB0CON.txreq || !TXB1CON.txreq || !TXB2CON.txreq || (!B0CONT.txreq && BSEL0.b0txen) || (!B1CONT.txreq && BSEL0.b1txen) || (!B2CONT.txreq && BSEL0.b2txen) || (!B3CONT.txreq && BSEL0.b3txen) || (!B4CONT.txreq && BSEL0.b4txen) || (!B5CONT.txreq && BSEL0.b5txen))
+#define can_tbe() (can_tx_free() != 0)
 #define can_abort()                 (CANCON.abat=1)
+#define can_mode_done(mode)         (CANSTAT.opmode==(mode))
+#define can_tx_errors()             (TXERRCNT)
+#define can_rx_errors()             (RXERRCNT)
 
 // current mode variable
 // used by many of the device drivers to prevent damage from the mode
@@ -126,6 +150,34 @@
 int curmode;
 int curfunmode;
 
+// CANSTAT polls the last can_set_mode() took, CAN_MODE_TIMEOUT if mode didn't
+// change
+//
+int16 can_mode_polls;
+
+// set by can_set_mode() when a mode isn't reached, cleared by caller
+//
+int1 can_mode_timedout;
+
+// bit rates can_autobaud() listens at
+//
+const int32 can_autobaud_rates[3]={250000,500000,1000000};
+
+// free transmit buffers when last looked at by can_tx_free(), bit 0 to 2 for
+// TXB0 to TXB2 and bit 3 to 8 for B0 to B5, a buffer can only become free
+// after it's looked at so can_putd() can use a set bit without testing buffer,
+// it's cleared when a mode change or can_enable_b_receiver() takes buffers
+// away
+//
+int16 can_txfree;
+
+// window of each transmit buffer of can_txfree, for modes 1 and 2 and mode 0
+const int8 can_tx_ewin[9]={TX0,TX1,TX2,TXRX0,TXRX1,TXRX2,TXRX3,TXRX4,TXRX5};
+const int8 can_tx_win[3]={CAN_WIN_TX0,CAN_WIN_TX1,CAN_WIN_TX2};
+
+// lowest set bit of a nibble
+const int8 can_tx_first[16]={0,0,1,0,2,0,1,0,3,0,1,0,2,0,1,0};
+
 ////////////////////////////////////////////////////////////////////////
 //
 // can_init()
@@ -142,11 +194,22 @@ int curfunmode;
 // These default values can be overwritten in the main code, but most
 // applications will be fine with these defaults.
 //
+// With CAN_INIT_NORMAL FALSE, CAN is left in Config mode instead of Normal
+// mode, so it doesn't go on the bus before can_autobaud() finds the bit rate.
+//
+// Returns:
+//      int1 - TRUE if CAN was put in Normal mode, or left in Config mode,
+//             FALSE if the bit rate couldn't be set, CAN is left in Disable
+//             mode off the bus
+//
 //////////////////////////////////////////////////////////////////////////////
-void can_init(void) {
+int1 can_init(void) {
+   int1 baud;
+
    can_set_mode(CAN_OP_CONFIG);   //must be in config mode before params can be set
-   can_set_baud();
+   baud=can_set_baud();
    curfunmode=CAN_FUN_OP_LEGACY;
+   can_txfree=0;                  //can_putd() looks at transmit buffers first time
 
    // RXB0CON
    //    filthit0=0
@@ -188,7 +251,15 @@ void can_init(void) {
 
    set_tris_b((*0xF93 & 0xFB ) | 0x08);   //b3 is out, b2 is in
  
+   if (!baud) {
+      can_set_mode(CAN_OP_DISABLE);   //wrong bit rate would put error frames on the bus
+      return(FALSE);
+   }
+
+   #if CAN_INIT_NORMAL
    can_set_mode(CAN_OP_NORMAL);
+   #endif
+   return(TRUE);
 }
 
 ////////////////////////////////////////////////////////////////////////
@@ -269,8 +340,13 @@ void can_init(void) {
 //         6*Tq Phase Segment 2 Time
 //
 // More information can be found in the PIC18F4580 datasheet section 23.9
+//
+// Returns:
+//      int1 - TRUE if registers were set, FALSE if can_set_bit_timing()
+//             couldn't solve them for CAN_BITRATE
+//
 ////////////////////////////////////////////////////////////////////////
-void can_set_baud(void) {
+int1 can_set_baud(void) {
 
    #ifdef Set_1000K_Baud{
       BRGCON1 = 0x00;
@@ -330,7 +406,125 @@ void can_set_baud(void) {
    #define MCP_16MHz_125kBPS_CFG3 (0x86)
    */
 
-   
+   #if !defined(Set_1000K_Baud) && !defined(Set_500K_Baud) && !defined(Set_250K_Baud) && !defined(Set_200K_Baud) && !defined(Set_125K_Baud)
+    #if (getenv("CLOCK") % (2 * CAN_BITRATE)) != 0
+     #error CAN_BITRATE cannot be made from the PIC clock, no whole number of Tq per bit
+    #endif
+      return(can_set_bit_timing(getenv("CLOCK"), CAN_BITRATE, CAN_SAMPLE_POINT));
+   #else
+      return(TRUE);
+   #endif
+}
+
+////////////////////////////////////////////////////////////////////////
+//
+// can_set_bit_timing()
+//
+// Solves the baud rate control registers for a clock and bit rate.  The
+// smallest prescaler giving a whole number of 8 to 25 Tq per bit is
+// used, then propagation and phase segment 1 are split to put the
+// sample point as close to the one asked for as segment limits allow.
+// Synchronized jump width, sampling and wake-up filter are taken from
+// the CAN_BRG defines.  CAN module must be in Config mode.
+//
+// Parameters:
+//      clock - oscillator frequency, Fosc, in Hz
+//      bitrate - bit rate in bits per second
+//      sample - sample point in tenths of percent of the bit time, 500
+//               to 900
+//
+// Returns:
+//      int1 - TRUE if registers were set, FALSE if no prescaler gives a
+//             whole number of Tq for the bit rate
+//
+////////////////////////////////////////////////////////////////////////
+int1 can_set_bit_timing(int32 clock, int32 bitrate, int16 sample) {
+   int32 div;
+   int16 tseg1;
+   int brp,n,ps1,ps2;
+
+   for (brp=0;brp<64;brp++) {
+      div=(int32)2*(brp+1)*bitrate;       // Tq = 2 x (BRP + 1) / Fosc
+      if ((clock/div) < 8)
+         return(FALSE);
+      if (((clock/div) <= 25) && ((clock % div) == 0))
+         break;
+   }
+
+   if (brp>=64)
+      return(FALSE);
+
+   n=clock/div;                        // Tq per bit, Sync segment is 1 Tq
+
+   tseg1=(((int16)n*sample)+500)/1000-1;   // propagation and phase segment 1
+   if (tseg1>16)
+      tseg1=16;
+   if (tseg1>n-3)
+      tseg1=n-3;                       // phase segment 2 at least 2 Tq
+   if (tseg1+9<n)
+      tseg1=n-9;                       // phase segment 2 at most 8 Tq
+
+   ps2=n-1-tseg1;
+   ps1=(tseg1+1)/2;
+
+   BRGCON1.brp=brp;
+   BRGCON1.sjw=CAN_BRG_SYNCH_JUMP_WIDTH;
+
+   BRGCON2.prseg=tseg1-ps1-1;
+   BRGCON2.seg1ph=ps1-1;
+   BRGCON2.sam=CAN_BRG_SAM;
+   BRGCON2.seg2phts=TRUE;              // phase segment 2 freely programmable
+
+   BRGCON3.seg2ph=ps2-1;
+   BRGCON3.wakfil=CAN_BRG_WAKE_FILTER;
+
+   return(TRUE);
+}
+
+////////////////////////////////////////////////////////////////////////
+//
+// can_autobaud()
+//
+// Finds the bit rate of the bus.  Each of can_autobaud_rates[] is
+// tried in Listen mode, so nothing is put on the bus, for
+// CAN_AUTOBAUD_TIME ms, the first rate a valid frame is received at is
+// kept.  Every rate is tried up to CAN_AUTOBAUD_ROUNDS times, then
+// can_set_baud() is used.  Frames are only seen if they pass the
+// acceptance filters.  CAN module is left in Normal mode, with the
+// received frame in its buffer.  Watchdog is restarted every ms while
+// listening.
+//
+// Returns:
+//      int32 - bit rate found, 0 if none was
+//
+////////////////////////////////////////////////////////////////////////
+int32 can_autobaud(void) {
+   int round,i;
+   int16 ms;
+
+   for (round=0;round<CAN_AUTOBAUD_ROUNDS;round++) {
+      for (i=0;i<3;i++) {
+         can_set_mode(CAN_OP_CONFIG);
+         if (!can_set_bit_timing(getenv("CLOCK"),can_autobaud_rates[i],CAN_SAMPLE_POINT))
+            continue;
+         can_set_mode(CAN_OP_LISTEN);
+
+         for (ms=0;ms<CAN_AUTOBAUD_TIME;ms++) {
+            if (can_kbhit()) {
+               can_set_mode(CAN_OP_NORMAL);
+               return(can_autobaud_rates[i]);
+            }
+            restart_wdt();             // whole search can take seconds
+            delay_ms(1);
+         }
+      }
+   }
+
+   can_set_mode(CAN_OP_CONFIG);
+   can_set_baud();
+   can_set_mode(CAN_OP_NORMAL);
+
+   return(0);
 }
 
 
@@ -370,13 +564,148 @@ void can_set_baud(void) {
 // three most significant bits in the CANSTAT register (opmode2:opmode0)
 // must change to reflect the actuall change in mode, therefore a while
 // statement is used to check if the CANSTAT opmode bits have changed to
-// reflect the passed in mode
+// reflect the passed in mode.  The check gives up after CAN_MODE_TIMEOUT
+// polls, so a disconnected transceiver can't hang the program, the number
+// of polls is saved in can_mode_polls and can_mode_timedout is set if
+// it gave up.
 //
 // More information can be found in the PIC18F4580 datasheet section 23.3
 ////////////////////////////////////////////////////////////////////////
 void can_set_mode(CAN_OP_MODE mode) {
+   if (!can_set_mode_timeout(mode,can_mode_polls))
+      can_mode_timedout=TRUE;
+}
+
+////////////////////////////////////////////////////////////////////////
+//
+// can_set_mode_timeout
+//
+// Sets the CAN module into a specific mode the same as can_set_mode(),
+// and reports how long it took.
+//
+// Parameters:
+//      mode - mode to put CAN module in, see can_set_mode()
+//      polls - number of times CANSTAT was polled before the mode
+//              changed, CAN_MODE_TIMEOUT if it didn't
+//
+// Returns:
+//      int1 - TRUE if CAN module is in mode, FALSE if it didn't change
+//             in time
+//
+////////////////////////////////////////////////////////////////////////
+int1 can_set_mode_timeout(CAN_OP_MODE mode, int16 & polls) {
+   CANCON.reqop=mode;
+   can_txfree=0;                 // can_putd() looks at buffers again in new mode
+
+   for(polls=0;polls<CAN_MODE_TIMEOUT;polls++)
+   {
+      if(can_mode_done(mode))
+         return(TRUE);
+   }
+
+   #if CAN_DO_DEBUG
+      can_debug("\r\nCAN_SET_MODE() FAIL: MODE %U NOT REACHED\r\n", mode);
+   #endif
+
+   return(FALSE);
+}
+
+////////////////////////////////////////////////////////////////////////
+//
+// can_request_mode
+//
+// Requests a mode without waiting for it.  The CAN module keeps working
+// in the current mode until the frame on the bus is done, can_mode_done()
+// is TRUE once it's in the requested mode.
+//
+// Parameters:
+//      mode - mode to put CAN module in, see can_set_mode()
+//
+////////////////////////////////////////////////////////////////////////
+void can_request_mode(CAN_OP_MODE mode) {
    CANCON.reqop=mode;
-   while( (CANSTAT.opmode) != mode );
+   can_txfree=0;                 // can_putd() looks at buffers again in new mode
+}
+
+////////////////////////////////////////////////////////////////////////
+//
+// can_error_state
+//
+// Returns the error state of the CAN module from the COMSTAT flags, the
+// error counters themselves are read with can_tx_errors() and
+// can_rx_errors().
+//
+// Returns:
+//      CAN_ERROR_STATE - CAN_ERROR_BUS_OFF, CAN_ERROR_PASSIVE,
+//                        CAN_ERROR_WARNING or CAN_ERROR_ACTIVE
+//
+////////////////////////////////////////////////////////////////////////
+CAN_ERROR_STATE can_error_state(void) {
+   if (COMSTAT.txbo)
+      return(CAN_ERROR_BUS_OFF);
+
+   if (COMSTAT.txbp || COMSTAT.rxbp)
+      return(CAN_ERROR_PASSIVE);
+
+   if (COMSTAT.ewarn)
+      return(CAN_ERROR_WARNING);
+
+   return(CAN_ERROR_ACTIVE);
+}
+
+////////////////////////////////////////////////////////////////////////
+//
+// can_tx_pending
+//
+// Looks at which transmit buffers have a frame waiting to be sent.  B0
+// to B5 are only looked at when they're set as transmit buffers, in
+// modes 1 and 2.  Used before taking the CAN module through Config mode
+// to recover from a bus-off, which resets the error counters instead
+// of waiting for 128 occurrences of 11 recessive bits.
+//
+// Returns:
+//      int16 - bitmap of transmit buffers with a frame waiting, bit 0
+//              to 2 for TXB0 to TXB2 and bit 3 to 8 for B0 to B5
+//
+////////////////////////////////////////////////////////////////////////
+int16 can_tx_pending(void) {
+   int16 txen;
+
+   if (curfunmode==CAN_FUN_OP_LEGACY)
+      txen=0x0007;
+   else
+      txen=((int16)(BSEL0 >> 2) << 3) | 0x0007;   // b0txen to b5txen
+
+   return(~can_tx_free() & txen);
+}
+
+////////////////////////////////////////////////////////////////////////
+//
+// can_tx_requeue
+//
+// Requests transmit buffers be sent again, once the CAN module is back
+// in Normal mode after a bus-off.
+//
+// Parameters:
+//      pending - bitmap of transmit buffers from can_tx_pending()
+//
+////////////////////////////////////////////////////////////////////////
+void can_tx_requeue(int16 pending) {
+   if (bit_test(pending,0)) TXB0CON.txreq=1;
+   if (bit_test(pending,1)) TXB1CON.txreq=1;
+   if (bit_test(pending,2)) TXB2CON.txreq=1;
+   if (bit_test(pending,3)) B0CONT.txreq=1;
+   if (bit_test(pending,4)) B1CONT.txreq=1;
+   if (bit_test(pending,5)) B2CONT.txreq=1;
+   if (bit_test(pending,6)) B3CONT.txreq=1;
+   if (bit_test(pending,7)) B4CONT.txreq=1;
+   if (bit_test(pending,8)) B5CONT.txreq=1;
+
+   can_txfree&=~pending;
+
+   #if CAN_DO_DEBUG
+      can_debug("\r\nCAN_TX_REQUEUE(): %LX BUFFERS REQUESTED AGAIN\r\n", pending);
+   #endif
 }
 
 ////////////////////////////////////////////////////////////////////////
@@ -440,6 +769,7 @@ void can_set_functional_mode(CAN_FUN_OP_MODE mode)
    can_set_mode(CAN_OP_CONFIG);   //must be in config mode before params can be set
    ECANCON.mdsel=mode;
    curfunmode=mode;
+   can_txfree=0;                  //B0 to B5 come and go with functional mode
    can_set_mode(CAN_OP_NORMAL);
 }
 
@@ -697,63 +1027,12 @@ int1 can_putd(int32 id, int * data, int len, int priority, int1 ext, int1 rtr) {
 
    txd0=&TXRXBaD0;
 
-    // find emtpy transmitter
-    // map access bank addresses to empty transmitter
-   if (!TXB0CON.txreq) 
-   {
-      if(curfunmode==CAN_FUN_OP_LEGACY)
-         CANCON.win=CAN_WIN_TX0;
-      else
-         ECANCON.ewin=TX0;
-      port=0;
-   }
-   else if (!TXB1CON.txreq)
-   {
-      if(curfunmode==CAN_FUN_OP_LEGACY)
-         CANCON.win=CAN_WIN_TX1;
-      else
-         ECANCON.ewin=TX1;
-      port=1;
-   }
-   else if (!TXB2CON.txreq) 
-   {
-      if(curfunmode==CAN_FUN_OP_LEGACY)
-         CANCON.win=CAN_WIN_TX2;
-      else
-         ECANCON.ewin=TX2;
-      port=2;
-   }
-   else if (!B0CONT.txreq && BSEL0.b0txen) 
-   {
-      ECANCON.ewin=TXRX0;
-      port=3;
-   }
-   else if (!B1CONT.txreq && BSEL0.b1txen) 
-   {
-      ECANCON.ewin=TXRX1;
-      port=4;
-   }
-   else if (!B2CONT.txreq && BSEL0.b2txen) 
-   {
-      ECANCON.ewin=TXRX2;
-      port=5;
-   }
-   else if (!B3CONT.txreq && BSEL0.b3txen) 
-   {
-      ECANCON.ewin=TXRX3;
-      port=6;
-   }
-   else if (!B4CONT.txreq && BSEL0.b4txen) 
-   {
-      ECANCON.ewin=TXRX4;
-      port=7;
-   }
-   else if (!B5CONT.txreq && BSEL0.b5txen) 
-   {
-      ECANCON.ewin=TXRX5;
-      port=8;
-   }
-   else 
+   // find emtpy transmitter, buffers are only tested if none were free
+   // when can_tbe() or can_tx_free() last looked
+   if (can_txfree==0)
+      can_tx_free();
+
+   if (can_txfree==0)
    {
       #if CAN_DO_DEBUG
          can_debug("\r\nCAN_PUTD() FAIL: NO OPEN TX BUFFERS\r\n");
@@ -761,6 +1040,21 @@ int1 can_putd(int32 id, int * data, int len, int priority, int1 ext, int1 rtr) {
       return(0);
    }
 
+   if (make8(can_txfree,0) & 0x0F)
+      port=can_tx_first[make8(can_txfree,0) & 0x0F];
+   else if (make8(can_txfree,0))
+      port=can_tx_first[make8(can_txfree,0) >> 4] + 4;
+   else
+      port=8;
+
+   bit_clear(can_txfree,port);
+
+   // map access bank addresses to empty transmitter
+   if(curfunmode==CAN_FUN_OP_LEGACY)
+      CANCON.win=can_tx_win[port];
+   else
+      ECANCON.ewin=can_tx_ewin[port];
+
    //set priority.
    TXBaCON.txpri=priority;
 
@@ -801,6 +1095,44 @@ int1 can_putd(int32 id, int * data, int len, int priority, int1 ext, int1 rtr) {
    return(1);
 }
 
+////////////////////////////////////////////////////////////////////////
+//
+// can_tx_free()
+//
+// Looks at all transmit buffers once and saves which are free in
+// can_txfree, can_putd() then uses a free buffer without testing them
+// again.  can_tbe() calls it.
+//
+//    Returns:
+//       bitmap of free transmit buffers, bit 0 to 2 for TXB0 to TXB2
+//       and bit 3 to 8 for B0 to B5 set as transmit buffers
+//
+////////////////////////////////////////////////////////////////////////
+int16 can_tx_free(void)
+{
+   int b;
+
+   if (curfunmode==CAN_FUN_OP_LEGACY)
+      b=0;              // B0 to B5 only in modes 1 and 2
+   else
+      b=BSEL0 >> 2;     // b0txen to b5txen
+
+   if (B0CONT.txreq) bit_clear(b,0);
+   if (B1CONT.txreq) bit_clear(b,1);
+   if (B2CONT.txreq) bit_clear(b,2);
+   if (B3CONT.txreq) bit_clear(b,3);
+   if (B4CONT.txreq) bit_clear(b,4);
+   if (B5CONT.txreq) bit_clear(b,5);
+
+   can_txfree=(int16)b << 3;
+
+   if (!TXB0CON.txreq) bit_set(can_txfree,0);
+   if (!TXB1CON.txreq) bit_set(can_txfree,1);
+   if (!TXB2CON.txreq) bit_set(can_txfree,2);
+
+   return(can_txfree);
+}
+
 ////////////////////////////////////////////////////////////////////////
 //
 // can_getd()
@@ -1107,6 +1439,8 @@ void can_enable_b_receiver(PROG_BUFFER b)
    temp&=~b;
    
    BSEL0=temp;
+   
+   can_txfree&=~((int16)(b >> 2) << 3);   //buffers can't be used by can_putd() anymore
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -1524,6 +1858,64 @@ int1 can_fifo_getd(int32 & id, int * data, int &len, struct rx_stat & stat )
    return(1);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// can_fifo_getd_fast
+//
+// Retreives data in Mode 2 the same as can_fifo_getd(), but copies all 8 data
+// bytes without a loop whatever the length is, so data must hold 8 bytes.  The
+// FIFO pointer selects the window of the buffer to read, so no receive buffer
+// is tested, and can_kbhit() isn't needed before it's called.
+//
+// Parameters:
+//      id - The ID of the sender
+//      data - Address of the array to store the data in, 8 bytes
+//      len - number of data bytes received
+//      stat - status structure to return infromation about the receive register
+//
+// Returns:
+//      int1 - TRUE if there was data in the buffer, FALSE if there wasn't
+//
+////////////////////////////////////////////////////////////////////////////////
+int1 can_fifo_getd_fast(int32 & id, int * data, int &len, struct rx_stat & stat )
+{
+   if(!COMSTAT_MODE_2.fifoempty)          // if there is no data in the buffer
+      return(0);                          // return false;
+
+   stat.buffer=CANCON_MODE_2.fp;
+   ECANCON.ewin=stat.buffer | 0x10;       // window of buffer FIFO pointer points to
+
+   stat.err_ovfl=COMSTAT_MODE_2.rxnovfl;
+   stat.filthit=RXB0CON_MODE_2.filthit;
+
+   len = RXBaDLC.dlc;
+   stat.rtr=RXBaDLC.rtr;
+
+   stat.ext=TXRXBaSIDL.ext;
+   id=can_get_id(TXRXBaID,stat.ext);
+
+   data[0]=TXRXBaD0;
+   data[1]=TXRXBaD1;
+   data[2]=TXRXBaD2;
+   data[3]=TXRXBaD3;
+   data[4]=TXRXBaD4;
+   data[5]=TXRXBaD5;
+   data[6]=TXRXBaD6;
+   data[7]=TXRXBaD7;
+
+   RXB0CON_MODE_2.rxful=0;                // only buffer in window is released
+   
+   CAN_INT_RXB1IF=0;
+
+   // return to default addressing
+   ECANCON.ewin=RX0;
+
+   stat.inv=CAN_INT_IRXIF;
+   CAN_INT_IRXIF = 0;
+
+   return(1);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // can_t0_putd - can_t2_putd
@@ -1577,6 +1969,7 @@ int1 can_t0_putd(int32 id, int * data, int len, int pri, int1 ext, int1 rtr)
       data++;
    }
 
+   bit_clear(can_txfree,0);     // buffer no longer free
    TXB0CON.txreq = 1;
 
    return ( TRUE );
@@ -1607,6 +2000,7 @@ int1 can_t1_putd(int32 id, int * data, int len, int pri, int1 ext, int1 rtr)
       data++;
    }
 
+   bit_clear(can_txfree,1);     // buffer no longer free
    TXB1CON.txreq = 1;
 
    return ( TRUE );
@@ -1637,6 +2031,7 @@ int1 can_t2_putd(int32 id, int * data, int len, int pri, int1 ext, int1 rtr)
       data++;
    }
 
+   bit_clear(can_txfree,2);     // buffer no longer free
    TXB2CON.txreq = 1;
 
    return ( TRUE );
@@ -1672,6 +2067,7 @@ int1 can_b0_putd(int32 id, int * data, int len, int pri, int1 ext, int1 rtr)
     }
 
    //enable transmission
+   bit_clear(can_txfree,3);     // buffer no longer free
    TXBaCON.txreq=1;
    
    // return to default addressing
@@ -1711,6 +2107,7 @@ int1 can_b1_putd(int32 id, int * data, int len, int pri, int1 ext, int1 rtr)
     }
 
    //enable transmission
+   bit_clear(can_txfree,4);     // buffer no longer free
    TXBaCON.txreq=1;
    
    // return to default addressing
@@ -1749,6 +2146,7 @@ int1 can_b2_putd(int32 id, int * data, int len, int pri, int1 ext, int1 rtr)
     }
 
    //enable transmission
+   bit_clear(can_txfree,5);     // buffer no longer free
    TXBaCON.txreq=1;
    
    // return to default addressing
@@ -1787,6 +2185,7 @@ int1 can_b3_putd(int32 id, int * data, int len, int pri, int1 ext, int1 rtr)
     }
 
    //enable transmission
+   bit_clear(can_txfree,6);     // buffer no longer free
    TXBaCON.txreq=1;
    
    // return to default addressing
@@ -1826,6 +2225,7 @@ int1 can_b4_putd(int32 id, int * data, int len, int pri, int1 ext, int1 rtr)
     }
 
    //enable transmission
+   bit_clear(can_txfree,7);     // buffer no longer free
    TXBaCON.txreq=1;
    
    // return to default addressing
@@ -1872,6 +2272,7 @@ int1 can_b5_putd(int32 id, int * data, int len, int pri, int1 ext, int1 rtr)
    printf("\n\r\n\r");
 
    //enable transmission
+   bit_clear(can_txfree,8);     // buffer no longer free
    TXBaCON.txreq=1;
    
    // return to default addressing
@@ -59,10 +59,34 @@
  #define CAN_BRG_PHASE_SEGMENT_2 5 //phase segment 2 time select (def: 6 x Tq)
 #endif
 
+#ifndef CAN_BITRATE
+ #define CAN_BITRATE 250000   //bit rate can_set_baud() solves bit timing for when no Set_xxxK_Baud is defined
+#endif
+
+#ifndef CAN_SAMPLE_POINT
+ #define CAN_SAMPLE_POINT 875   //sample point in tenths of percent of the bit time (def: 87.5%)
+#endif
+
+#ifndef CAN_AUTOBAUD_TIME
+ #define CAN_AUTOBAUD_TIME 250   //ms can_autobaud() listens at each bit rate for a valid frame
+#endif
+
+#ifndef CAN_AUTOBAUD_ROUNDS
+ #define CAN_AUTOBAUD_ROUNDS 4   //times can_autobaud() tries every bit rate before giving up
+#endif
+
+#ifndef CAN_INIT_NORMAL
+ #define CAN_INIT_NORMAL TRUE   //can_init() puts CAN in Normal mode, FALSE leaves it in Config mode, eg for can_autobaud()
+#endif
+
 #ifndef CAN_USE_RX_DOUBLE_BUFFER
  #define CAN_USE_RX_DOUBLE_BUFFER TRUE   //if buffer 0 overflows, do NOT use buffer 1 to put buffer 0 data
 #endif
 
+#ifndef CAN_MODE_TIMEOUT
+ #define CAN_MODE_TIMEOUT 20000   //most times can_set_mode() polls CANSTAT for the mode to change, about 16ms at 40MHz
+#endif
+
 #ifndef CAN_ENABLE_DRIVE_HIGH
  #define CAN_ENABLE_DRIVE_HIGH 0
 #endif
@@ -89,6 +113,11 @@ enum CAN_OP_MODE {   CAN_OP_CONFIG=4,
                      CAN_OP_DISABLE=1,
                      CAN_OP_NORMAL=0 };
 
+enum CAN_ERROR_STATE { CAN_ERROR_ACTIVE=0,     //error counters below 96
+                       CAN_ERROR_WARNING=1,    //an error counter at 96 or more
+                       CAN_ERROR_PASSIVE=2,    //an error counter at 128 or more
+                       CAN_ERROR_BUS_OFF=3 };  //transmit error counter at 256, off the bus
+
 enum CAN_FUN_OP_MODE { CAN_FUN_OP_LEGACY=0,
                        CAN_FUN_OP_ENHANCED=1,
                        CAN_FUN_OP_ENHANCED_FIFO=2 };
@@ -872,6 +901,12 @@ struct rxbNdlc_struct RXBaDLC;
 #byte RXB0D0=0xF66
 #byte RXB0D7=0xF6D
 #byte TXRXBaD0=0xF66
+#byte TXRXBaD1=0xF67
+#byte TXRXBaD2=0xF68
+#byte TXRXBaD3=0xF69
+#byte TXRXBaD4=0xF6A
+#byte TXRXBaD5=0xF6B
+#byte TXRXBaD6=0xF6C
 #byte TXRXBaD7=0xF6D
 
 //receive error count
@@ -1001,13 +1036,21 @@ struct rx_stat {
    int1 inv;         // invalid id?
 };
 
-void  can_init(void);
-void  can_set_baud(void);
+int1  can_init(void);
+int1  can_set_baud(void);
+int1  can_set_bit_timing(int32 clock, int32 bitrate, int16 sample);
+int32 can_autobaud(void);
 void  can_set_mode(CAN_OP_MODE mode);
+int1  can_set_mode_timeout(CAN_OP_MODE mode, int16 & polls);
+void  can_request_mode(CAN_OP_MODE mode);
+CAN_ERROR_STATE can_error_state(void);
+int16 can_tx_pending(void);
+void  can_tx_requeue(int16 pending);
 void  can_set_functional_mode(CAN_FUN_OP_MODE mode);
 void  can_set_id(int* addr, int32 id, int1 ext);
 int32 can_get_id(int * addr, int1 ext);
 int   can_putd(int32 id, int * data, int len, int priority, int1 ext, int1 rtr);
+int16 can_tx_free(void);
 int1  can_getd(int32 & id, int * data, int & len, struct rx_stat & stat);
 void  can_enable_rtr(PROG_BUFFER b);
 void  can_disable_rtr(PROG_BUFFER b);
@@ -1017,5 +1060,6 @@ void can_disable_filter(long filter);
 void can_associate_filter_to_buffer(CAN_FILTER_ASSOCIATION_BUFFERS buffer, CAN_FILTER_ASSOCIATION filter);
 void can_associate_filter_to_mask(CAN_MASK_FILTER_ASSOCIATE mask, CAN_FILTER_ASSOCIATION filter);
 int1 can_fifo_getd(int32 & id,int * data,int &len,struct rx_stat & stat);
+int1 can_fifo_getd_fast(int32 & id,int * data,int &len,struct rx_stat & stat);
 
 #endif
@@ -18,6 +18,8 @@
 //// J1939Kbhit() - Checks for new messages in J1939 receive buffer.        ////
 ////                                                                        ////
 //// J1939GetMessage() - Retrieves new message from J1939 receive buffer.   ////
+////                     With J1939_TIMESTAMP it can also return the time   ////
+////                     message was received.                              ////
 ////                                                                        ////
 //// J1939PutMessage() - Loads message into J1939 transmit buffer.          ////
 ////                                                                        ////
@@ -25,6 +27,61 @@
 ////                         been claimed.  Use address global address 255  ////
 ////                         to receive a list of all claimed address.      ////
 ////                                                                        ////
+//// J1939GetClaimStats() - Copies Address Claim statistics of a controller ////
+////                        application, for measuring claim storms.        ////
+////                                                                        ////
+//// J1939TPKbhit() - Checks for a packeted message received with the       ////
+////                  Transport Protocol (BAM or RTS/CTS) or Fast Packet.   ////
+////                                                                        ////
+//// J1939TPGetMessage() - Retrieves packeted message received with the     ////
+////                       Transport Protocol.                              ////
+////                                                                        ////
+//// J1939TPPoolPeak() - Returns highest number of Transport Protocol pool  ////
+////                     blocks that were in use at same time.              ////
+////                                                                        ////
+//// J1939TPRegisterSink() - Registers a function that packets of a PGN     ////
+////                         received with the Transport Protocol are       ////
+////                         streamed to instead of being stored.           ////
+////                                                                        ////
+//// J1939Subscribe() - Subscribes to a PDU2 PGN, broadcast messages of     ////
+////                    other PGNs are dropped, in the CAN acceptance       ////
+////                    filters when they fit.                              ////
+////                                                                        ////
+//// J1939SubscribeHandler() - Subscribes to a PDU2 PGN with a function     ////
+////                            its messages are passed to.                 ////
+////                                                                        ////
+//// J1939Unsubscribe() - Unsubscribes from a PDU2 PGN.                     ////
+////                                                                        ////
+//// J1939AcceptFormat() - Sets if messages of a PDU Format are put in the  ////
+////                       J1939 receive buffer.                            ////
+////                                                                        ////
+//// J1939Accept() - Accepts messages of a PDU Format with one PDU Specific ////
+////                 value, Destination Address or Group Extension.         ////
+////                                                                        ////
+//// J1939FPRegister() - Registers a PDU2 PGN as Fast Packet, its frames    ////
+////                     are reassembled instead of being put in the J1939  ////
+////                     receive buffer.                                    ////
+////                                                                        ////
+//// J1939FPUnregister() - Unregisters a Fast Packet PGN.                   ////
+////                                                                        ////
+//// J1939FPPutMessage() - Loads a Fast Packet message to be sent in frames ////
+////                       by J1939XmitTask().                              ////
+////                                                                        ////
+//// J1939LookupAddress() - Looks up the Name of the node at an address in  ////
+////                        the address table.                              ////
+////                                                                        ////
+//// J1939LookupName() - Looks up the address of a node by its Name in the  ////
+////                     address table.                                     ////
+////                                                                        ////
+//// J1939TimerStart() - Starts or restarts a timer on the timer wheel.     ////
+////                                                                        ////
+//// J1939TimerStop() - Stops a timer.                                      ////
+////                                                                        ////
+//// J1939TimerRunning() - Checks if a timer is running.                    ////
+////                                                                        ////
+//// J1939SetBusCallback() - Sets function called when CAN error state      ////
+////                         changes.                                       ////
+////                                                                        ////
 ////  Requires:                                                             ////
 ////     J1939InitAddress - Macro to initialize the g_MyJ1939Adddress       ////
 ////                        variable, which is the preferred J1939 address  ////
@@ -33,6 +90,10 @@
 ////     J1939InitName - Macro to initialize the g_J1939Name array, which   ////
 ////                     is J1939 Name of this unit.                        ////
 ////                                                                        ////
+////     With J1939_CONTROLLER_APPS more than 1 the macros initialize the   ////
+////     Address and Name of each g_J1939CA[] entry instead, entry 0 is     ////
+////     g_MyJ1939Address and g_J1939Name.                                  ////
+////                                                                        ////
 ////   Driver also requires a tick timer with the following macros and      ////
 ////   defines.  The tick timer should be setup for a rate of 1 tick per    ////
 ////   millisecond or faster.                                               ////
@@ -76,6 +137,18 @@
  #include <can-mcp251x.c>     //External CAN Controller
 #endif
 
+#if J1939_ECAN_MODE1 == TRUE
+//ECAN filters 6 to 15, used for staged address filters, by controller applications 1 and up
+//or for subscribed PGNs
+const uint16_t g_J1939FilterRegister[10] = {RXFILTER6, RXFILTER7, RXFILTER8, RXFILTER9, RXFILTER10,
+                                           RXFILTER11, RXFILTER12, RXFILTER13, RXFILTER14, RXFILTER15};
+#endif
+
+#if J1939_PGN_FILTERS > 0
+//ECAN filters 2 to 5, Mask 1 filters used for subscribed PGNs
+const uint16_t g_J1939PGNFilterRegister[4] = {RXFILTER2, RXFILTER3, RXFILTER4, RXFILTER5};
+#endif
+
 ////////////////////////////////////////////////////////////////////////////////  API
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -83,18 +156,91 @@
 // Initializes the CAN for J1939 Baud Rate and sets up the CAN filters, and 
 // initial J1939 Address Claim.
 //  Parameters: None
-//  Returns:    Nothing
+//  Returns:    True - if CAN reached every mode it was put in
+//              False - if CAN didn't reach Config mode, filters may not be
+//                      set, or Normal mode, J1939XmitTask() keeps asking
+//                      for it, or if the bit rate couldn't be set, CAN is
+//                      left disabled off the bus
+// With J1939_AUTOBAUD TRUE, doesn't return until a frame is received or every
+// bit rate has been tried, up to CAN_AUTOBAUD_ROUNDS x 3 x CAN_AUTOBAUD_TIME ms.
 ////////////////////////////////////////////////////////////////////////////////
-void J1939Init(void)
+int1 J1939Init(void)
 {
+   uint8_t CA;
+  #if J1939_PGN_FILTERS > 4
+   uint8_t Filter;
+  #endif
+   
    memset(&g_J1939Flags,0,sizeof(J1939_FLAGS_STRUCT));   //clear the J1939 Flag structure
    
+   for(CA=0;CA<J1939_CONTROLLER_APPS;CA++)
+   {
+      g_J1939CA[CA].ClaimState = J1939_CLAIM_IDLE;
+      g_J1939CA[CA].ClaimPending = FALSE;
+   }
+   
+  #if J1939_FILTER_TASK == TRUE
+   g_J1939FilterPending = 0;
+  #endif
+  
+  #if J1939_BUS_MONITOR == TRUE
+   g_J1939BusCallback = 0;
+   g_J1939BusState = CAN_ERROR_ACTIVE;
+   g_J1939BusStateTick = J1939GetTick();
+   g_J1939BusBackoff = J1939_BUS_OFF_BACKOFF;
+   g_J1939PassiveXmitTick = J1939GetTick();
+   g_J1939BusOffs = 0;
+   g_J1939BusRecover = J1939_BUS_RECOVER_NONE;
+  #endif
+   
+  #if J1939_CLAIM_STATS == TRUE
+   memset(g_J1939ClaimStats,0,sizeof(g_J1939ClaimStats));
+  #endif
+  #if J1939_ACCEPT_FILTER == TRUE
+   memset(g_J1939AcceptPF,0xFF,sizeof(g_J1939AcceptPF));    //every PDU Format accepted until application changes it
+  #endif
+  #if J1939_SUBSCRIBED_PGNS > 0
+   g_J1939SubscribedCount = 0;   //every broadcast PGN received until application subscribes
+   g_J1939PGNFiltersDirty = FALSE;
+   #if J1939_PGN_FILTERS > 0
+   memset(g_J1939FilterHandler,0,sizeof(g_J1939FilterHandler));
+   #endif
+  #endif
+   
    J1939InitAddress();  //Initialize unit's J1939 Preferred Address
    J1939InitName();     //Initialize unit's J1939 Name
    
    rand_seed = 128;  //Initialize random generator seed number
+   
+   memset(g_J1939AddressUsed,0,sizeof(g_J1939AddressUsed));
+   J1939AddressSeedInit();    //Seed arbitrary address generator from unit's Name
+  #ifdef J1939_EEPROM_ADDRESS
+   J1939EepromLoad();   //Start from last claimed address if Arbitrary Address Capable
+  #endif
+  #if J1939_CONTROLLER_APPS > 1
+   J1939AddressCAUpdate();
+  #endif
+   
+   J1939TimerInit(); //Stop all timers and start timer wheel at current tick
+   
+   g_J1939Commanded.Source = J1939_NULL_ADDRESS;   //no Commanded Address BAM being received
+   
+  #if J1939_ADDRESS_TABLE_SIZE > 0
+   J1939AddressTableInit();   //Empty address table of other nodes
+  #endif
 
+  #if J1939_TP_SESSIONS > 0
+   J1939TPInit();    //Initialize Transport Protocol sessions and buffer pool
+  #endif
+
+  #if J1939_MODE_TASK == TRUE
+   can_mode_timedout = FALSE;
+   
+   if(can_init() == FALSE)    //Initialize the CAN, sets up Baud Rate and puts it in normal mode
+      return(FALSE);          //bit rate couldn't be made from the clock, CAN left disabled
+  #else
    can_init();    //Initialize the CAN, sets up Baud Rate and puts it in normal mode
+  #endif
    
    #if (USE_INTERNAL_CAN == TRUE)
     #if defined(__PCD__)  //dsPIC30
@@ -104,7 +250,7 @@ void J1939Init(void)
       
       can_set_mode(CAN_OP_CONFIG);  //put CAN in Config mode
       
-      can_set_id(&C1RXM0, 0x0000FF00, CAN_MASK_ACCEPT_ALL);    //Set Mask 0 to look at Destination Address of PDU
+      can_set_id(&C1RXM0, J1939_DESTINATION_MASK, CAN_MASK_ACCEPT_ALL);    //Set Mask 0 to look at Destination Address of PDU
       can_set_id(&C1RXM1, 0x00F00000, CAN_MASK_ACCEPT_ALL);    //Set Mask 1 to look at upper nibble of PDU Format
       
       can_set_id(&C1RXF0, 0x0000FF00, CAN_USE_EXTENDED_ID);    //Filter 0 set to look for messages to the Global Address 255
@@ -118,7 +264,7 @@ void J1939Init(void)
      #else //PIC24 and dsPIC33
       //Initialize the CAN filters, each function puts CAN in config mode
       //makes changes and puts back in normal mode
-      can_set_id(&C1RXM0, 0x0000FF00, CAN_USE_EXTENDED_ID);    //Set Mask 0 to look at Destination Address of PDU
+      can_set_id(&C1RXM0, J1939_DESTINATION_MASK, CAN_USE_EXTENDED_ID);    //Set Mask 0 to look at Destination Address of PDU
       can_set_id(&C1RXM1, 0x00F00000, CAN_USE_EXTENDED_ID);    //Set Mask 1 to look at upper nibble of PDU Format
       
       can_set_id(&C1RXF0, 0x0000FF00, CAN_USE_EXTENDED_ID);    //Filter 0 set to look for messages to the Global Address 255
@@ -143,7 +289,7 @@ void J1939Init(void)
     #else //PIC18
       can_set_mode(CAN_OP_CONFIG);  //put CAN in Config mode
     
-      can_set_id(RX0MASK, 0x0000FF00, CAN_USE_EXTENDED_ID);       //Set Mask 0 to look at Destination Address of PDU
+      can_set_id(RX0MASK, J1939_DESTINATION_MASK, CAN_USE_EXTENDED_ID);       //Set Mask 0 to look at Destination Address of PDU
       can_set_id(RX1MASK, 0x00F00000, CAN_USE_EXTENDED_ID);       //Set Mask 1 to look at upper nibble of PDU Format
       
       can_set_id(RXFILTER0, 0x0000FF00, CAN_USE_EXTENDED_ID);     //Filter 0 set to look for messages to the Global Address 255
@@ -163,12 +309,52 @@ void J1939Init(void)
       can_set_id(RXFILTER14, 0x00F00000, CAN_USE_EXTENDED_ID);    //Filter 14 set to look for Broadcast messages PDU 240 to 255
       can_set_id(RXFILTER15, 0x00F00000, CAN_USE_EXTENDED_ID);    //Filter 15 set to look for Broadcast messages PDU 240 to 255
       
+     #if J1939_ECAN_MODE1 == TRUE
+      can_set_mode(CAN_OP_NORMAL);
+      #if J1939_ECAN_FIFO == TRUE
+      can_set_functional_mode(CAN_FUN_OP_ENHANCED_FIFO);          //Mode 2 for filters 6 to 15, receive buffers B0 to B5 in FIFO
+      #else
+      can_set_functional_mode(CAN_FUN_OP_ENHANCED);               //Mode 1 for filters 6 to 15 and filter hit in can_getd()
+      #endif
+      can_set_mode(CAN_OP_CONFIG);
+      
+      //each call stays in Config mode because it returns CAN to the mode it was in
+      can_associate_filter_to_mask(ACCEPTANCE_MASK_0, F0BP);      //Associate Mask 0 with filter 0
+      can_associate_filter_to_mask(ACCEPTANCE_MASK_0, F1BP);      //Associate Mask 0 with filter 1
+      can_associate_filter_to_mask(ACCEPTANCE_MASK_1, F2BP);      //Associate Mask 1 with filter 2
+      can_associate_filter_to_mask(ACCEPTANCE_MASK_1, F3BP);      //Associate Mask 1 with filter 3
+      can_associate_filter_to_mask(ACCEPTANCE_MASK_1, F4BP);      //Associate Mask 1 with filter 4
+      can_associate_filter_to_mask(ACCEPTANCE_MASK_1, F5BP);      //Associate Mask 1 with filter 5
+      #if J1939_STAGED_FILTERS > 0
+      J1939StageFilters(g_MyJ1939Address);                        //Filters 6 and up loaded with preferred and arbitrary addresses
+      #else
+      for(CA=1;CA<J1939_CONTROLLER_APPS;CA++)
+      {
+         can_set_id((int *)g_J1939FilterRegister[CA - 1], 0x0000FF00, CAN_USE_EXTENDED_ID);   //Filters 6 and up look for Global Address 255 until their controller application claims an address
+         can_associate_filter_to_mask(ACCEPTANCE_MASK_0, (CAN_FILTER_ASSOCIATION)(CA + 5));
+      }
+      
+      can_disable_filter(~((((uint16_t)1 << (J1939_CONTROLLER_APPS + 5)) - 1) | J1939_PGN_FILTER_ENABLE));     //Filters after the last controller application's disabled
+      can_enable_filter((((uint16_t)1 << (J1939_CONTROLLER_APPS + 5)) - 1));         //Filters 0 to 5 and the controller applications' enabled
+      #endif
+      #if J1939_PGN_FILTERS > 4
+      for(Filter=J1939_PGN_FILTER_FIRST;Filter<16;Filter++)
+         can_associate_filter_to_mask(ACCEPTANCE_MASK_1, (CAN_FILTER_ASSOCIATION)Filter);   //Spare filters look for Broadcast messages until PGNs are subscribed to
+      
+      can_enable_filter(J1939_PGN_FILTER_ENABLE);
+      #endif
+     #endif
+      
+     #if J1939_AUTOBAUD == TRUE
+      g_J1939BaudRate = can_autobaud();     //listen at each bit rate with filters set, leaves CAN in Normal mode
+     #else
       can_set_mode(CAN_OP_NORMAL);  //put CAN in Normal mode
+     #endif
     #endif
    #else //External CAN Controller
       can_set_mode(CAN_OP_CONFIG);     //put CAN in Config mode
       
-      can_set_id(RX0MASK, 0x0000FF00, CAN_USE_EXTENDED_ID);       //Set Mask 0 to look at Destination Address of PDU
+      can_set_id(RX0MASK, J1939_DESTINATION_MASK, CAN_USE_EXTENDED_ID);       //Set Mask 0 to look at Destination Address of PDU
       can_set_id(RX1MASK, 0x00F00000, CAN_USE_EXTENDED_ID);       //Set Mask 1 to look at upper nibble of PDU Format
       
       can_set_id(RX0FILTER0, 0x0000FF00, CAN_USE_EXTENDED_ID);    //Filter 0 set to look for messages to the Global Address 255
@@ -181,7 +367,14 @@ void J1939Init(void)
       can_set_mode(CAN_OP_NORMAL);     //put CAN in Normal mode
    #endif
    
-   J1939ClaimAddress();  //Attempt to Claim unit's address
+   for(CA=0;CA<J1939_CONTROLLER_APPS;CA++)
+      J1939ClaimAddress(CA);  //Attempt to Claim unit's address
+   
+  #if J1939_MODE_TASK == TRUE
+   return(can_mode_timedout == FALSE);
+  #else
+   return(TRUE);
+  #endif
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -204,96 +397,205 @@ void J1939ReceiveTask(void)
    uint8_t Data[8];
    uint8_t length;
    struct rx_stat Status;
+  #if J1939_SUBSCRIBED_PGNS > 0
+   J1939_PGN_HANDLER Handler;
+  #endif
    
    rand_seed++;
    
+  #if J1939_ECAN_FIFO == TRUE
+   while(can_fifo_getd_fast(ReceivedPDU,Data,length,Status))    //FIFO pointer gives buffer, no need to test each one
+   {
+  #else
    while(can_kbhit())
    {
       can_getd(ReceivedPDU,Data,length,Status);
+  #endif
+      
+     #if J1939_TIMESTAMP != J1939_TIMESTAMP_NONE
+      g_J1939ReceiveTime.Tick = J1939GetTick();
+      #if J1939_TIMESTAMP == J1939_TIMESTAMP_CAPTURE
+      g_J1939ReceiveTime.Capture = CCP_1;    //CAN capture of latest start of frame
+      #endif
+     #endif
+      
+     #if J1939_ADDRESS_TABLE_SIZE > 0
+      J1939AddressTableSeen(ReceivedPDU.SourceAddress);
+     #endif
       
-      if(g_J1939Flags.ReceiveBufferCount < J1939_RECEIVE_BUFFERS)
+      if((ReceivedPDU.SourceAddress < J1939_NULL_ADDRESS) && (J1939AddressCA(ReceivedPDU.SourceAddress) == J1939_CA_NONE))
+         J1939AddressUse(ReceivedPDU.SourceAddress);
+      
+     #if J1939_PGN_FILTERS > 0
+      //Handlers are only loaded for filters holding one subscribed PDU2 PGN, which
+      //can't be a Fast Packet PGN, so a hit isn't a staged address filter and
+      //there is no destination to check, the handler can be called first.
+      Handler = g_J1939FilterHandler[Status.filthit & 0x0F];
+      
+      #if J1939_ACCEPT_FILTER == TRUE
+      if(J1939AcceptState(ReceivedPDU.PDUFormat) != J1939_ACCEPT_ALL)
+         Handler = 0;   //accept stage below decides
+      #endif
+      
+      if(Handler != 0)
       {
-         switch(ReceivedPDU.PDUFormat)
-         {
-            case J1939_PF_ADDR_CLAIMED:
-               J1939HandleAddressClaim(ReceivedPDU,Data);
-               
-               if((ReceivedPDU.SourceAddress != g_MyJ1939Address) && (ReceivedPDU.SourceAddress != J1939_NULL_ADDRESS))
-               {
-                  J1939LoadReceiveBuffer(ReceivedPDU,Data,length);  //so you can keep a list of J1939Names to J1939Addresses, if desired
-               }
+         (*Handler)(&ReceivedPDU,Data,length);    //filter only accepts subscribed PGN, no need to look it up
+         continue;
+      }
+     #endif
+      
+     #if J1939_STAGED_FILTERS > 0
+      if((Status.filthit >= J1939_FILTER_FIRST) && (Status.filthit < J1939_FILTER_FIRST + J1939_STAGED_FILTERS) &&
+         ((g_J1939StagedActive == J1939_FILTER_NONE) || (Status.filthit != J1939_FILTER_FIRST + g_J1939StagedActive)))
+         continue;   //sent to a staged address unit doesn't own
+     #endif
+      
+     #if J1939_ACCEPT_FILTER == TRUE
+      if((ReceivedPDU.PDUFormat >= 240) && (J1939AcceptState(ReceivedPDU.PDUFormat) != J1939_ACCEPT_ALL) &&
+         (J1939Accepted(ReceivedPDU.PDUFormat,ReceivedPDU.DestinationAddress) == FALSE))
+         continue;   //application didn't accept message, dropped before its PGN is looked up
+     #endif
+      
+     #if J1939_SUBSCRIBED_PGNS > 0
+      if((ReceivedPDU.PDUFormat >= 240) && (J1939Subscribed(J1939GetPGN(ReceivedPDU)) == FALSE))
+         continue;   //broadcast PGN application didn't subscribe to
+     #endif
+      
+     #if J1939_CONTROLLER_APPS > 1
+      if((ReceivedPDU.PDUFormat < 240) && (ReceivedPDU.DestinationAddress != J1939_GLOBAL_ADDRESS) && 
+         (J1939OwnAddress(ReceivedPDU.DestinationAddress) == FALSE))
+         continue;   //sent to an address no controller application owns
+     #endif
+      
+      if(((ReceivedPDU.PDUFormat == J1939_PF_PT_CM) || (ReceivedPDU.PDUFormat == J1939_PF_PT_DT)) && (length == 8) &&
+         J1939CommandedReceive(ReceivedPDU,Data))
+         continue;   //packet of a Commanded Address BAM
+      
+      switch(ReceivedPDU.PDUFormat)
+      {
+         case J1939_PF_ADDR_CLAIMED:
+            J1939HandleAddressClaim(ReceivedPDU,Data);
+            
+           #if J1939_ADDRESS_TABLE_SIZE > 0
+            if((J1939AddressCA(ReceivedPDU.SourceAddress) == J1939_CA_NONE) && (length == 8))
+               J1939AddressTableClaim(ReceivedPDU.SourceAddress,Data);  //keeps list of J1939Names to J1939Addresses
+           #else
+            if((J1939AddressCA(ReceivedPDU.SourceAddress) == J1939_CA_NONE) && (ReceivedPDU.SourceAddress != J1939_NULL_ADDRESS))
+            {
+               J1939LoadReceiveBuffer(ReceivedPDU,Data,length);  //so you can keep a list of J1939Names to J1939Addresses, if desired
+            }
+           #endif
+            break;
+        #if J1939_TP_SESSIONS > 0
+         case J1939_PF_PT_CM:
+         case J1939_PF_PT_DT:
+            if(length == 8)
+               J1939TPReceive(ReceivedPDU,Data);   //packets are reassembled into Transport Protocol pool
+            break;
+        #endif
+         case J1939_PF_REQUEST:
+            if((Data[0] == 0x00) && (Data[1] == 0xEE) && (Data[2] == 0x00))
+            {
+               J1939HandleAddressRequest(ReceivedPDU);
                break;
-            case J1939_PF_REQUEST:
-               if((Data[0] == 0x00) && (Data[1] == 0xEE) && (Data[2] == 0x00))
+            }
+         default:
+           #if J1939_FP_PGNS > 0
+            if((ReceivedPDU.PDUFormat >= 240) && (length == 8) && (J1939FPFind(J1939GetPGN(ReceivedPDU)) != J1939_FP_NONE))
+            {
+               J1939FPReceive(ReceivedPDU,Data);   //frames are reassembled into Transport Protocol pool
+               break;
+            }
+           #endif
+           #if J1939_SUBSCRIBED_PGNS > 0
+            if(ReceivedPDU.PDUFormat >= 240)
+            {
+               Handler = J1939SubscribedHandler(J1939GetPGN(ReceivedPDU));
+               
+               if(Handler != 0)
                {
-                  J1939HandleAddressRequest(ReceivedPDU);
+                  (*Handler)(&ReceivedPDU,Data,length);
                   break;
                }
-            default:
-               J1939LoadReceiveBuffer(ReceivedPDU,Data,length);
-               break;
-         }
+            }
+           #endif
+           #if J1939_ACCEPT_FILTER == TRUE
+            if((ReceivedPDU.PDUFormat < 240) && (J1939AcceptState(ReceivedPDU.PDUFormat) != J1939_ACCEPT_ALL))
+            {
+               if(J1939Accepted(ReceivedPDU.PDUFormat,ReceivedPDU.DestinationAddress) == FALSE)
+                  break;   //application didn't accept message, PDU2 messages were checked before the switch
+            }
+           #endif
+            J1939LoadReceiveBuffer(ReceivedPDU,Data,length);
+            break;
       }
    }
    
-   if((g_J1939Flags.AddressClaimed == FALSE) && (g_J1939Flags.AddressClaimSent == TRUE) && (g_J1939Flags.AddressCannotClaim == FALSE))
-   {
-      g_J1939CurrentClaimTick = J1939GetTick();
-      
-      if(J1939GetTickDifference(g_J1939CurrentClaimTick, g_J1939PreviousClaimTick) >= (J1939_TICK_TYPE)J1939_TICKS_PER_SECOND/4)
-      {
-         g_J1939Flags.AddressClaimed = TRUE;
-         J1939SetCANFilter(g_MyJ1939Address);      //unit claimed address so setup filter to start looking for 
-                                                   //J1939 Messages sent to unit's address 
-      }
-   }
+   J1939TimerTask();    //expire Transport Protocol and Address Claim timeouts
+   
+  #if J1939_FILTER_TASK == TRUE
+   J1939FilterTask();   //load address filters once CAN is in Config mode
+  #endif
+  
+  #if J1939_BUS_MONITOR == TRUE
+   J1939BusTask();      //report CAN error state changes and recover from bus-off
+  #endif
+  
+  #if J1939_MODE_TASK == TRUE
+   J1939ModeTask();     //ask for Normal mode again if CAN didn't reach it
+  #endif
+   
+  #if J1939_SUBSCRIBED_PGNS > 0
+   if(g_J1939PGNFiltersDirty)
+      J1939LoadPGNFilters();     //subscriptions changed, CAN put in Config mode to reload filters
+  #endif
+   
+  #ifdef J1939_EEPROM_ADDRESS
+   J1939EepromTask();   //write at most one changed byte to data EEPROM
+  #endif
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //J1939XmitTask()
 // Checks for message in Xmit Buffer and loads into CAN buffers to transmit.
+// Pending Address Claimed messages are loaded first by J1939ClaimXmitTask().
 //  Parameters: None
 //  Returns:    Nothing
 ////////////////////////////////////////////////////////////////////////////////
 void J1939XmitTask(void)
 {
-   J1939_TICK_TYPE CurrentTick;
+  #if J1939_MODE_TASK == TRUE
+   if(J1939ModeTask() == FALSE)
+      return;     //CAN is changing mode, messages wait for Normal mode
+  #endif
+  
+   J1939ClaimXmitTask();   //Address Claimed and Cannot Claim Address go ahead of transmit buffer
+
+  #if J1939_TP_SESSIONS > 0
+   J1939TPCMXmitTask();    //TP.CM messages that didn't fit in transmit buffer go next
+  #endif
+
+  #if (J1939_FP_PGNS > 0) && (J1939_TP_BLOCKS > 0)
+   J1939FPXmitTask();   //load next frames of Fast Packet message into transmit buffer
+  #endif
 
    while((g_J1939Flags.XmitBufferCount > 0) && can_tbe())
    {
-      if((g_J1939Flags.AddressClaimed == TRUE) || (g_J1939XmitBuffer[g_J1939XmitNextOut].PDU.PDUFormat == J1939_PF_ADDR_CLAIMED) || 
+     #if J1939_BUS_MONITOR == TRUE
+      if((g_J1939BusState >= CAN_ERROR_PASSIVE) && (g_J1939XmitBuffer[g_J1939XmitNextOut].PDU.Priority >= J1939_PASSIVE_PRIORITY))
+      {
+         if(J1939GetTickDifference(J1939GetTick(), g_J1939PassiveXmitTick) < J1939_PASSIVE_INTERVAL)
+            break;      //keep low priority message until bus has room for it
+         
+         g_J1939PassiveXmitTick = J1939GetTick();
+      }
+     #endif
+      
+      if(J1939SourceClaimed(g_J1939XmitBuffer[g_J1939XmitNextOut].PDU.SourceAddress) || (g_J1939XmitBuffer[g_J1939XmitNextOut].PDU.PDUFormat == J1939_PF_ADDR_CLAIMED) || 
          ((g_J1939XmitBuffer[g_J1939XmitNextOut].PDU.PDUFormat == J1939_PF_REQUEST) && (g_J1939XmitBuffer[g_J1939XmitNextOut].Data[0] == 0x00) &&
           (g_J1939XmitBuffer[g_J1939XmitNextOut].Data[1] == 0xEE) && (g_J1939XmitBuffer[g_J1939XmitNextOut].Data[2] == 0x00)))
       {
-         if((g_J1939XmitBuffer[g_J1939XmitNextOut].PDU.PDUFormat == J1939_PF_ADDR_CLAIMED) && (g_J1939XmitBuffer[g_J1939XmitNextOut].PDU.DestinationAddress == J1939_NULL_ADDRESS))
-         {
-            CurrentTick = J1939GetTick();
-            
-            if(J1939GetTickDifference(CurrentTick, g_J1939PreviousCannotClaimTick) <= g_J1939CannotClaimDelay)
-               break;
-         }
-               
          can_putd(g_J1939XmitBuffer[g_J1939XmitNextOut].PDU,g_J1939XmitBuffer[g_J1939XmitNextOut].Data,g_J1939XmitBuffer[g_J1939XmitNextOut].Length,3,TRUE,FALSE);
-         
-         if((g_J1939Flags.AddressClaimed == FALSE) && (g_J1939Flags.AddressNewClaim == TRUE) && (g_J1939XmitBuffer[g_J1939XmitNextOut].PDU.PDUFormat == J1939_PF_ADDR_CLAIMED) && (g_J1939XmitBuffer[g_J1939XmitNextOut].PDU.DestinationAddress != J1939_NULL_ADDRESS))
-         {
-            if((bit_test(g_J1939Name[7],7) == FALSE) && ((g_J1939XmitBuffer[g_J1939XmitNextOut].PDU.DestinationAddress <= 128) || 
-               ((g_J1939XmitBuffer[g_J1939XmitNextOut].PDU.DestinationAddress >= 248) && (g_J1939XmitBuffer[g_J1939XmitNextOut].PDU.DestinationAddress <=253))))
-            {
-               g_J1939Flags.AddressClaimed = TRUE;
-               g_J1939Flags.AddressClaimSent = TRUE;
-               g_J1939Flags.AddressNewClaim = FALSE;
-               
-               J1939SetCANFilter(g_MyJ1939Address);   //unit claimed address so setup filter to start looking for 
-                                                      //J1939 Messages sent to unit's address
-            }
-            else
-            {
-               g_J1939PreviousClaimTick = J1939GetTick();
-               g_J1939Flags.AddressClaimSent = TRUE;
-               g_J1939Flags.AddressNewClaim = FALSE;
-            }
-         }            
       }
                
       if(++g_J1939XmitNextOut >= J1939_TRANSMIT_BUFFERS)
@@ -350,6 +652,31 @@ int1 J1939GetMessage(J1939_PDU_STRUCT &PDU, uint8_t *Data, uint8_t &Length)
       return(FALSE);
 }
 
+#if J1939_TIMESTAMP != J1939_TIMESTAMP_NONE
+////////////////////////////////////////////////////////////////////////////////
+//J1939GetMessage()
+// Retrieves a message from buffer with the time it was received
+//  Parameters: PDU - PDU structure to return message's PDU to
+//              Data - pointer to return data to
+//              Length - variable to return message length to
+//              Time - structure to return J1939GetTick() and, with
+//                     J1939_TIMESTAMP_CAPTURE, CCP1 capture of message to
+//  Returns:    True - if new message was retrieved
+//              False - if there was no new message to retrieve
+////////////////////////////////////////////////////////////////////////////////
+int1 J1939GetMessage(J1939_PDU_STRUCT &PDU, uint8_t *Data, uint8_t &Length, J1939_TIMESTAMP_STRUCT &Time)
+{
+   if(g_J1939Flags.ReceiveBufferCount > 0)
+   {
+      memcpy(&Time,&g_J1939ReceiveBuffer[g_J1939ReceiveNextOut].Time,sizeof(J1939_TIMESTAMP_STRUCT));
+      
+      return(J1939GetMessage(PDU,Data,Length));
+   }
+   else
+      return(FALSE);
+}
+#endif
+
 ////////////////////////////////////////////////////////////////////////////////
 //J1939PutMessage()
 // Load message into transmit buffer
@@ -386,7 +713,7 @@ void J1939RequestAddress(uint8_t address)
    J1939_PDU_STRUCT PDU;
    uint8_t data[3];
    
-   if(g_J1939Flags.AddressClaimed == FALSE)
+   if(J1939AddressClaimed(0) == FALSE)
       PDU.SourceAddress = J1939_NULL_ADDRESS;
    else
       PDU.SourceAddress = g_MyJ1939Address;
@@ -404,78 +731,219 @@ void J1939RequestAddress(uint8_t address)
    J1939PutMessage(PDU,data,3);
 }
 
+#if J1939_CLAIM_STATS == TRUE
+////////////////////////////////////////////////////////////////////////////////
+//J1939GetClaimStats()
+// Copies Address Claim statistics of a controller application, the number of
+// claims sent, lost and defended, if it ended in Cannot Claim and how long it
+// took to own an address.  Used to measure claim traffic when many units
+// power up at once.
+//  Parameters: CA - controller application, 0 if there is only one
+//              Stats - pointer to structure statistics are copied to
+//  Returns:    Nothing
+////////////////////////////////////////////////////////////////////////////////
+void J1939GetClaimStats(uint8_t CA, J1939_CLAIM_STATS_STRUCT *Stats)
+{
+   memcpy(Stats,&g_J1939ClaimStats[CA],sizeof(J1939_CLAIM_STATS_STRUCT));
+}
+#endif
+
 ////////////////////////////////////////////////////////////////////////////////  Internal Functions
 
 ////////////////////////////////////////////////////////////////////////////////
 //J1939ClaimAddress()
-// Sends an Address Claimed message to claim address in g_MyJ1939Address.
-//  Parameters: None
+// Sends an Address Claimed message to claim address of a controller
+// application, g_MyJ1939Address for controller application 0.
+//  Parameters: CA - controller application
 //  Returns:    Nothing
 ////////////////////////////////////////////////////////////////////////////////
-void J1939ClaimAddress(void)
+void J1939ClaimAddress(uint8_t CA)
 {
-   J1939_PDU_STRUCT RequestPDU;
-
-   RequestPDU.SourceAddress = g_MyJ1939Address;
-   RequestPDU.DestinationAddress = J1939_GLOBAL_ADDRESS;
-   RequestPDU.PDUFormat = J1939_PF_ADDR_CLAIMED;
-   RequestPDU.DataPage = 0;
-   RequestPDU.ExtendedDataPage = 0;
-   RequestPDU.Priority = J1939_REQUEST_PRIORITY;
+  #if J1939_CONTROLLER_APPS > 1
+   J1939AddressCAUpdate();    //Address may have been changed by application
+  #endif
    
-   g_J1939Flags.AddressNewClaim = TRUE;
+   J1939ClaimEvent(CA, J1939_CLAIM_EV_CLAIM);
    
-   J1939PutMessage(RequestPDU,g_J1939Name,8);
+   g_J1939CA[CA].ClaimPending = TRUE;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //J1939CompareName()
-// Compares our name with received name to determine which has priority
-//  Parameters: data - pointer to received name
-//  Returns:    True - if our name is high priority
+// Compares name of a controller application with received name to determine
+// which has priority.  Names are compared as 64 bit values from the most
+// significant byte, Name[7], down, the first byte that differs decides and the
+// lower value has priority.
+//  Parameters: CA - controller application
+//              data - pointer to received name
+//  Returns:    True - if our name is high priority, or names are the same
 //              False - if our name is lower priority
 ////////////////////////////////////////////////////////////////////////////////
-int1 J1939CompareName(uint8_t *data)
+int1 J1939CompareName(uint8_t CA, uint8_t *data)
 {
    uint8_t i;
    
-   for(i=0;i<8;i++)
+   i = 8;
+   
+   while(i--)
    {
-      if(g_J1939Name[i] > data[i])
-         return(FALSE);
+      if(g_J1939CA[CA].Name[i] != data[i])
+         return(g_J1939CA[CA].Name[i] < data[i]);
    }
    
    return(TRUE);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
-//J1939HandleAddressRequest()
-// Generates response to J1939 Address Requests
+//J1939OwnAddress()
+// Checks if address is claimed by one of unit's controller applications.
+//  Parameters: Address - address to check
+//  Returns:    True - if a controller application owns address
+//              False - if none does
+////////////////////////////////////////////////////////////////////////////////
+int1 J1939OwnAddress(uint8_t Address)
+{
+   uint8_t CA;
+   
+   CA = J1939AddressCA(Address);
+   
+   if(CA == J1939_CA_NONE)
+      return(FALSE);
+   
+   return(J1939AddressClaimed(CA));
+}
+
+#if J1939_CONTROLLER_APPS > 1
+////////////////////////////////////////////////////////////////////////////////
+//J1939AddressCAUpdate()
+// Rebuilds g_J1939AddressCA from the address of each controller application.
 //  Parameters: None
 //  Returns:    Nothing
 ////////////////////////////////////////////////////////////////////////////////
-void J1939HandleAddressRequest(J1939_PDU_STRUCT PDU)
+void J1939AddressCAUpdate(void)
 {
-   J1939_PDU_STRUCT RequestPDU;
+   uint8_t CA;
    
-   if(g_J1939Flags.AddressClaimed != TRUE)
-      RequestPDU.SourceAddress = J1939_NULL_ADDRESS;
-   else
-      RequestPDU.SourceAddress = g_MyJ1939Address;
+   memset(g_J1939AddressCA,J1939_CA_NONE,sizeof(g_J1939AddressCA));
+   
+   for(CA=0;CA<J1939_CONTROLLER_APPS;CA++)
+   {
+      if(g_J1939CA[CA].Address < J1939_NULL_ADDRESS)
+         g_J1939AddressCA[g_J1939CA[CA].Address] = CA;
+   }
+}
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//J1939XmitFlush()
+// Removes messages with a source address from transmit buffer, other messages
+// keep their order.
+//  Parameters: Address - source address of messages to remove
+//  Returns:    Nothing
+////////////////////////////////////////////////////////////////////////////////
+void J1939XmitFlush(uint8_t Address)
+{
+   uint8_t In;
+   uint8_t Out;
+   uint8_t Count;
+   
+   In = g_J1939XmitNextOut;
+   Out = g_J1939XmitNextOut;
+   
+   for(Count=g_J1939Flags.XmitBufferCount;Count>0;Count--)
+   {
+      if(g_J1939XmitBuffer[Out].PDU.SourceAddress != Address)
+      {
+         if(In != Out)
+            memcpy(&g_J1939XmitBuffer[In],&g_J1939XmitBuffer[Out],sizeof(J1939_MESSAGE_STRUCT));
+         
+         if(++In >= J1939_TRANSMIT_BUFFERS)
+            In = 0;
+      }
+      else
+         g_J1939Flags.XmitBufferCount--;
+      
+      if(++Out >= J1939_TRANSMIT_BUFFERS)
+         Out = 0;
+   }
+   
+   g_J1939XmitNextIn = In;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//J1939ClaimXmitTask()
+// Sends pending Address Claimed and Cannot Claim Address messages of
+// controller applications straight to the CAN transmit buffers, ahead of and
+// without using g_J1939XmitBuffer, so responses can't be dropped or push out
+// application messages when the transmit buffer is full.  The message is made
+// when it's sent, from the controller application's current address and state.
+//  Parameters: None
+//  Returns:    Nothing
+////////////////////////////////////////////////////////////////////////////////
+void J1939ClaimXmitTask(void)
+{
+   J1939_PDU_STRUCT PDU;
+   uint8_t CA;
+   
+   PDU.DestinationAddress = J1939_GLOBAL_ADDRESS;
+   PDU.PDUFormat = J1939_PF_ADDR_CLAIMED;            //value is the same for both Address Claimed and Cannot Claim Address
+   PDU.DataPage = 0;
+   PDU.ExtendedDataPage = 0;
+   PDU.Priority = J1939_REQUEST_PRIORITY;
    
-   RequestPDU.DestinationAddress = J1939_GLOBAL_ADDRESS;
-   RequestPDU.PDUFormat = J1939_PF_ADDR_CLAIMED;            //value is the same for both Address Claimed and Cannot Claim Address
-   RequestPDU.DataPage = 0;
-   RequestPDU.ExtendedDataPage = 0;
-   RequestPDU.Priority = J1939_REQUEST_PRIORITY;
+   for(CA=0;(CA<J1939_CONTROLLER_APPS) && can_tbe();CA++)
+   {
+      if(g_J1939CA[CA].ClaimPending == FALSE)
+         continue;
+      
+      if(g_J1939CA[CA].ClaimState == J1939_CLAIM_CANNOT_CLAIM)
+      {
+         if(J1939GetTickDifference(J1939GetTick(), g_J1939PreviousCannotClaimTick) <= g_J1939CannotClaimDelay)
+            continue;
+         
+         PDU.SourceAddress = J1939_NULL_ADDRESS;
+      }
+      else
+         PDU.SourceAddress = g_J1939CA[CA].Address;   //claimed or being claimed
+      
+      can_putd(PDU,g_J1939CA[CA].Name,8,3,TRUE,FALSE);
+      
+      g_J1939CA[CA].ClaimPending = FALSE;
+      
+      if((J1939NameArbitrary(g_J1939CA[CA].Name) == FALSE) && ((g_J1939CA[CA].Address < 128) || ((g_J1939CA[CA].Address >= 248) && (g_J1939CA[CA].Address <= 253))))
+         J1939ClaimEvent(CA, J1939_CLAIM_EV_SENT_NOW);    //address can be used without waiting for contending claims
+      else
+         J1939ClaimEvent(CA, J1939_CLAIM_EV_SENT);
+   }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//J1939HandleAddressRequest()
+// Generates response to J1939 Address Requests, responses are sent by
+// J1939ClaimXmitTask() so they don't use the transmit buffer.
+//  Parameters: PDU - the PDU of received Request message
+//  Returns:    Nothing
+////////////////////////////////////////////////////////////////////////////////
+void J1939HandleAddressRequest(J1939_PDU_STRUCT PDU)
+{
+   uint8_t CA;
    
-   if((g_J1939Flags.AddressClaimed == TRUE) || (g_J1939Flags.AddressClaimSent == TRUE))  //don't respond to request if an address claim hasn't been sent
-      J1939PutMessage(RequestPDU,g_J1939Name,8);
+   for(CA=0;CA<J1939_CONTROLLER_APPS;CA++)
+   {
+      if(g_J1939CA[CA].ClaimState < J1939_CLAIM_CONTENDING)  //don't respond to request if an address claim hasn't been sent
+         continue;
+      
+      if((PDU.DestinationAddress != J1939_GLOBAL_ADDRESS) && (PDU.DestinationAddress != g_J1939CA[CA].Address))
+         continue;
+      
+      g_J1939CA[CA].ClaimPending = TRUE;
+   }
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //J1939LoadReceiveBuffer()
-// Loads g_J1939ReceiveBuffer with passed data and updates global indexes.
+// Loads g_J1939ReceiveBuffer with passed data and updates global indexes.  If
+// g_J1939ReceiveBuffer is full the message is thrown away.
 //  Parameters: ReceivedPDU - the PDU of the received CAN message
 //              Data - pointer to the received CAN data
 //              length - number of bytes received in CAN message
@@ -485,10 +953,16 @@ void J1939LoadReceiveBuffer(J1939_PDU_STRUCT ReceivedPDU,uint8_t *Data,uint8_t l
 {
    uint8_t i;
    
+   if(g_J1939Flags.ReceiveBufferCount >= J1939_RECEIVE_BUFFERS)
+      return;
+   
    memcpy(&g_J1939ReceiveBuffer[g_J1939ReceiveNextIn].PDU,&ReceivedPDU,sizeof(J1939_PDU_STRUCT));
    g_J1939ReceiveBuffer[g_J1939ReceiveNextIn].Length = length;
    for(i=0;i<length;i++)
       g_J1939ReceiveBuffer[g_J1939ReceiveNextIn].Data[i] = Data[i];
+  #if J1939_TIMESTAMP != J1939_TIMESTAMP_NONE
+   memcpy(&g_J1939ReceiveBuffer[g_J1939ReceiveNextIn].Time,&g_J1939ReceiveTime,sizeof(J1939_TIMESTAMP_STRUCT));
+  #endif
    
    if(++g_J1939ReceiveNextIn >= J1939_RECEIVE_BUFFERS)
       g_J1939ReceiveNextIn = 0;
@@ -498,114 +972,3052 @@ void J1939LoadReceiveBuffer(J1939_PDU_STRUCT ReceivedPDU,uint8_t *Data,uint8_t l
 
 ////////////////////////////////////////////////////////////////////////////////
 //J1939HandleAddressClaim()
-// Responses to a J1939 Address Claim message.  Compares unit's Address and Name
-// to the Source Address and Name of the received J1939 Address Claim message,
-// and either response with Address Claimed, Cannot Claim Address or if unit is
-// Arbitrary Address Capable and if received Name is higher priority then unit's
+// Responses to a J1939 Address Claim message for the address of one of unit's
+// controller applications.  Compares controller application's Name to the
+// Name of the received J1939 Address Claim message, and either response with
+// Address Claimed, Cannot Claim Address or if controller application is
+// Arbitrary Address Capable and if received Name is higher priority then its
 // name it sends a new Address Request with a randomly generated address from
-// 128 to 247.
+// 128 to 247.  Claims for other addresses aren't responded to.
 //  Parameters: ReceivedPDU - the PDU of received Address Claim message
 //              Name - pointer to the J1939 Name of Address Claimer
 //  Returns:    Nothing
 ////////////////////////////////////////////////////////////////////////////////
 void J1939HandleAddressClaim(J1939_PDU_STRUCT ReceivedPDU, uint8_t *Name)
 {
-   J1939_PDU_STRUCT RequestPDU;
+   uint8_t CA;
+   
+   if(ReceivedPDU.SourceAddress == J1939_NULL_ADDRESS)
+      return;
+   
+   CA = J1939AddressCA(ReceivedPDU.SourceAddress);    //controller application using claimed address, if any
    
-   if((ReceivedPDU.SourceAddress != J1939_NULL_ADDRESS) && (g_J1939Flags.AddressClaimSent))
+   if((CA != J1939_CA_NONE) && (g_J1939CA[CA].ClaimState >= J1939_CLAIM_CONTENDING))
    {
-      RequestPDU.DestinationAddress = J1939_GLOBAL_ADDRESS;
-      RequestPDU.PDUFormat = J1939_PF_ADDR_CLAIMED;            //value is the same for both Address Claimed and Cannot Claim Address
-      RequestPDU.DataPage = 0;
-      RequestPDU.ExtendedDataPage = 0;
-      RequestPDU.Priority = J1939_REQUEST_PRIORITY;
-
-      if((ReceivedPDU.SourceAddress == g_MyJ1939Address) && (g_J1939Flags.AddressCannotClaim == FALSE))
+      if(g_J1939CA[CA].ClaimState != J1939_CLAIM_CANNOT_CLAIM)
       {
-         if(J1939CompareName(Name))
+         if(J1939CompareName(CA, Name))
          {
-            RequestPDU.SourceAddress = g_MyJ1939Address;
+           #if J1939_CLAIM_STATS == TRUE
+            g_J1939ClaimStats[CA].ClaimsDefended++;
+           #endif
          }
          else
          {
-            if(g_J1939Flags.AddressClaimed)
-               J1939SetCANFilter(J1939_GLOBAL_ADDRESS);  //Only do this if unit already claimed address,
-                                                         //because this switches CAN to CONFIG mode.
-            //Clear Address Claim Flags
-            g_J1939Flags.AddressClaimed = FALSE;
-            
-            //Clear Transmit Buffer
-            g_J1939XmitNextOut = 0;
-            g_J1939XmitNextIn = 0;
-            g_J1939Flags.XmitBufferCount = 0;
+            J1939XmitFlush(g_J1939CA[CA].Address);    //Clear controller application's messages from Transmit Buffer
             
-            if(bit_test(g_J1939Name[7],7) == FALSE)   //If not Arbitrary Address Capable send Cannot Claim Address
+            if(J1939NameArbitrary(g_J1939CA[CA].Name) == FALSE)   //If not Arbitrary Address Capable send Cannot Claim Address
             {
-               RequestPDU.SourceAddress = J1939_NULL_ADDRESS;
-               g_J1939Flags.AddressCannotClaim = TRUE;
+               J1939ClaimEvent(CA, J1939_CLAIM_EV_LOST_CANNOT);
             }
             else  //If Arbitrary Address Capable Generate Random address from 128 to 247 and request
             {
-               g_MyJ1939Address = (((uint32_t)xor8() * 46875) / 100000) + 128;
-               RequestPDU.SourceAddress = g_MyJ1939Address;
-               g_J1939Flags.AddressNewClaim = TRUE;
+               J1939AddressUse(ReceivedPDU.SourceAddress);     //winner keeps the address
+               g_J1939CA[CA].Address = J1939ArbitraryAddress();
+              #if J1939_CONTROLLER_APPS > 1
+               J1939AddressCAUpdate();
+              #endif
+               J1939ClaimEvent(CA, J1939_CLAIM_EV_LOST);
             }
          }
       }
-      else
-         RequestPDU.SourceAddress = J1939_NULL_ADDRESS;
       
-      if(RequestPDU.SourceAddress == J1939_NULL_ADDRESS)
+      if(g_J1939CA[CA].ClaimState == J1939_CLAIM_CANNOT_CLAIM)
       {
          g_J1939PreviousCannotClaimTick = J1939GetTick();
          g_J1939CannotClaimDelay = ((uint32_t)xor8() * 53125) / 100000;    //Generate Random delay from 0 to 135ms
       }
          
-      J1939PutMessage(RequestPDU,g_J1939Name,8);
+      g_J1939CA[CA].ClaimPending = TRUE;
    }
 }
-      
+
 ////////////////////////////////////////////////////////////////////////////////
-//J1939SetCANFilter()
-// Sets filter 1 of CAN module to receive unit's address after unit it has
-// successfully claimed an address.
-//  Parameters: address - address to set filter to
+//J1939HandleCommandedAddress()
+// Responses to a Commanded Address message.  The controller application whose
+// Name matches the Name in the message drops its queued messages and claims
+// the commanded address, its filter is set up once the claim succeeds.  The
+// command is ignored if another of unit's controller applications uses the
+// address.
+//  Parameters: Data - pointer to the 9 data bytes of Commanded Address
+//                     message, Name followed by new address
 //  Returns:    Nothing
 ////////////////////////////////////////////////////////////////////////////////
-void J1939SetCANFilter(uint8_t address)
+void J1939HandleCommandedAddress(uint8_t *Data)
 {
-   can_set_mode(CAN_OP_CONFIG);  //put CAN in Config mode
-
-   #if (USE_INTERNAL_CAN == TRUE)
-    #if defined(__PCD__)   //PIC24, dsPIC33 and dsPIC30
-      can_set_id(&C1RXF1, (uint32_t)address << 8, CAN_USE_EXTENDED_ID);       //Set Filter 1
-    #else
-      can_set_id(RXFILTER1, (uint32_t)address << 8, CAN_USE_EXTENDED_ID);     //Set Filter 1
-    #endif
-   #else
-      can_set_id(RX0FILTER1, (uint32_t)address << 8, CAN_USE_EXTENDED_ID);    //Set Filter 1
-   #endif
+   uint8_t CA;
    
-   can_set_mode(CAN_OP_NORMAL);  //put CAN in Normal mode
+   if(Data[8] >= J1939_NULL_ADDRESS)
+      return;
+   
+   for(CA=0;CA<J1939_CONTROLLER_APPS;CA++)
+   {
+      if(memcmp(g_J1939CA[CA].Name,Data,8) == 0)
+      {
+         if((J1939AddressCA(Data[8]) != J1939_CA_NONE) && (J1939AddressCA(Data[8]) != CA))
+            break;      //both controller applications would claim same address
+         
+         if(g_J1939CA[CA].Address != Data[8])
+         {
+            J1939XmitFlush(g_J1939CA[CA].Address);   //messages with old address
+            g_J1939CA[CA].Address = Data[8];
+            J1939ClaimAddress(CA);
+         }
+         
+         break;
+      }
+   }
 }
 
 ////////////////////////////////////////////////////////////////////////////////
-//xor8()
-// Generates a pseudo-random 8-bit number.  rand_seed is used as a seed
-//   for the algorithm.
-//  Parameters: None
-//  Returns:    uint8_t - Pseudo-random value
+//J1939CommandedReceive()
+// Receives a Commanded Address message sent with a BAM into g_J1939Commanded,
+// and calls J1939HandleCommandedAddress() once both TP.DT packets are in.  A
+// new TP.CM from the sender replaces its BAM, a packet out of sequence or more
+// than J1939_TP_T1 after the one before drops it.  Other TP.CM and TP.DT
+// messages are left to the Transport Protocol, a Commanded Address sent with
+// RTS/CTS still needs a Transport Protocol session and pool blocks.
+//  Parameters: ReceivedPDU - the PDU of received TP.CM or TP.DT message
+//              Data - pointer to the 8 data bytes of received message
+//  Returns:    True - if message was part of a Commanded Address BAM
+//              False - if it wasn't
 ////////////////////////////////////////////////////////////////////////////////
-uint8_t xor8(void)
+int1 J1939CommandedReceive(J1939_PDU_STRUCT ReceivedPDU, uint8_t *Data)
 {
-   static uint8_t y = 69;
-   static uint8_t z = 29;
-   static uint8_t w = 23;
-   uint8_t t;
-
+   J1939_TICK_TYPE CurrentTick;
+   
+   if(ReceivedPDU.DestinationAddress != J1939_GLOBAL_ADDRESS)
+      return(FALSE);
+   
+   if(ReceivedPDU.PDUFormat == J1939_PF_PT_CM)
+   {
+      if(ReceivedPDU.SourceAddress == g_J1939Commanded.Source)
+         g_J1939Commanded.Source = J1939_NULL_ADDRESS;
+      
+      if((Data[0] != J1939_TP_CM_BAM) || (make16(Data[2],Data[1]) != J1939_COMMANDED_ADDRESS_SIZE) || (Data[3] != 2) ||
+         (make32(0,Data[7],Data[6],Data[5]) != J1939_PGN_COMMANDED_ADDRESS))
+         return(FALSE);
+      
+      g_J1939Commanded.Source = ReceivedPDU.SourceAddress;
+      g_J1939Commanded.Packets = 0;
+      g_J1939Commanded.Tick = J1939GetTick();
+      
+      return(TRUE);
+   }
+   
+   if((g_J1939Commanded.Source == J1939_NULL_ADDRESS) || (ReceivedPDU.SourceAddress != g_J1939Commanded.Source))
+      return(FALSE);
+   
+   CurrentTick = J1939GetTick();
+   
+   if((Data[0] != (g_J1939Commanded.Packets + 1)) || (J1939GetTickDifference(CurrentTick, g_J1939Commanded.Tick) > J1939_TP_T1))
+   {
+      g_J1939Commanded.Source = J1939_NULL_ADDRESS;
+      return(TRUE);
+   }
+   
+   memcpy(&g_J1939Commanded.Data[g_J1939Commanded.Packets * 7],&Data[1],7);
+   g_J1939Commanded.Tick = CurrentTick;
+   
+   if(++g_J1939Commanded.Packets == 2)
+   {
+      g_J1939Commanded.Source = J1939_NULL_ADDRESS;
+      J1939HandleCommandedAddress(g_J1939Commanded.Data);
+   }
+   
+   return(TRUE);
+}
+      
+////////////////////////////////////////////////////////////////////////////////
+//J1939SetCANFilter()
+// Sets filter 1 of CAN module to receive unit's address after unit it has
+// successfully claimed an address.  With J1939_STAGED_FILTERS the staged filter
+// already loaded with address is made the active one instead, so CAN stays in
+// Normal mode, only an address that wasn't staged reloads the staged filters.
+// With J1939_CONTROLLER_APPS more than 1, controller applications 1 and up
+// use filters 6 and up of PIC18 ECAN, other CAN modules accept every
+// destination and J1939ReceiveTask() drops messages no controller application
+// owns.
+//  Parameters: CA - controller application
+//              address - address to set filter to, J1939_GLOBAL_ADDRESS to
+//                        stop receiving messages to controller application
+//  Returns:    Nothing
+////////////////////////////////////////////////////////////////////////////////
+void J1939SetCANFilter(uint8_t CA, uint8_t address)
+{
+  #if J1939_STAGED_FILTERS > 0
+   uint8_t Filter;
+   
+   if(address == J1939_GLOBAL_ADDRESS)
+   {
+      g_J1939StagedActive = J1939_FILTER_NONE;
+      return;
+   }
+   
+   Filter = J1939StagedFilter(address);
+   
+   if(Filter == J1939_FILTER_NONE)
+   {
+      can_set_mode(CAN_OP_CONFIG);     //put CAN in Config mode
+      J1939StageFilters(address);
+      can_set_mode(CAN_OP_NORMAL);     //put CAN in Normal mode
+      Filter = 0;
+   }
+   
+   g_J1939StagedActive = Filter;
+  #elif (J1939_CONTROLLER_APPS > 1) && ((USE_INTERNAL_CAN == FALSE) || defined(__PCD__))
+   //filters 0 and 1 accept every destination address
+  #elif J1939_FILTER_TASK == TRUE
+   g_J1939FilterAddress[CA] = address;
+   bit_set(g_J1939FilterPending, CA);     //loaded by J1939FilterTask() once CAN is in Config mode
+  #else
+   can_set_mode(CAN_OP_CONFIG);  //put CAN in Config mode
+
+   #if (USE_INTERNAL_CAN == TRUE)   //PIC24, dsPIC33 and dsPIC30
+      can_set_id(&C1RXF1, (uint32_t)address << 8, CAN_USE_EXTENDED_ID);       //Set Filter 1
+   #else
+      can_set_id(RX0FILTER1, (uint32_t)address << 8, CAN_USE_EXTENDED_ID);    //Set Filter 1
+   #endif
+   
+   can_set_mode(CAN_OP_NORMAL);  //put CAN in Normal mode
+  #endif
+}
+
+#if J1939_FILTER_TASK == TRUE
+////////////////////////////////////////////////////////////////////////////////
+//J1939FilterTask()
+// Loads address filters set by J1939SetCANFilter().  Config mode is requested
+// without waiting for it, J1939ReceiveTask() keeps reading messages and
+// J1939XmitTask() holds messages until CAN is back in Normal mode, so a
+// transceiver that keeps CAN from changing mode doesn't hang the unit.  The
+// ticks spent waiting for Config mode are saved in g_J1939ModeTime.
+//  Parameters: None
+//  Returns:    Nothing
+////////////////////////////////////////////////////////////////////////////////
+void J1939FilterTask(void)
+{
+   uint8_t CA;
+   
+   if(g_J1939FilterPending == 0)
+      return;
+   
+   if(can_mode_done(CAN_OP_CONFIG) == FALSE)
+   {
+      if(CANCON.reqop != CAN_OP_CONFIG)
+      {
+         can_request_mode(CAN_OP_CONFIG);    //CAN finishes frame on bus before changing mode
+         g_J1939ModeStart = J1939GetTick();
+      }
+      
+      return;
+   }
+   
+   for(CA=0;CA<J1939_CONTROLLER_APPS;CA++)
+   {
+      if(bit_test(g_J1939FilterPending, CA))
+      {
+        #if J1939_CONTROLLER_APPS > 1
+         if(CA > 0)
+            can_set_id((int *)g_J1939FilterRegister[CA - 1], (uint32_t)g_J1939FilterAddress[CA] << 8, CAN_USE_EXTENDED_ID);   //Set Filter 5 + CA
+         else
+        #endif
+         can_set_id(RXFILTER1, (uint32_t)g_J1939FilterAddress[CA] << 8, CAN_USE_EXTENDED_ID);     //Set Filter 1
+      }
+   }
+   
+   g_J1939FilterPending = 0;
+   g_J1939ModeTime = J1939GetTickDifference(J1939GetTick(), g_J1939ModeStart);
+   
+   can_request_mode(CAN_OP_NORMAL);   //J1939XmitTask() waits for Normal mode
+}
+#endif
+
+#if J1939_MODE_TASK == TRUE
+////////////////////////////////////////////////////////////////////////////////
+//J1939ModeTask()
+// Checks CAN is in Normal mode.  When no filter reload is waiting for Config
+// mode and CAN isn't in Normal mode, because a mode change timed out, Normal
+// mode is asked for again instead of J1939XmitTask() holding messages forever.
+//  Parameters: None
+//  Returns:    True - if CAN is in Normal mode and messages can be sent
+//              False - if CAN is changing mode
+////////////////////////////////////////////////////////////////////////////////
+int1 J1939ModeTask(void)
+{
+  #if J1939_FILTER_TASK == TRUE
+   if(g_J1939FilterPending != 0)
+      return(FALSE);     //J1939FilterTask() is taking CAN through Config mode
+  #endif
+  
+  #if J1939_BUS_MONITOR == TRUE
+   if(g_J1939BusRecover != J1939_BUS_RECOVER_NONE)
+      return(FALSE);     //J1939BusTask() is taking CAN through Config mode
+  #endif
+   
+   if(can_mode_done(CAN_OP_NORMAL))
+      return(TRUE);
+   
+   if(CANCON.reqop == CAN_OP_DISABLE)
+      return(FALSE);     //J1939Init() couldn't set the bit rate, CAN stays off the bus
+   
+   can_request_mode(CAN_OP_NORMAL);     //request again, CAN changes mode once bus is idle
+   
+   return(FALSE);
+}
+#endif
+
+#if J1939_BUS_MONITOR == TRUE
+////////////////////////////////////////////////////////////////////////////////
+//J1939SetBusCallback()
+// Sets function called by J1939ReceiveTask() when the CAN error state changes.
+//  Parameters: Callback - function called with CAN_ERROR_ACTIVE,
+//                         CAN_ERROR_WARNING, CAN_ERROR_PASSIVE or
+//                         CAN_ERROR_BUS_OFF, 0 for none
+//  Returns:    Nothing
+////////////////////////////////////////////////////////////////////////////////
+void J1939SetBusCallback(J1939_BUS_CALLBACK Callback)
+{
+   g_J1939BusCallback = Callback;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//J1939BusTask()
+// Watches the CAN error state.  After a bus-off CAN is put back on the bus once
+// g_J1939BusBackoff ticks have passed, frames in the CAN transmit buffers are
+// sent again and J1939 transmit buffer is kept.  Config and Normal mode are
+// requested without waiting, the same as J1939FilterTask(), each call moves
+// recovery on a step.  The backoff doubles for each bus-off in a row, up to
+// J1939_BUS_OFF_BACKOFF_MAX, and is reset after that long error-active.
+//  Parameters: None
+//  Returns:    Nothing
+////////////////////////////////////////////////////////////////////////////////
+void J1939BusTask(void)
+{
+   uint8_t State;
+   
+   State = can_error_state();
+   
+   if(State != g_J1939BusState)
+   {
+      g_J1939BusState = State;
+      g_J1939BusStateTick = J1939GetTick();
+      
+      if(State == CAN_ERROR_BUS_OFF)
+         g_J1939BusOffs++;
+      
+      if(g_J1939BusCallback != 0)
+         (*g_J1939BusCallback)(State);
+   }
+   
+   if(g_J1939BusRecover != J1939_BUS_RECOVER_NONE)
+   {
+      if(g_J1939BusRecover == J1939_BUS_RECOVER_CONFIG)
+      {
+         if(can_mode_done(CAN_OP_CONFIG))
+         {
+            can_request_mode(CAN_OP_NORMAL);     //error counters are reset
+            g_J1939BusRecover = J1939_BUS_RECOVER_NORMAL;
+         }
+      }
+      else if(can_mode_done(CAN_OP_NORMAL))
+      {
+         can_tx_requeue(g_J1939BusPending);
+         g_J1939BusRecover = J1939_BUS_RECOVER_NONE;
+         
+         if(g_J1939BusBackoff < (J1939_BUS_OFF_BACKOFF_MAX / 2))
+            g_J1939BusBackoff <<= 1;
+         else
+            g_J1939BusBackoff = J1939_BUS_OFF_BACKOFF_MAX;
+         
+         return;
+      }
+      
+      if(J1939GetTickDifference(J1939GetTick(), g_J1939BusRecoverTick) >= J1939_BUS_OFF_BACKOFF_MAX)
+      {
+         g_J1939BusRecover = J1939_BUS_RECOVER_NONE;   //CAN didn't change mode, J1939ModeTask() asks for Normal mode
+         g_J1939BusStateTick = J1939GetTick();        //try again after another backoff
+      }
+      
+      return;
+   }
+   
+   if(State == CAN_ERROR_BUS_OFF)
+   {
+     #if J1939_FILTER_TASK == TRUE
+      if(g_J1939FilterPending != 0)
+         return;     //J1939FilterTask() takes CAN through Config mode anyway
+     #endif
+      
+      if(J1939GetTickDifference(J1939GetTick(), g_J1939BusStateTick) < g_J1939BusBackoff)
+         return;
+      
+      g_J1939BusPending = can_tx_pending();
+      g_J1939BusRecoverTick = J1939GetTick();
+      g_J1939BusRecover = J1939_BUS_RECOVER_CONFIG;
+      can_request_mode(CAN_OP_CONFIG);
+   }
+   else if((State == CAN_ERROR_ACTIVE) && (g_J1939BusBackoff != J1939_BUS_OFF_BACKOFF) &&
+           (J1939GetTickDifference(J1939GetTick(), g_J1939BusStateTick) >= J1939_BUS_OFF_BACKOFF_MAX))
+   {
+      g_J1939BusBackoff = J1939_BUS_OFF_BACKOFF;     //bus-off run is over
+   }
+}
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//J1939ArbitraryAddress()
+// Picks the address an Arbitrary Address Capable unit claims after losing its
+// address, the next staged address if there is one left, otherwise a random
+// address from 128 to 247 not known to be taken.
+//  Parameters: None
+//  Returns:    uint8_t - address to claim
+////////////////////////////////////////////////////////////////////////////////
+uint8_t J1939ArbitraryAddress(void)
+{
+  #if J1939_STAGED_FILTERS > 0
+   while(g_J1939StagedNext < J1939_STAGED_FILTERS)
+   {
+      if(J1939AddressTaken(g_J1939StagedAddress[g_J1939StagedNext]) == FALSE)
+         return(g_J1939StagedAddress[g_J1939StagedNext++]);
+      
+      g_J1939StagedNext++;    //seen in use since it was staged
+   }
+  #endif
+   
+   return(J1939RandomAddress());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//J1939RandomAddress()
+// Draws a random address from the addresses 128 to 247 that aren't known to be
+// taken by another node, each free address is equally likely.
+//  Parameters: None
+//  Returns:    uint8_t - random free address, any address from 128 to 247 if
+//                        none are free
+////////////////////////////////////////////////////////////////////////////////
+uint8_t J1939RandomAddress(void)
+{
+   uint8_t Free;
+   uint8_t Pick;
+   uint8_t Address;
+   
+   Free = 0;
+   
+   for(Address=128;Address<=247;Address++)
+   {
+      if(J1939AddressTaken(Address) == FALSE)
+         Free++;
+   }
+   
+   if(Free == 0)
+      return((J1939AddressRandom() % 120) + 128);
+   
+   Pick = J1939AddressRandom() % Free;
+   
+   for(Address=128;Address<247;Address++)
+   {
+      if(J1939AddressTaken(Address) == FALSE)
+      {
+         if(Pick == 0)
+            break;
+         
+         Pick--;
+      }
+   }
+   
+   return(Address);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//J1939AddressSeedInit()
+// Seeds arbitrary address generator with a hash of unit's Name, the Identity
+// Number makes it different for every unit.
+//  Parameters: None
+//  Returns:    Nothing
+////////////////////////////////////////////////////////////////////////////////
+void J1939AddressSeedInit(void)
+{
+   uint8_t i;
+   
+   g_J1939AddressSeed = 0x1939;
+   
+   for(i=0;i<8;i++)
+      g_J1939AddressSeed = ((g_J1939AddressSeed << 5) - g_J1939AddressSeed) ^ g_J1939Name[i];
+   
+   if(g_J1939AddressSeed == 0)
+      g_J1939AddressSeed = 0x1939;  //generator would stay at 0
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//J1939AddressRandom()
+// Generates next pseudo-random 8-bit number of arbitrary address generator,
+// a 16-bit xorshift.
+//  Parameters: None
+//  Returns:    uint8_t - Pseudo-random value
+////////////////////////////////////////////////////////////////////////////////
+uint8_t J1939AddressRandom(void)
+{
+   g_J1939AddressSeed ^= g_J1939AddressSeed << 7;
+   g_J1939AddressSeed ^= g_J1939AddressSeed >> 9;
+   g_J1939AddressSeed ^= g_J1939AddressSeed << 8;
+   
+   return(make8(g_J1939AddressSeed,0) ^ make8(g_J1939AddressSeed,1));
+}
+
+#if J1939_STAGED_FILTERS > 0
+////////////////////////////////////////////////////////////////////////////////
+//J1939StageFilters()
+// Loads staged filters 6 and up, first with address and the rest with
+// arbitrary addresses unit may claim later, and enables them.  Frames hitting
+// a staged filter other than the active one are dropped by J1939ReceiveTask().
+// CAN must be in Config mode.
+//  Parameters: address - address to load first staged filter with
+//  Returns:    Nothing
+////////////////////////////////////////////////////////////////////////////////
+void J1939StageFilters(uint8_t address)
+{
+   uint16_t Enable;
+   uint8_t i, j;
+   uint8_t Tries;
+   
+   for(i=0;i<J1939_STAGED_FILTERS;i++)
+   {
+      if(i == 0)
+         g_J1939StagedAddress[i] = address;
+      else
+      {
+         Tries = 0;
+         
+         do
+         {
+            g_J1939StagedAddress[i] = J1939RandomAddress();
+            
+            for(j=0;j<i;j++)
+            {
+               if(g_J1939StagedAddress[j] == g_J1939StagedAddress[i])
+                  break;
+            }
+         } while((j < i) && (++Tries < 16));   //each staged address different, unless almost all are taken
+      }
+      
+      can_set_id((int *)g_J1939FilterRegister[i], (uint32_t)g_J1939StagedAddress[i] << 8, CAN_USE_EXTENDED_ID);
+      can_associate_filter_to_mask(ACCEPTANCE_MASK_0, (CAN_FILTER_ASSOCIATION)(J1939_FILTER_FIRST + i));
+   }
+   
+   //filters 0 to 5, staged filters and subscribed PGN filters are enabled, rest disabled
+   Enable = (RXF0EN | RXF1EN | RXF2EN | RXF3EN | RXF4EN | RXF5EN) | ((((uint16_t)1 << J1939_STAGED_FILTERS) - 1) << J1939_FILTER_FIRST) | J1939_PGN_FILTER_ENABLE;
+   can_disable_filter(~Enable);
+   can_enable_filter(Enable);
+   
+   g_J1939StagedNext = 1;
+   g_J1939StagedActive = J1939_FILTER_NONE;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//J1939StagedFilter()
+// Finds staged filter loaded with address.
+//  Parameters: address - address to find
+//  Returns:    uint8_t - staged filter, 0 is filter 6, J1939_FILTER_NONE if
+//                        address isn't staged
+////////////////////////////////////////////////////////////////////////////////
+uint8_t J1939StagedFilter(uint8_t address)
+{
+   uint8_t i;
+   
+   for(i=0;i<J1939_STAGED_FILTERS;i++)
+   {
+      if(g_J1939StagedAddress[i] == address)
+         return(i);
+   }
+   
+   return(J1939_FILTER_NONE);
+}
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//J1939AddressClaimTimeout()
+// Called when no contending Address Claim was received within 250ms of sending
+// unit's Address Claimed, unit now owns the address.
+//  Parameters: Timer - J1939_TIMER_ADDRESS_CLAIM plus controller application
+//  Returns:    Nothing
+////////////////////////////////////////////////////////////////////////////////
+void J1939AddressClaimTimeout(uint8_t Timer)
+{
+   J1939ClaimEvent(Timer - J1939_TIMER_ADDRESS_CLAIM, J1939_CLAIM_EV_TIMEOUT);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//J1939ClaimEvent()
+// Moves Address Claim state machine of a controller application to the state
+// g_J1939ClaimTransition gives for event.  Leaving Claimed stops receiving
+// messages to its address, entering Contending starts its 250ms claim timer
+// and entering Claimed sets up the filter for its address.
+//  Parameters: CA - controller application
+//              Event - J1939_CLAIM_EV_xxx
+//  Returns:    Nothing
+////////////////////////////////////////////////////////////////////////////////
+void J1939ClaimEvent(uint8_t CA, uint8_t Event)
+{
+   uint8_t Next;
+   
+  #if J1939_CLAIM_STATS == TRUE
+   switch(Event)
+   {
+      case J1939_CLAIM_EV_CLAIM:
+         g_J1939ClaimStats[CA].StartTick = J1939GetTick();
+         break;
+      case J1939_CLAIM_EV_SENT:
+      case J1939_CLAIM_EV_SENT_NOW:
+         g_J1939ClaimStats[CA].ClaimsSent++;
+         break;
+      case J1939_CLAIM_EV_LOST:
+      case J1939_CLAIM_EV_LOST_CANNOT:
+         g_J1939ClaimStats[CA].ClaimsLost++;
+         break;
+   }
+  #endif
+   
+   Next = g_J1939ClaimTransition[g_J1939CA[CA].ClaimState][Event];
+   
+   if(Next == g_J1939CA[CA].ClaimState)
+      return;
+   
+  #if J1939_CLAIM_STATS == TRUE
+   if(Next == J1939_CLAIM_CLAIMED)
+      g_J1939ClaimStats[CA].ClaimTime = J1939GetTickDifference(J1939GetTick(), g_J1939ClaimStats[CA].StartTick);
+   else if(Next == J1939_CLAIM_CANNOT_CLAIM)
+      g_J1939ClaimStats[CA].CannotClaim++;
+  #endif
+   
+   if(g_J1939CA[CA].ClaimState == J1939_CLAIM_CLAIMED)
+      J1939SetCANFilter(CA, J1939_GLOBAL_ADDRESS);
+   
+   g_J1939CA[CA].ClaimState = Next;
+   
+   if(Next == J1939_CLAIM_CONTENDING)
+      J1939TimerStart(J1939_TIMER_ADDRESS_CLAIM + CA, J1939_ADDRESS_CLAIM_TIME, J1939AddressClaimTimeout);
+   else
+   {
+      J1939TimerStop(J1939_TIMER_ADDRESS_CLAIM + CA);
+      
+      if(Next == J1939_CLAIM_CLAIMED)
+      {
+         J1939SetCANFilter(CA, g_J1939CA[CA].Address);   //unit claimed address so setup filter to start looking for 
+                                                //J1939 Messages sent to unit's address
+        #ifdef J1939_EEPROM_ADDRESS
+         g_J1939EepromDirty = TRUE;             //save claimed address
+         g_J1939EepromNext = 0;
+        #endif
+      }
+   }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//xor8()
+// Generates a pseudo-random 8-bit number.  rand_seed is used as a seed
+//   for the algorithm.
+//  Parameters: None
+//  Returns:    uint8_t - Pseudo-random value
+////////////////////////////////////////////////////////////////////////////////
+uint8_t xor8(void)
+{
+   static uint8_t y = 69;
+   static uint8_t z = 29;
+   static uint8_t w = 23;
+   uint8_t t;
+
    t = rand_seed ^ (rand_seed << 3);
    rand_seed = y; y = z; z = w;
    w = w ^ (w >> 5) ^ (t ^ (t >> 2));
    return (w);
 }
+
+////////////////////////////////////////////////////////////////////////////////
+//J1939GetPGN()
+// Gets the Parameter Group Number of a message from its PDU.
+//  Parameters: PDU - the PDU of message
+//  Returns:    uint32_t - PGN, Group Extension is 0 for PDU1 messages
+////////////////////////////////////////////////////////////////////////////////
+uint32_t J1939GetPGN(J1939_PDU_STRUCT PDU)
+{
+   uint8_t Page;
+   
+   Page = 0;
+   
+   if(PDU.DataPage)
+      bit_set(Page,0);
+   if(PDU.ExtendedDataPage)
+      bit_set(Page,1);
+   
+   if(PDU.PDUFormat < 240)
+      return(make32(0,Page,PDU.PDUFormat,0));
+   else
+      return(make32(0,Page,PDU.PDUFormat,PDU.DestinationAddress));
+}
+
+////////////////////////////////////////////////////////////////////////////////  Address Table
+#if J1939_ADDRESS_TABLE_SIZE > 0
+
+////////////////////////////////////////////////////////////////////////////////
+//J1939LookupAddress()
+// Looks up the node at an address in the address table.  The table is built
+// from Address Claimed messages, use J1939RequestAddress(J1939_GLOBAL_ADDRESS)
+// to have every node send one.
+//  Parameters: Address - address of node
+//              Name - pointer to 8 bytes to return node's J1939 Name to
+//              LastSeen - variable to return tick of last message received
+//                         from node to
+//  Returns:    True - if node is in address table
+//              False - if no node is known at address
+////////////////////////////////////////////////////////////////////////////////
+int1 J1939LookupAddress(uint8_t Address, uint8_t *Name, J1939_TICK_TYPE &LastSeen)
+{
+   uint8_t Entry;
+   
+   Entry = J1939AddressTableFindAddress(Address);
+   
+   if(Entry == J1939_ADDRESS_NONE)
+      return(FALSE);
+   
+   memcpy(Name,g_J1939AddressTable[Entry].Name,8);
+   LastSeen = g_J1939AddressTable[Entry].LastSeen;
+   
+   return(TRUE);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//J1939LookupName()
+// Looks up the address claimed by a node from its J1939 Name.
+//  Parameters: Name - pointer to 8 byte J1939 Name of node
+//  Returns:    uint8_t - address of node, J1939_NULL_ADDRESS if node isn't in
+//                        address table
+////////////////////////////////////////////////////////////////////////////////
+uint8_t J1939LookupName(uint8_t *Name)
+{
+   uint8_t Entry;
+   
+   Entry = J1939AddressTableFindName(Name);
+   
+   if(Entry == J1939_ADDRESS_NONE)
+      return(J1939_NULL_ADDRESS);
+   
+   return(g_J1939AddressTable[Entry].Address);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//J1939AddressTableInit()
+// Empties the address table and its indexes.
+//  Parameters: None
+//  Returns:    Nothing
+////////////////////////////////////////////////////////////////////////////////
+void J1939AddressTableInit(void)
+{
+   uint16_t i;
+   
+   for(i=0;i<J1939_ADDRESS_TABLE_SIZE;i++)
+      g_J1939AddressTable[i].Address = J1939_NULL_ADDRESS;
+   
+   for(i=0;i<J1939_ADDRESS_INDEX_SIZE;i++)
+   {
+      g_J1939AddressIndex[J1939_INDEX_ADDRESS][i] = J1939_ADDRESS_NONE;
+      g_J1939AddressIndex[J1939_INDEX_NAME][i] = J1939_ADDRESS_NONE;
+   }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//J1939AddressTableClaim()
+// Updates the address table from a received Address Claimed or Cannot Claim
+// Address message.  A node that claims a new address is moved, a node that
+// can't claim an address is removed and a claim for an address that is in
+// table under a different Name replaces that entry.  If the table is full the
+// node that hasn't been seen for longest is dropped.
+//  Parameters: Address - Source Address of received message
+//              Name - pointer to J1939 Name in received message
+//  Returns:    Nothing
+////////////////////////////////////////////////////////////////////////////////
+void J1939AddressTableClaim(uint8_t Address, uint8_t *Name)
+{
+   J1939_TICK_TYPE CurrentTick;
+   uint8_t Entry;
+   uint8_t i;
+   
+   Entry = J1939AddressTableFindName(Name);
+   
+   if(Entry != J1939_ADDRESS_NONE)
+   {
+      if(g_J1939AddressTable[Entry].Address == Address)
+         return;     //claim of an address node already has
+      
+      J1939AddressTableUnlink(Entry);
+   }
+   
+   if(Address == J1939_NULL_ADDRESS)
+      return;        //Cannot Claim Address
+   
+   Entry = J1939AddressTableFindAddress(Address);
+   
+   if(Entry != J1939_ADDRESS_NONE)
+      J1939AddressTableUnlink(Entry);
+   else
+   {
+      CurrentTick = J1939GetTick();
+      
+      for(i=0;i<J1939_ADDRESS_TABLE_SIZE;i++)
+      {
+         if(g_J1939AddressTable[i].Address == J1939_NULL_ADDRESS)
+         {
+            Entry = i;
+            break;
+         }
+         
+         if((Entry == J1939_ADDRESS_NONE) || (J1939GetTickDifference(CurrentTick, g_J1939AddressTable[i].LastSeen) > J1939GetTickDifference(CurrentTick, g_J1939AddressTable[Entry].LastSeen)))
+            Entry = i;
+      }
+      
+      if(g_J1939AddressTable[Entry].Address != J1939_NULL_ADDRESS)
+         J1939AddressTableUnlink(Entry);
+   }
+   
+   g_J1939AddressTable[Entry].Address = Address;
+   memcpy(g_J1939AddressTable[Entry].Name,Name,8);
+   g_J1939AddressTable[Entry].LastSeen = J1939GetTick();
+   
+   J1939AddressTableLink(Entry);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//J1939AddressTableSeen()
+// Updates the last seen tick of the node a message was received from.
+//  Parameters: Address - Source Address of received message
+//  Returns:    Nothing
+////////////////////////////////////////////////////////////////////////////////
+void J1939AddressTableSeen(uint8_t Address)
+{
+   uint8_t Entry;
+   
+   Entry = J1939AddressTableFindAddress(Address);
+   
+   if(Entry != J1939_ADDRESS_NONE)
+      g_J1939AddressTable[Entry].LastSeen = J1939GetTick();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//J1939AddressTableFindAddress()
+// Finds the entry of an address through the address index.
+//  Parameters: Address - address to find
+//  Returns:    uint8_t - entry, J1939_ADDRESS_NONE if address isn't in table
+////////////////////////////////////////////////////////////////////////////////
+uint8_t J1939AddressTableFindAddress(uint8_t Address)
+{
+   uint8_t Slot;
+   uint8_t Entry;
+   
+   if(Address >= J1939_NULL_ADDRESS)
+      return(J1939_ADDRESS_NONE);
+   
+   Slot = J1939AddressHash(Address);
+   
+   while(TRUE)    //index is never full so probe ends at an unused slot
+   {
+      Entry = g_J1939AddressIndex[J1939_INDEX_ADDRESS][Slot];
+      
+      if((Entry == J1939_ADDRESS_NONE) || (g_J1939AddressTable[Entry].Address == Address))
+         return(Entry);
+      
+      Slot = (Slot + 1) & (J1939_ADDRESS_INDEX_SIZE - 1);
+   }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//J1939AddressTableFindName()
+// Finds the entry of a J1939 Name through the Name index.
+//  Parameters: Name - pointer to 8 byte J1939 Name to find
+//  Returns:    uint8_t - entry, J1939_ADDRESS_NONE if Name isn't in table
+////////////////////////////////////////////////////////////////////////////////
+uint8_t J1939AddressTableFindName(uint8_t *Name)
+{
+   uint8_t Slot;
+   uint8_t Entry;
+   uint8_t i;
+   
+   Slot = J1939NameHash(Name);
+   
+   while(TRUE)    //index is never full so probe ends at an unused slot
+   {
+      Entry = g_J1939AddressIndex[J1939_INDEX_NAME][Slot];
+      
+      if(Entry == J1939_ADDRESS_NONE)
+         return(Entry);
+      
+      for(i=0;i<8;i++)
+      {
+         if(g_J1939AddressTable[Entry].Name[i] != Name[i])
+            break;
+      }
+      
+      if(i >= 8)
+         return(Entry);
+      
+      Slot = (Slot + 1) & (J1939_ADDRESS_INDEX_SIZE - 1);
+   }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//J1939AddressTableHome()
+// Gets the slot an entry's probe starts at in one of the indexes.
+//  Parameters: Index - J1939_INDEX_ADDRESS or J1939_INDEX_NAME
+//              Entry - entry in address table
+//  Returns:    uint8_t - home slot of entry
+////////////////////////////////////////////////////////////////////////////////
+uint8_t J1939AddressTableHome(uint8_t Index, uint8_t Entry)
+{
+   if(Index == J1939_INDEX_ADDRESS)
+      return(J1939AddressHash(g_J1939AddressTable[Entry].Address));
+   else
+      return(J1939NameHash(g_J1939AddressTable[Entry].Name));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//J1939AddressTableLink()
+// Adds an entry to both indexes, in the first unused slot from its home slot.
+//  Parameters: Entry - entry in address table, Address and Name must be set
+//  Returns:    Nothing
+////////////////////////////////////////////////////////////////////////////////
+void J1939AddressTableLink(uint8_t Entry)
+{
+   uint8_t Index;
+   uint8_t Slot;
+   
+   for(Index=J1939_INDEX_ADDRESS;Index<=J1939_INDEX_NAME;Index++)
+   {
+      Slot = J1939AddressTableHome(Index, Entry);
+      
+      while(g_J1939AddressIndex[Index][Slot] != J1939_ADDRESS_NONE)
+         Slot = (Slot + 1) & (J1939_ADDRESS_INDEX_SIZE - 1);
+      
+      g_J1939AddressIndex[Index][Slot] = Entry;
+   }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//J1939AddressTableUnlink()
+// Removes an entry from both indexes and marks it unused.  Entries after it in
+// the same run of used slots are shifted back if their probe passes through
+// the emptied slot, so no deleted marks are needed.
+//  Parameters: Entry - entry in address table
+//  Returns:    Nothing
+////////////////////////////////////////////////////////////////////////////////
+void J1939AddressTableUnlink(uint8_t Entry)
+{
+   uint8_t Index;
+   uint8_t Empty;
+   uint8_t Slot;
+   uint8_t Home;
+   
+   for(Index=J1939_INDEX_ADDRESS;Index<=J1939_INDEX_NAME;Index++)
+   {
+      Empty = J1939AddressTableHome(Index, Entry);
+      
+      while(g_J1939AddressIndex[Index][Empty] != Entry)
+         Empty = (Empty + 1) & (J1939_ADDRESS_INDEX_SIZE - 1);
+      
+      g_J1939AddressIndex[Index][Empty] = J1939_ADDRESS_NONE;
+      Slot = Empty;
+      
+      while(TRUE)
+      {
+         Slot = (Slot + 1) & (J1939_ADDRESS_INDEX_SIZE - 1);
+         
+         if(g_J1939AddressIndex[Index][Slot] == J1939_ADDRESS_NONE)
+            break;
+         
+         Home = J1939AddressTableHome(Index, g_J1939AddressIndex[Index][Slot]);
+         
+         //leave entry if its home slot is after emptied slot, up to its slot
+         if(((uint8_t)(Slot - Home) & (J1939_ADDRESS_INDEX_SIZE - 1)) < ((uint8_t)(Slot - Empty) & (J1939_ADDRESS_INDEX_SIZE - 1)))
+            continue;
+         
+         g_J1939AddressIndex[Index][Empty] = g_J1939AddressIndex[Index][Slot];
+         g_J1939AddressIndex[Index][Slot] = J1939_ADDRESS_NONE;
+         Empty = Slot;
+      }
+   }
+   
+   g_J1939AddressTable[Entry].Address = J1939_NULL_ADDRESS;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//J1939AddressHash()
+// Hashes an address into the address index.
+//  Parameters: Address - address to hash
+//  Returns:    uint8_t - home slot in address index
+////////////////////////////////////////////////////////////////////////////////
+uint8_t J1939AddressHash(uint8_t Address)
+{
+   return((Address ^ (Address >> 4)) & (J1939_ADDRESS_INDEX_SIZE - 1));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//J1939NameHash()
+// Hashes a J1939 Name into the Name index, all 8 bytes are folded together so
+// nodes that only differ in Identity Number spread out.
+//  Parameters: Name - pointer to 8 byte J1939 Name to hash
+//  Returns:    uint8_t - home slot in Name index
+////////////////////////////////////////////////////////////////////////////////
+uint8_t J1939NameHash(uint8_t *Name)
+{
+   uint8_t Hash;
+   uint8_t i;
+   
+   Hash = 0;
+   
+   for(i=0;i<8;i++)
+      Hash = ((Hash << 1) | (Hash >> 7)) ^ Name[i];
+   
+   return((Hash ^ (Hash >> 4)) & (J1939_ADDRESS_INDEX_SIZE - 1));
+}
+#endif
+
+////////////////////////////////////////////////////////////////////////////////  Used Addresses
+
+////////////////////////////////////////////////////////////////////////////////
+//J1939AddressUse()
+// Marks address as claimed by another node in g_J1939AddressUsed.
+//  Parameters: Address - address claimed
+//  Returns:    Nothing
+////////////////////////////////////////////////////////////////////////////////
+void J1939AddressUse(uint8_t Address)
+{
+   if(bit_test(g_J1939AddressUsed[Address >> 3], Address & 7) == FALSE)
+   {
+      bit_set(g_J1939AddressUsed[Address >> 3], Address & 7);
+      
+     #ifdef J1939_EEPROM_ADDRESS
+      g_J1939EepromDirty = TRUE;
+      g_J1939EepromNext = 0;
+     #endif
+   }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//J1939AddressTaken()
+// Checks if address was claimed by another node since power up, or before
+// unit last saved its addresses to data EEPROM.
+//  Parameters: Address - address to check
+//  Returns:    TRUE - if address is known to be taken
+//              FALSE - if address isn't known to be taken
+////////////////////////////////////////////////////////////////////////////////
+int1 J1939AddressTaken(uint8_t Address)
+{
+   if(bit_test(g_J1939AddressUsed[Address >> 3], Address & 7))
+      return(TRUE);
+   
+   if(J1939AddressCA(Address) != J1939_CA_NONE)
+      return(TRUE);     //used by one of unit's controller applications
+   
+  #ifdef J1939_EEPROM_ADDRESS
+   if(g_J1939EepromValid && bit_test(read_eeprom(J1939_EEPROM_ADDRESS + J1939_EEPROM_USED + (Address >> 3)), Address & 7))
+      return(TRUE);
+  #endif
+   
+   return(FALSE);
+}
+
+#ifdef J1939_EEPROM_ADDRESS
+////////////////////////////////////////////////////////////////////////////////
+//J1939EepromLoad()
+// Called at power up, if data EEPROM holds saved addresses each Arbitrary
+// Address Capable controller application starts claiming from the address it
+// last claimed instead of its preferred address.  The saved used addresses are
+// left in EEPROM for J1939AddressTaken() until unit claims an address.
+//  Parameters: None
+//  Returns:    Nothing
+////////////////////////////////////////////////////////////////////////////////
+void J1939EepromLoad(void)
+{
+   uint8_t Address;
+   uint8_t CA;
+   
+   g_J1939EepromValid = (read_eeprom(J1939_EEPROM_ADDRESS + J1939_EEPROM_SIGNATURE) == J1939_EEPROM_VALID);
+   g_J1939EepromDirty = FALSE;
+   g_J1939EepromNext = 0;
+   
+   if(g_J1939EepromValid == FALSE)
+      return;
+   
+   for(CA=0;CA<J1939_CONTROLLER_APPS;CA++)
+   {
+      if(J1939NameArbitrary(g_J1939CA[CA].Name))
+      {
+         Address = read_eeprom(J1939_EEPROM_ADDRESS + J1939_EEPROM_CLAIMED + CA);
+         
+         if(Address < J1939_NULL_ADDRESS)
+            g_J1939CA[CA].Address = Address;
+      }
+   }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//J1939EepromTask()
+// While controller application 0 owns its address, writes the first byte of
+// the data EEPROM layout that differs from g_J1939AddressUsed, the claimed
+// addresses or the signature, so each call is held up by at most one EEPROM
+// write.  Address of a controller application that doesn't own one is left
+// as it was.  The signature is the last byte, it's only written once the rest
+// is.
+//  Parameters: None
+//  Returns:    Nothing
+////////////////////////////////////////////////////////////////////////////////
+void J1939EepromTask(void)
+{
+   uint8_t Value;
+   uint8_t CA;
+   
+   if((g_J1939EepromDirty == FALSE) || (J1939AddressClaimed(0) == FALSE))
+      return;
+   
+   while(g_J1939EepromNext < J1939_EEPROM_SIZE)
+   {
+      if((g_J1939EepromNext >= J1939_EEPROM_CLAIMED) && (g_J1939EepromNext < J1939_EEPROM_SIGNATURE))
+      {
+         CA = g_J1939EepromNext - J1939_EEPROM_CLAIMED;
+         
+         if(J1939AddressClaimed(CA))
+            Value = g_J1939CA[CA].Address;
+         else
+            Value = read_eeprom(J1939_EEPROM_ADDRESS + g_J1939EepromNext);
+      }
+      else if(g_J1939EepromNext == J1939_EEPROM_SIGNATURE)
+         Value = J1939_EEPROM_VALID;
+      else
+         Value = g_J1939AddressUsed[g_J1939EepromNext - J1939_EEPROM_USED];
+      
+      if(read_eeprom(J1939_EEPROM_ADDRESS + g_J1939EepromNext) != Value)
+      {
+         write_eeprom(J1939_EEPROM_ADDRESS + g_J1939EepromNext, Value);
+         return;
+      }
+      
+      g_J1939EepromNext++;
+   }
+   
+   g_J1939EepromNext = 0;
+   g_J1939EepromDirty = FALSE;
+}
+#endif
+
+////////////////////////////////////////////////////////////////////////////////  Timer Wheel
+
+////////////////////////////////////////////////////////////////////////////////
+//J1939TimerStart()
+// Starts a timer, a running timer is restarted.  The timer wheel is advanced
+// by J1939ReceiveTask(), so a timer expires within one J1939_TIMER_RESOLUTION
+// after Ticks if J1939ReceiveTask() is called often enough.  Starting, stopping
+// and expiring a timer takes the same time no matter how many are running.
+//  Parameters: Timer - timer to start, application timers are J1939_TIMER_USER
+//                      to J1939_TIMER_USER + J1939_USER_TIMERS - 1
+//              Ticks - number of ticks until timer expires, at most 65535
+//                      J1939_TIMER_RESOLUTION slots
+//              Callback - function called from J1939ReceiveTask() when timer
+//                         expires
+//  Returns:    Nothing
+////////////////////////////////////////////////////////////////////////////////
+void J1939TimerStart(uint8_t Timer, J1939_TICK_TYPE Ticks, J1939_TIMER_CALLBACK Callback)
+{
+   J1939_TICK_TYPE Slots;
+   
+   if(g_J1939Timer[Timer].Slot != J1939_TIMER_STOPPED)
+      J1939TimerUnlink(Timer);
+   
+   Ticks += J1939GetTickDifference(J1939GetTick(), g_J1939TimerTick);    //part of current slot already elapsed
+   Slots = (Ticks + (J1939_TIMER_RESOLUTION - 1)) / J1939_TIMER_RESOLUTION;
+   
+   if(Slots == 0)
+      Slots = 1;
+   
+   g_J1939Timer[Timer].Expiry = g_J1939TimerNow + (uint16_t)Slots;
+   g_J1939Timer[Timer].Callback = Callback;
+   
+   J1939TimerLink(Timer);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//J1939TimerStop()
+// Stops a timer, nothing is done if timer isn't running.
+//  Parameters: Timer - timer to stop
+//  Returns:    Nothing
+////////////////////////////////////////////////////////////////////////////////
+void J1939TimerStop(uint8_t Timer)
+{
+   if(g_J1939Timer[Timer].Slot != J1939_TIMER_STOPPED)
+      J1939TimerUnlink(Timer);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//J1939TimerRunning()
+// Checks if a timer is running.
+//  Parameters: Timer - timer to check
+//  Returns:    True - if timer is running
+//              False - if timer is stopped or has expired
+////////////////////////////////////////////////////////////////////////////////
+int1 J1939TimerRunning(uint8_t Timer)
+{
+   return(g_J1939Timer[Timer].Slot != J1939_TIMER_STOPPED);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//J1939TimerInit()
+// Stops all timers and empties the timer wheel.
+//  Parameters: None
+//  Returns:    Nothing
+////////////////////////////////////////////////////////////////////////////////
+void J1939TimerInit(void)
+{
+   uint8_t i;
+   
+   for(i=0;i<J1939_TIMERS;i++)
+      g_J1939Timer[i].Slot = J1939_TIMER_STOPPED;
+   
+   for(i=0;i<(J1939_TIMER_SLOTS0 + J1939_TIMER_SLOTS1);i++)
+      g_J1939TimerWheel[i] = J1939_TIMER_NONE;
+   
+   g_J1939TimerNow = 0;
+   g_J1939TimerTick = J1939GetTick();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//J1939TimerTask()
+// Advances the timer wheel one slot for each J1939_TIMER_RESOLUTION ticks that
+// have elapsed.  Each time level 0 wraps the next level 1 slot is cascaded down
+// into level 0, then every timer in the current level 0 slot has expired.
+//  Parameters: None
+//  Returns:    Nothing
+////////////////////////////////////////////////////////////////////////////////
+void J1939TimerTask(void)
+{
+   uint8_t Slot;
+   uint8_t Timer;
+   uint8_t Next;
+   
+   while(J1939GetTickDifference(J1939GetTick(), g_J1939TimerTick) >= J1939_TIMER_RESOLUTION)
+   {
+      g_J1939TimerTick += J1939_TIMER_RESOLUTION;
+      g_J1939TimerNow++;
+      
+      Slot = g_J1939TimerNow & (J1939_TIMER_SLOTS0 - 1);
+      
+      if(Slot == 0)
+      {
+         Slot = J1939_TIMER_SLOTS0 + ((g_J1939TimerNow >> J1939_TIMER_SHIFT) & (J1939_TIMER_SLOTS1 - 1));
+         
+         Timer = g_J1939TimerWheel[Slot];
+         g_J1939TimerWheel[Slot] = J1939_TIMER_NONE;  //detach whole slot, timers longer than wheel relink into it
+         
+         while(Timer != J1939_TIMER_NONE)
+         {
+            Next = g_J1939Timer[Timer].Next;
+            J1939TimerLink(Timer);
+            Timer = Next;
+         }
+         
+         Slot = 0;
+      }
+      
+      //callback may start or stop timers, they are never linked into current slot
+      while(g_J1939TimerWheel[Slot] != J1939_TIMER_NONE)
+      {
+         Timer = g_J1939TimerWheel[Slot];
+         J1939TimerUnlink(Timer);
+         (*g_J1939Timer[Timer].Callback)(Timer);
+      }
+   }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//J1939TimerLink()
+// Links a timer into the slot of the timer wheel for its expiry.  Timers
+// expiring within level 0 are linked into level 0, timers expiring within
+// level 1 are linked into level 1 and longer timers are linked into the last
+// level 1 slot to be cascaded.
+//  Parameters: Timer - timer to link, Expiry must be set
+//  Returns:    Nothing
+////////////////////////////////////////////////////////////////////////////////
+void J1939TimerLink(uint8_t Timer)
+{
+   uint16_t Remaining;
+   uint8_t Slot;
+   
+   Remaining = g_J1939Timer[Timer].Expiry - g_J1939TimerNow;
+   
+   if(Remaining < J1939_TIMER_SLOTS0)
+      Slot = g_J1939Timer[Timer].Expiry & (J1939_TIMER_SLOTS0 - 1);
+   else if(Remaining < (J1939_TIMER_SLOTS0 * J1939_TIMER_SLOTS1))
+      Slot = J1939_TIMER_SLOTS0 + ((g_J1939Timer[Timer].Expiry >> J1939_TIMER_SHIFT) & (J1939_TIMER_SLOTS1 - 1));
+   else
+      Slot = J1939_TIMER_SLOTS0 + ((g_J1939TimerNow >> J1939_TIMER_SHIFT) & (J1939_TIMER_SLOTS1 - 1));
+   
+   g_J1939Timer[Timer].Slot = Slot;
+   g_J1939Timer[Timer].Prev = J1939_TIMER_NONE;
+   g_J1939Timer[Timer].Next = g_J1939TimerWheel[Slot];
+   
+   if(g_J1939TimerWheel[Slot] != J1939_TIMER_NONE)
+      g_J1939Timer[g_J1939TimerWheel[Slot]].Prev = Timer;
+   
+   g_J1939TimerWheel[Slot] = Timer;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//J1939TimerUnlink()
+// Removes a timer from its slot of the timer wheel and marks it stopped.
+//  Parameters: Timer - timer to unlink, must be running
+//  Returns:    Nothing
+////////////////////////////////////////////////////////////////////////////////
+void J1939TimerUnlink(uint8_t Timer)
+{
+   uint8_t Next;
+   uint8_t Prev;
+   
+   Next = g_J1939Timer[Timer].Next;
+   Prev = g_J1939Timer[Timer].Prev;
+   
+   if(Prev == J1939_TIMER_NONE)
+      g_J1939TimerWheel[g_J1939Timer[Timer].Slot] = Next;
+   else
+      g_J1939Timer[Prev].Next = Next;
+   
+   if(Next != J1939_TIMER_NONE)
+      g_J1939Timer[Next].Prev = Prev;
+   
+   g_J1939Timer[Timer].Slot = J1939_TIMER_STOPPED;
+}
+
+////////////////////////////////////////////////////////////////////////////////  Transport Protocol
+#if J1939_TP_SESSIONS > 0
+
+#if J1939_TP_BLOCKS > 0
+////////////////////////////////////////////////////////////////////////////////
+//J1939TPKbhit()
+// Checks for a packeted message received with the Transport Protocol or a
+// Fast Packet message.
+//  Parameters: None
+//  Returns: True - if a packeted message has been received
+//           False - if no packeted message has been received
+////////////////////////////////////////////////////////////////////////////////
+int1 J1939TPKbhit(void)
+{
+   uint8_t i;
+   
+   for(i=0;i<J1939_TP_SESSIONS;i++)
+   {
+      if(g_J1939TPSession[i].State == J1939_TP_STATE_COMPLETE)
+         return(TRUE);
+   }
+   
+   return(FALSE);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//J1939TPGetMessage()
+// Retrieves a packeted message received with the Transport Protocol or a Fast
+// Packet message and returns its blocks to the Transport Protocol pool.
+//  Parameters: PDU - PDU structure to return message's PDU to, PDU Format and
+//                    Destination Address (Group Extension) are those of the
+//                    packeted message's PGN
+//              Data - pointer to return data to
+//              MaxLength - size of Data, any bytes past MaxLength are lost
+//              Length - variable to return message length to
+//  Returns:    True - if packeted message was retrieved
+//              False - if there was no packeted message to retrieve
+////////////////////////////////////////////////////////////////////////////////
+int1 J1939TPGetMessage(J1939_PDU_STRUCT &PDU, uint8_t *Data, uint16_t MaxLength, uint16_t &Length)
+{
+   J1939_TP_SESSION_STRUCT *Session;
+   uint8_t i;
+   
+   for(i=0;i<J1939_TP_SESSIONS;i++)
+   {
+      if(g_J1939TPSession[i].State == J1939_TP_STATE_COMPLETE)
+         break;
+   }
+   
+   if(i >= J1939_TP_SESSIONS)
+      return(FALSE);
+   
+   Session = &g_J1939TPSession[i];
+   
+   memcpy(&PDU,&Session->PDU,sizeof(J1939_PDU_STRUCT));
+   Length = Session->Size;
+   
+   if(MaxLength > Session->Size)
+      MaxLength = Session->Size;
+   
+   J1939TPCopy(Session,0,Data,MaxLength);
+   
+   J1939TPCloseSession(Session);
+   
+   return(TRUE);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//J1939TPPoolPeak()
+// Returns the highest number of Transport Protocol pool blocks that were in use
+// at the same time, used to size J1939_TP_BLOCKS for an application.
+//  Parameters: None
+//  Returns:    uint8_t - peak number of blocks used, multiply by
+//                        J1939_TP_BLOCK_SIZE for bytes
+////////////////////////////////////////////////////////////////////////////////
+uint8_t J1939TPPoolPeak(void)
+{
+   return(g_J1939TPPoolPeak);
+}
+#endif
+
+#if J1939_TP_SINKS > 0
+////////////////////////////////////////////////////////////////////////////////
+//J1939TPRegisterSink()
+// Registers a sink for a PGN.  Each in order TP.DT packet of a BAM or RTS/CTS
+// packeted message with that PGN is passed to the sink as it is received
+// instead of being stored in the Transport Protocol pool, so packeted messages
+// larger than the pool can be received.  The sink is called with a Length of 0
+// if the session is aborted or times out before the message is complete.
+//  Parameters: PGN - Parameter Group Number to stream to sink
+//              Sink - function to call with each packet, 0 to unregister PGN
+//  Returns:    True - if sink was registered or unregistered
+//              False - if all J1939_TP_SINKS entries are in use
+////////////////////////////////////////////////////////////////////////////////
+int1 J1939TPRegisterSink(uint32_t PGN, J1939_TP_SINK Sink)
+{
+   uint8_t i;
+   
+   i = J1939TPFindSink(PGN);
+   
+   if(i == J1939_TP_NO_SINK)
+   {
+      if(Sink == 0)
+         return(TRUE);
+      
+      for(i=0;i<J1939_TP_SINKS;i++)
+      {
+         if(g_J1939TPSink[i].Sink == 0)
+            break;
+      }
+      
+      if(i >= J1939_TP_SINKS)
+         return(FALSE);
+   }
+   
+   g_J1939TPSink[i].PGN = PGN;
+   g_J1939TPSink[i].Sink = Sink;
+   
+   return(TRUE);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//J1939TPFindSink()
+// Finds the sink registered for a PGN.
+//  Parameters: PGN - Parameter Group Number of packeted message
+//  Returns:    uint8_t - index into g_J1939TPSink, J1939_TP_NO_SINK if PGN
+//                        has no sink
+////////////////////////////////////////////////////////////////////////////////
+uint8_t J1939TPFindSink(uint32_t PGN)
+{
+   uint8_t i;
+   
+   for(i=0;i<J1939_TP_SINKS;i++)
+   {
+      if((g_J1939TPSink[i].Sink != 0) && (g_J1939TPSink[i].PGN == PGN))
+         return(i);
+   }
+   
+   return(J1939_TP_NO_SINK);
+}
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//J1939TPInit()
+// Closes all Transport Protocol sessions and links every block of the
+// Transport Protocol pool into the free list.
+//  Parameters: None
+//  Returns:    Nothing
+////////////////////////////////////////////////////////////////////////////////
+void J1939TPInit(void)
+{
+   uint8_t i;
+   
+  #if J1939_TP_BLOCKS > 0
+   for(i=0;i<(J1939_TP_BLOCKS - 1);i++)
+      g_J1939TPPoolLink[i] = i + 1;
+   
+   g_J1939TPPoolLink[J1939_TP_BLOCKS - 1] = J1939_TP_NO_BLOCK;
+   
+   g_J1939TPPoolFree = 0;
+   g_J1939TPPoolUsed = 0;
+   g_J1939TPPoolPeak = 0;
+   g_J1939TPPoolReserved = 0;
+  #endif
+   
+   g_J1939TPCMNextOut = 0;
+   g_J1939TPCMCount = 0;
+   
+  #if J1939_TP_SINKS > 0
+   for(i=0;i<J1939_TP_SINKS;i++)
+      g_J1939TPSink[i].Sink = 0;
+  #endif
+   
+  #if J1939_FP_PGNS > 0
+   for(i=0;i<J1939_FP_PGNS;i++)
+      g_J1939FPPGN[i].PGN = 0;
+   
+   g_J1939FPXmitSession = J1939_FP_NONE;
+  #endif
+   
+   for(i=0;i<J1939_TP_INDEX_SIZE;i++)
+      g_J1939TPIndex[i] = J1939_TP_INDEX_EMPTY;
+   
+   for(i=0;i<J1939_TP_SESSIONS;i++)
+   {
+      g_J1939TPSession[i].State = J1939_TP_STATE_IDLE;
+      g_J1939TPSession[i].Blocks = 0;
+      g_J1939TPSession[i].Reserved = 0;
+      g_J1939TPSession[i].Timer = J1939_TIMER_TP + i;
+      g_J1939TPSession[i].Index = J1939_TP_NOT_INDEXED;
+   }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//J1939TPTimeout()
+// Called when a session's timer expires.  A BAM session is closed if next TP.DT
+// isn't received within T1, a RTS/CTS session is aborted if next TP.DT isn't
+// received within T1, or T2 after sending a TP.CM_CTS.
+//  Parameters: Timer - timer of session
+//  Returns:    Nothing
+////////////////////////////////////////////////////////////////////////////////
+void J1939TPTimeout(uint8_t Timer)
+{
+   J1939TPAbort(&g_J1939TPSession[Timer - J1939_TIMER_TP], J1939_TP_ABORT_TIMEOUT);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//J1939TPReceive()
+// Handles a received TP.CM or TP.DT message.
+//  Parameters: ReceivedPDU - the PDU of received message
+//              Data - pointer to the 8 data bytes of received message
+//  Returns:    Nothing
+////////////////////////////////////////////////////////////////////////////////
+void J1939TPReceive(J1939_PDU_STRUCT ReceivedPDU, uint8_t *Data)
+{
+   if(ReceivedPDU.PDUFormat == J1939_PF_PT_CM)
+      J1939TPReceiveCM(ReceivedPDU,Data);
+   else
+      J1939TPReceiveDT(ReceivedPDU,Data);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//J1939TPReceiveCM()
+// Handles a received TP.CM message.  A BAM opens a session, a RTS opens a
+// session if there is a free session and either a sink registered for the PGN
+// or enough unreserved free blocks in the Transport Protocol pool for the whole
+// message, which are then reserved for the session until it's closed, and
+// responds with a TP.CM_CTS, otherwise responds with a TP.CM_Abort.  A
+// TP.CM_Abort closes the matching session.
+//  Parameters: ReceivedPDU - the PDU of received TP.CM message
+//              Data - pointer to the 8 data bytes of received TP.CM message
+//  Returns:    Nothing
+////////////////////////////////////////////////////////////////////////////////
+void J1939TPReceiveCM(J1939_PDU_STRUCT ReceivedPDU, uint8_t *Data)
+{
+   J1939_TP_SESSION_STRUCT *Session;
+   uint8_t Response[8];
+   uint16_t Size;
+   int1 Valid;
+  #if J1939_TP_BLOCKS > 0
+   uint8_t Blocks;
+  #endif
+   
+   Size = make16(Data[2],Data[1]);
+   Valid = (Size > 8) && (Size <= J1939_TP_MAX_SIZE) && (Data[3] == ((Size + 6) / 7));
+   
+   switch(Data[0])
+   {
+      case J1939_TP_CM_BAM:
+         if(Valid && (ReceivedPDU.DestinationAddress == J1939_GLOBAL_ADDRESS))
+         {
+            Session = J1939TPOpenSession(ReceivedPDU,Data);
+            
+            if(Session != 0)
+               Session->State = J1939_TP_STATE_BAM;
+         }
+         break;
+      case J1939_TP_CM_RTS:
+         if(Valid && J1939OwnAddress(ReceivedPDU.DestinationAddress))
+         {
+            Session = J1939TPOpenSession(ReceivedPDU,Data);
+            
+            if(Session == 0)
+            {
+               Response[0] = J1939_TP_CM_ABORT;
+               Response[1] = J1939_TP_ABORT_BUSY;
+               Response[2] = 0xFF;
+               Response[3] = 0xFF;
+               Response[4] = 0xFF;
+               
+               J1939TPSendCM(ReceivedPDU.DestinationAddress, ReceivedPDU.SourceAddress, make32(0,Data[7],Data[6],Data[5]), Response);
+            }
+            else
+            {
+               Session->State = J1939_TP_STATE_RTS;
+               
+               if((Data[4] == 0) || (Data[4] > J1939_TP_CTS_PACKETS))   //0xFF means sender has no limit
+                  Session->WindowSize = J1939_TP_CTS_PACKETS;
+               else
+                  Session->WindowSize = Data[4];
+               
+              #if J1939_TP_SINKS > 0
+               if(Session->Sink != J1939_TP_NO_SINK)
+                  J1939TPSendCTS(Session);
+               else
+              #endif
+              #if J1939_TP_BLOCKS > 0
+               {
+                  Blocks = (Size + (J1939_TP_BLOCK_SIZE - 1)) / J1939_TP_BLOCK_SIZE;
+                  
+                  if(Blocks <= (J1939_TP_BLOCKS - g_J1939TPPoolUsed - g_J1939TPPoolReserved))
+                  {
+                     Session->Reserved = Blocks;      //other sessions can't take blocks this one was promised
+                     g_J1939TPPoolReserved += Blocks;
+                     J1939TPSendCTS(Session);
+                  }
+                  else
+                     J1939TPAbort(Session, J1939_TP_ABORT_RESOURCES);
+               }
+              #else
+                  J1939TPAbort(Session, J1939_TP_ABORT_RESOURCES);
+              #endif
+            }
+         }
+         break;
+      case J1939_TP_CM_ABORT:
+         Session = J1939TPFindSession(ReceivedPDU.SourceAddress, ReceivedPDU.DestinationAddress);
+         
+         if(Session != 0)
+            J1939TPCloseSession(Session);
+         break;
+   }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//J1939TPReceiveDT()
+// Handles a received TP.DT message.  Stores the packet's data in the matching
+// session, and for RTS/CTS sessions sends the next TP.CM_CTS or the
+// TP.CM_EndOfMsgAck when the message is complete.
+//  Parameters: ReceivedPDU - the PDU of received TP.DT message
+//              Data - pointer to the 8 data bytes of received TP.DT message
+//  Returns:    Nothing
+////////////////////////////////////////////////////////////////////////////////
+void J1939TPReceiveDT(J1939_PDU_STRUCT ReceivedPDU, uint8_t *Data)
+{
+   J1939_TP_SESSION_STRUCT *Session;
+   uint8_t Response[8];
+   uint8_t Length;
+   
+   Session = J1939TPFindSession(ReceivedPDU.SourceAddress, ReceivedPDU.DestinationAddress);
+   
+   if(Session == 0)
+      return;
+   
+   if(Data[0] != Session->NextSequence)
+   {
+      J1939TPAbort(Session, J1939_TP_ABORT_SEQUENCE);
+      return;
+   }
+   
+   Length = 7;
+   
+   if((Session->Size - Session->Count) < 7)
+      Length = Session->Size - Session->Count;   //last packet, unused bytes are 0xFF
+   
+   if(J1939TPStore(Session,&Data[1],Length) == FALSE)
+   {
+      J1939TPAbort(Session, J1939_TP_ABORT_RESOURCES);
+      return;
+   }
+   
+   Session->NextSequence++;
+   
+   if(Session->Count >= Session->Size)
+   {
+      if(Session->State == J1939_TP_STATE_RTS)
+      {
+         Response[0] = J1939_TP_CM_EOF;
+         Response[1] = make8(Session->Size,0);
+         Response[2] = make8(Session->Size,1);
+         Response[3] = Session->Packets;
+         Response[4] = 0xFF;
+         
+         J1939TPSendCM(Session->Destination, Session->PDU.SourceAddress, Session->PGN, Response);
+      }
+      
+      J1939TPComplete(Session);
+   }
+   else if((Session->State == J1939_TP_STATE_RTS) && (Data[0] == Session->WindowEnd))
+      J1939TPSendCTS(Session);
+   else
+      J1939TimerStart(Session->Timer, J1939_TP_T1, J1939TPTimeout);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//J1939TPSendCM()
+// Loads a TP.CM message into transmit buffer.  If transmit buffer is full, or
+// earlier TP.CM messages are still waiting, it's kept in g_J1939TPCMBuffer
+// instead so a TP.CM_CTS or TP.CM_EndOfMsgAck isn't lost.
+//  Parameters: SourceAddress - address of unit's controller application in
+//                              session
+//              DestinationAddress - address of other node of session
+//              PGN - Parameter Group Number of packeted message, loaded into
+//                    bytes 5 to 7 of Data
+//              Data - pointer to 8 data bytes of TP.CM message, bytes 0 to 4
+//                     must be set by caller
+//  Returns:    Nothing
+////////////////////////////////////////////////////////////////////////////////
+void J1939TPSendCM(uint8_t SourceAddress, uint8_t DestinationAddress, uint32_t PGN, uint8_t *Data)
+{
+   J1939_PDU_STRUCT PDU;
+   uint8_t Entry;
+   
+   PDU.SourceAddress = SourceAddress;
+   PDU.DestinationAddress = DestinationAddress;
+   PDU.PDUFormat = J1939_PF_PT_CM;
+   PDU.DataPage = 0;
+   PDU.ExtendedDataPage = 0;
+   PDU.Priority = J1939_TP_CM_PRIORITY;
+   
+   Data[5] = make8(PGN,0);
+   Data[6] = make8(PGN,1);
+   Data[7] = make8(PGN,2);
+   
+   if(g_J1939TPCMCount == 0)
+   {
+      if(J1939PutMessage(PDU,Data,8))
+         return;
+   }
+   
+   if(g_J1939TPCMCount < J1939_TP_SESSIONS)    //each session waits on at most one TP.CM
+   {
+      Entry = g_J1939TPCMNextOut + g_J1939TPCMCount;
+      
+      if(Entry >= J1939_TP_SESSIONS)
+         Entry -= J1939_TP_SESSIONS;
+      
+      memcpy(&g_J1939TPCMBuffer[Entry].PDU,&PDU,sizeof(J1939_PDU_STRUCT));
+      memcpy(g_J1939TPCMBuffer[Entry].Data,Data,8);
+      g_J1939TPCMBuffer[Entry].Length = 8;
+      
+      g_J1939TPCMCount++;
+   }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//J1939TPCMXmitTask()
+// Sends TP.CM messages kept in g_J1939TPCMBuffer by J1939TPSendCM(), called by
+// J1939XmitTask() ahead of transmit buffer.
+//  Parameters: None
+//  Returns:    Nothing
+////////////////////////////////////////////////////////////////////////////////
+void J1939TPCMXmitTask(void)
+{
+   while((g_J1939TPCMCount > 0) && can_tbe())
+   {
+      if(J1939SourceClaimed(g_J1939TPCMBuffer[g_J1939TPCMNextOut].PDU.SourceAddress))
+         can_putd(g_J1939TPCMBuffer[g_J1939TPCMNextOut].PDU,g_J1939TPCMBuffer[g_J1939TPCMNextOut].Data,8,3,TRUE,FALSE);
+      
+      if(++g_J1939TPCMNextOut >= J1939_TP_SESSIONS)
+         g_J1939TPCMNextOut = 0;
+      
+      g_J1939TPCMCount--;
+   }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//J1939TPSendCTS()
+// Sends a TP.CM_CTS requesting the next window of packets of a RTS/CTS session.
+//  Parameters: Session - pointer to session
+//  Returns:    Nothing
+////////////////////////////////////////////////////////////////////////////////
+void J1939TPSendCTS(J1939_TP_SESSION_STRUCT *Session)
+{
+   uint8_t Data[8];
+   uint8_t Packets;
+   
+   Packets = Session->Packets - Session->NextSequence + 1;
+   
+   if(Packets > Session->WindowSize)
+      Packets = Session->WindowSize;
+   
+   Session->WindowEnd = Session->NextSequence + Packets - 1;
+   
+   Data[0] = J1939_TP_CM_CTS;
+   Data[1] = Packets;
+   Data[2] = Session->NextSequence;
+   Data[3] = 0xFF;
+   Data[4] = 0xFF;
+   
+   J1939TPSendCM(Session->Destination, Session->PDU.SourceAddress, Session->PGN, Data);
+   
+   J1939TimerStart(Session->Timer, J1939_TP_T2, J1939TPTimeout);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//J1939TPAbort()
+// Closes a session, if it is a RTS/CTS session a TP.CM_Abort is also sent to
+// the originator.  BAM sessions are closed silently.
+//  Parameters: Session - pointer to session
+//              Reason - Connection Abort reason
+//  Returns:    Nothing
+////////////////////////////////////////////////////////////////////////////////
+void J1939TPAbort(J1939_TP_SESSION_STRUCT *Session, uint8_t Reason)
+{
+   uint8_t Data[8];
+   
+   if(Session->State == J1939_TP_STATE_RTS)
+   {
+      Data[0] = J1939_TP_CM_ABORT;
+      Data[1] = Reason;
+      Data[2] = 0xFF;
+      Data[3] = 0xFF;
+      Data[4] = 0xFF;
+      
+      J1939TPSendCM(Session->Destination, Session->PDU.SourceAddress, Session->PGN, Data);
+   }
+   
+   J1939TPCloseSession(Session);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//J1939TPFindSession()
+// Finds the open session of a TP.CM or TP.DT message in the session index.
+//  Parameters: SourceAddress - Source Address of received message
+//              Destination - Destination Address of received message
+//  Returns:    pointer to session, 0 if there is no open session
+////////////////////////////////////////////////////////////////////////////////
+J1939_TP_SESSION_STRUCT *J1939TPFindSession(uint8_t SourceAddress, uint8_t Destination)
+{
+   J1939_TP_SESSION_STRUCT *Session;
+   uint8_t Slot;
+   uint8_t i;
+   
+   Slot = J1939TPIndexHash(SourceAddress, Destination);
+   
+   for(i=0;i<J1939_TP_INDEX_SIZE;i++)
+   {
+      if(g_J1939TPIndex[Slot] == J1939_TP_INDEX_EMPTY)
+         break;
+      
+      Session = &g_J1939TPSession[g_J1939TPIndex[Slot]];
+      
+      if(((Session->State == J1939_TP_STATE_BAM) || (Session->State == J1939_TP_STATE_RTS)) &&
+         (Session->PDU.SourceAddress == SourceAddress) && (Session->Destination == Destination))
+      {
+         return(Session);
+      }
+      
+      Slot = (Slot + 1) & (J1939_TP_INDEX_SIZE - 1);
+   }
+   
+   return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//J1939TPIdleSession()
+// Finds a session that isn't in use.
+//  Parameters: None
+//  Returns:    pointer to idle session, 0 if all sessions are in use
+////////////////////////////////////////////////////////////////////////////////
+J1939_TP_SESSION_STRUCT *J1939TPIdleSession(void)
+{
+   uint8_t i;
+   
+   for(i=0;i<J1939_TP_SESSIONS;i++)
+   {
+      if(g_J1939TPSession[i].State == J1939_TP_STATE_IDLE)
+         return(&g_J1939TPSession[i]);
+   }
+   
+   return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//J1939TPIndexHash()
+// Gets the first slot of the session index to probe for a session.
+//  Parameters: SourceAddress - Source Address of session
+//              Key - Destination Address of Transport Protocol session, see
+//                    J1939FPIndexKey() for Fast Packet session
+//  Returns:    uint8_t - slot of session index
+////////////////////////////////////////////////////////////////////////////////
+uint8_t J1939TPIndexHash(uint8_t SourceAddress, uint8_t Key)
+{
+   return((SourceAddress ^ (Key << 1) ^ (Key >> 4)) & (J1939_TP_INDEX_SIZE - 1));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//J1939TPIndexInsert()
+// Adds a session being received to the session index, in the first empty slot
+// from its hash.  The index is larger than the number of sessions so there is
+// always an empty slot.
+//  Parameters: Session - pointer to session, PDU.SourceAddress must be set
+//              Key - Destination Address of Transport Protocol session, see
+//                    J1939FPIndexKey() for Fast Packet session
+//  Returns:    Nothing
+////////////////////////////////////////////////////////////////////////////////
+void J1939TPIndexInsert(J1939_TP_SESSION_STRUCT *Session, uint8_t Key)
+{
+   uint8_t Slot;
+   
+   Slot = J1939TPIndexHash(Session->PDU.SourceAddress, Key);
+   
+   while(g_J1939TPIndex[Slot] != J1939_TP_INDEX_EMPTY)
+      Slot = (Slot + 1) & (J1939_TP_INDEX_SIZE - 1);
+   
+   g_J1939TPIndex[Slot] = J1939TPSessionNumber(Session);
+   Session->Index = Slot;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//J1939TPIndexRemove()
+// Removes a session from the session index.  Sessions after it in the same
+// run of used slots are shifted back into the emptied slot if their probe
+// passes through it, so a probe never has to skip over removed sessions.
+//  Parameters: Session - pointer to session
+//  Returns:    Nothing
+////////////////////////////////////////////////////////////////////////////////
+void J1939TPIndexRemove(J1939_TP_SESSION_STRUCT *Session)
+{
+   J1939_TP_SESSION_STRUCT *Moved;
+   uint8_t Empty;
+   uint8_t Slot;
+   uint8_t Home;
+   
+   if(Session->Index == J1939_TP_NOT_INDEXED)
+      return;
+   
+   Empty = Session->Index;
+   Slot = Empty;
+   
+   g_J1939TPIndex[Empty] = J1939_TP_INDEX_EMPTY;
+   Session->Index = J1939_TP_NOT_INDEXED;
+   
+   while(TRUE)
+   {
+      Slot = (Slot + 1) & (J1939_TP_INDEX_SIZE - 1);
+      
+      if(g_J1939TPIndex[Slot] == J1939_TP_INDEX_EMPTY)
+         break;
+      
+      Moved = &g_J1939TPSession[g_J1939TPIndex[Slot]];
+      Home = J1939TPIndexHash(Moved->PDU.SourceAddress, J1939TPIndexKey(Moved));
+      
+      //leave session if its home slot is after emptied slot, up to its slot
+      if(((Slot - Home) & (J1939_TP_INDEX_SIZE - 1)) < ((Slot - Empty) & (J1939_TP_INDEX_SIZE - 1)))
+         continue;
+      
+      g_J1939TPIndex[Empty] = g_J1939TPIndex[Slot];
+      g_J1939TPIndex[Slot] = J1939_TP_INDEX_EMPTY;
+      Moved->Index = Empty;
+      Empty = Slot;
+   }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//J1939TPIndexKey()
+// Gets the key a session is hashed by in the session index.
+//  Parameters: Session - pointer to session in index
+//  Returns:    uint8_t - Destination Address, see J1939FPIndexKey() for Fast
+//                        Packet session
+////////////////////////////////////////////////////////////////////////////////
+uint8_t J1939TPIndexKey(J1939_TP_SESSION_STRUCT *Session)
+{
+  #if J1939_FP_PGNS > 0
+   if(Session->State == J1939_TP_STATE_FAST)
+      return(J1939FPIndexKey(Session->PGN));
+  #endif
+   
+   return(Session->Destination);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//J1939TPOpenSession()
+// Opens a session for a received BAM or RTS.  A new announcement from a node
+// that already has an open session with same destination replaces that
+// session.  The session is streamed to the sink registered for the PGN, if
+// there is one.
+//  Parameters: ReceivedPDU - the PDU of received TP.CM message
+//              Data - pointer to the 8 data bytes of received TP.CM message
+//  Returns:    pointer to opened session, 0 if all sessions are in use or
+//              message can't be stored
+////////////////////////////////////////////////////////////////////////////////
+J1939_TP_SESSION_STRUCT *J1939TPOpenSession(J1939_PDU_STRUCT ReceivedPDU, uint8_t *Data)
+{
+   J1939_TP_SESSION_STRUCT *Session;
+  #if J1939_TP_SINKS > 0
+   uint8_t Sink;
+   
+   Sink = J1939TPFindSink(make32(0,Data[7],Data[6],Data[5]));
+   
+  #if J1939_TP_BLOCKS == 0
+   if(Sink == J1939_TP_NO_SINK)     //no pool to store message in
+      return(0);
+  #endif
+  #endif
+   
+   Session = J1939TPFindSession(ReceivedPDU.SourceAddress, ReceivedPDU.DestinationAddress);
+   
+   if(Session != 0)
+      J1939TPCloseSession(Session);
+   else
+   {
+      Session = J1939TPIdleSession();
+      
+      if(Session == 0)
+         return(0);
+   }
+   
+   Session->PGN = make32(0,Data[7],Data[6],Data[5]);
+   Session->Destination = ReceivedPDU.DestinationAddress;
+   Session->Size = make16(Data[2],Data[1]);
+   Session->Count = 0;
+   Session->Packets = Data[3];
+   Session->NextSequence = 1;
+   J1939TimerStart(Session->Timer, J1939_TP_T1, J1939TPTimeout);
+  #if J1939_TP_SINKS > 0
+   Session->Sink = Sink;
+  #endif
+   
+   Session->PDU.SourceAddress = ReceivedPDU.SourceAddress;
+   Session->PDU.PDUFormat = make8(Session->PGN,1);
+   Session->PDU.DataPage = bit_test(Session->PGN,16);
+   Session->PDU.ExtendedDataPage = bit_test(Session->PGN,17);
+   Session->PDU.Priority = ReceivedPDU.Priority;
+   
+   if(Session->PDU.PDUFormat < 240)
+      Session->PDU.DestinationAddress = ReceivedPDU.DestinationAddress;    //PDU1, destination specific
+   else
+      Session->PDU.DestinationAddress = make8(Session->PGN,0);             //PDU2, Group Extension
+   
+   J1939TPIndexInsert(Session, Session->Destination);
+   
+   return(Session);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//J1939TPCloseSession()
+// Closes a session and returns its whole chain of blocks to the free list of
+// the Transport Protocol pool.  The sink of a streamed session that is closed
+// before it is complete is called with a Length of 0, after the session is
+// released so the sink can reopen it.
+//  Parameters: Session - pointer to session
+//  Returns:    Nothing
+////////////////////////////////////////////////////////////////////////////////
+void J1939TPCloseSession(J1939_TP_SESSION_STRUCT *Session)
+{
+  #if J1939_TP_SINKS > 0
+   J1939_TP_SINK Sink;
+  #endif
+   
+   J1939TPIndexRemove(Session);
+   J1939TimerStop(Session->Timer);
+   
+  #if J1939_TP_BLOCKS > 0
+   if(Session->Blocks > 0)
+   {
+      g_J1939TPPoolLink[Session->LastBlock] = g_J1939TPPoolFree;
+      g_J1939TPPoolFree = Session->FirstBlock;
+      g_J1939TPPoolUsed -= Session->Blocks;
+   }
+   
+   g_J1939TPPoolReserved -= Session->Reserved;
+   Session->Reserved = 0;
+  #endif
+   
+   Session->Blocks = 0;
+   
+  #if J1939_TP_SINKS > 0
+   if((Session->Sink != J1939_TP_NO_SINK) && (Session->State != J1939_TP_STATE_COMPLETE))
+   {
+      Sink = g_J1939TPSink[Session->Sink].Sink;
+      Session->State = J1939_TP_STATE_IDLE;     //session can be reopened from sink
+      
+      if(Sink != 0)
+         (*Sink)(Session, Session->Count, 0, 0);
+      
+      return;     //session may belong to a new message now, leave it alone
+   }
+  #endif
+   
+   Session->State = J1939_TP_STATE_IDLE;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//J1939TPStore()
+// Passes received data to the session's sink or appends it to the session's
+// chain of blocks.
+//  Parameters: Session - pointer to session
+//              Data - pointer to received data
+//              Length - number of bytes received
+//  Returns:    True - if data was stored
+//              False - if sink was unregistered or Transport Protocol pool ran
+//                      out of blocks
+////////////////////////////////////////////////////////////////////////////////
+int1 J1939TPStore(J1939_TP_SESSION_STRUCT *Session, uint8_t *Data, uint8_t Length)
+{
+  #if J1939_TP_SINKS > 0
+   J1939_TP_SINK Sink;
+   
+   if(Session->Sink != J1939_TP_NO_SINK)
+   {
+      Sink = g_J1939TPSink[Session->Sink].Sink;
+      
+      if(Sink == 0)     //sink was unregistered during session
+         return(FALSE);
+      
+      (*Sink)(Session, Session->Count, Data, Length);
+      Session->Count += Length;
+      
+      return(TRUE);
+   }
+  #endif
+   
+  #if J1939_TP_BLOCKS > 0
+   return(J1939TPAppend(Session,Data,Length));
+  #else
+   return(FALSE);
+  #endif
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//J1939TPComplete()
+// Stops the session's timer once the whole message is received.  A streamed
+// session is closed, a Commanded Address message is handled and closed,
+// otherwise the message waits for J1939TPGetMessage().
+//  Parameters: Session - pointer to session
+//  Returns:    Nothing
+////////////////////////////////////////////////////////////////////////////////
+void J1939TPComplete(J1939_TP_SESSION_STRUCT *Session)
+{
+  #if J1939_TP_BLOCKS > 0
+   uint8_t Data[J1939_COMMANDED_ADDRESS_SIZE];
+  #endif
+   
+   J1939TimerStop(Session->Timer);
+   J1939TPIndexRemove(Session);
+   
+   Session->State = J1939_TP_STATE_COMPLETE;
+   
+  #if J1939_TP_SINKS > 0
+   if(Session->Sink != J1939_TP_NO_SINK)
+   {
+      J1939TPCloseSession(Session);    //sink isn't notified on close of a complete session
+      return;
+   }
+  #endif
+   
+  #if J1939_TP_BLOCKS > 0
+   if((Session->PGN == J1939_PGN_COMMANDED_ADDRESS) && (Session->Size == J1939_COMMANDED_ADDRESS_SIZE))
+   {
+      J1939TPCopy(Session,0,Data,J1939_COMMANDED_ADDRESS_SIZE);
+      J1939TPCloseSession(Session);
+      J1939HandleCommandedAddress(Data);
+   }
+  #endif
+}
+
+#if J1939_TP_BLOCKS > 0
+////////////////////////////////////////////////////////////////////////////////
+//J1939TPAllocBlock()
+// Removes a block from the free list of the Transport Protocol pool.  A session
+// takes one of its reserved blocks first, otherwise only blocks not reserved
+// for other sessions can be taken.
+//  Parameters: Session - pointer to session block is for
+//  Returns:    uint8_t - allocated block, J1939_TP_NO_BLOCK if pool is empty
+////////////////////////////////////////////////////////////////////////////////
+uint8_t J1939TPAllocBlock(J1939_TP_SESSION_STRUCT *Session)
+{
+   uint8_t Block;
+   
+   if(Session->Reserved > 0)
+   {
+      Session->Reserved--;
+      g_J1939TPPoolReserved--;
+   }
+   else if((g_J1939TPPoolUsed + g_J1939TPPoolReserved) >= J1939_TP_BLOCKS)
+      return(J1939_TP_NO_BLOCK);     //rest of free blocks are reserved
+   
+   Block = g_J1939TPPoolFree;
+   
+   if(Block != J1939_TP_NO_BLOCK)
+   {
+      g_J1939TPPoolFree = g_J1939TPPoolLink[Block];
+      g_J1939TPPoolLink[Block] = J1939_TP_NO_BLOCK;
+      
+      if(++g_J1939TPPoolUsed > g_J1939TPPoolPeak)
+         g_J1939TPPoolPeak = g_J1939TPPoolUsed;
+   }
+   
+   return(Block);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//J1939TPAppend()
+// Appends data to a session's chain of blocks, allocating a new block from the
+// Transport Protocol pool each time the last block is full.
+//  Parameters: Session - pointer to session
+//              Data - pointer to data to append
+//              Length - number of bytes to append
+//  Returns:    True - if data was appended
+//              False - if Transport Protocol pool ran out of blocks
+////////////////////////////////////////////////////////////////////////////////
+int1 J1939TPAppend(J1939_TP_SESSION_STRUCT *Session, uint8_t *Data, uint8_t Length)
+{
+   uint8_t i;
+   uint8_t Block;
+   uint8_t Offset;
+   
+   Offset = Session->Count % J1939_TP_BLOCK_SIZE;
+   
+   for(i=0;i<Length;i++)
+   {
+      if(Offset == 0)
+      {
+         Block = J1939TPAllocBlock(Session);
+         
+         if(Block == J1939_TP_NO_BLOCK)
+            return(FALSE);
+         
+         if(Session->Blocks == 0)
+            Session->FirstBlock = Block;
+         else
+            g_J1939TPPoolLink[Session->LastBlock] = Block;
+         
+         Session->LastBlock = Block;
+         Session->Blocks++;
+      }
+      
+      g_J1939TPPool[Session->LastBlock][Offset] = Data[i];
+      
+      if(++Offset >= J1939_TP_BLOCK_SIZE)
+         Offset = 0;
+   }
+   
+   Session->Count += Length;
+   
+   return(TRUE);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//J1939TPCopy()
+// Copies data out of a session's chain of blocks.
+//  Parameters: Session - pointer to session
+//              Offset - position in session's data to start copying from
+//              Data - pointer to where data is copied to
+//              Length - number of bytes to copy
+//  Returns:    Nothing
+////////////////////////////////////////////////////////////////////////////////
+void J1939TPCopy(J1939_TP_SESSION_STRUCT *Session, uint16_t Offset, uint8_t *Data, uint16_t Length)
+{
+   uint16_t i;
+   uint8_t Block;
+   
+   Block = Session->FirstBlock;
+   
+   while(Offset >= J1939_TP_BLOCK_SIZE)
+   {
+      Block = g_J1939TPPoolLink[Block];
+      Offset -= J1939_TP_BLOCK_SIZE;
+   }
+   
+   for(i=0;i<Length;i++)
+   {
+      Data[i] = g_J1939TPPool[Block][Offset];
+      
+      if(++Offset >= J1939_TP_BLOCK_SIZE)
+      {
+         Offset = 0;
+         Block = g_J1939TPPoolLink[Block];
+      }
+   }
+}
+#endif
+
+////////////////////////////////////////////////////////////////////////////////  PGN Subscriptions
+#if J1939_SUBSCRIBED_PGNS > 0
+
+////////////////////////////////////////////////////////////////////////////////
+//J1939Subscribe()
+// Subscribes to a PDU2 PGN.  Once a PGN is subscribed to, broadcast messages
+// of PGNs that aren't subscribed to are dropped, on PIC18 internal CAN mostly
+// by the acceptance filters.  Fast Packet PGNs must be subscribed to as well.
+// Filters are reloaded by the next J1939ReceiveTask(), so a list of PGNs can
+// be subscribed to with filters worked out once.
+//  Parameters: PGN - PDU2 Parameter Group Number
+//  Returns:    True - if PGN is subscribed to
+//              False - if PGN isn't PDU2 or all J1939_SUBSCRIBED_PGNS entries
+//                      are in use
+////////////////////////////////////////////////////////////////////////////////
+int1 J1939Subscribe(uint32_t PGN)
+{
+   if(make8(PGN,1) < 240)
+      return(FALSE);
+   
+   if(J1939Subscribed(PGN) && (g_J1939SubscribedCount > 0))
+      return(TRUE);
+   
+   if(g_J1939SubscribedCount >= J1939_SUBSCRIBED_PGNS)
+      return(FALSE);
+   
+   g_J1939SubscribedHandler[g_J1939SubscribedCount] = 0;
+   g_J1939SubscribedPGN[g_J1939SubscribedCount++] = PGN;
+   
+   g_J1939PGNFiltersDirty = TRUE;
+   
+   return(TRUE);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//J1939SubscribeHandler()
+// Subscribes to a PDU2 PGN the same as J1939Subscribe(), and sets a function
+// its messages are passed to instead of being put in the J1939 receive buffer.
+// When the PGN is loaded alone in an acceptance filter J1939ReceiveTask()
+// finds the handler from the filter hit of the message, without working out
+// the PGN.  The handler is called from J1939ReceiveTask().  A Fast Packet PGN
+// can't have a handler, its frames are reassembled.
+//  Parameters: PGN - PDU2 Parameter Group Number
+//              Handler - function messages are passed to, 0 to put them in
+//                        receive buffer
+//  Returns:    True - if PGN is subscribed to
+//              False - if PGN isn't PDU2, all J1939_SUBSCRIBED_PGNS entries
+//                      are in use or PGN is registered as Fast Packet
+////////////////////////////////////////////////////////////////////////////////
+int1 J1939SubscribeHandler(uint32_t PGN, J1939_PGN_HANDLER Handler)
+{
+   uint8_t i;
+   
+  #if J1939_FP_PGNS > 0
+   if((Handler != 0) && (J1939FPFind(PGN) != J1939_FP_NONE))
+      return(FALSE);
+  #endif
+   
+   if(J1939Subscribe(PGN) == FALSE)
+      return(FALSE);
+   
+   for(i=0;i<g_J1939SubscribedCount;i++)
+   {
+      if(g_J1939SubscribedPGN[i] == PGN)
+         g_J1939SubscribedHandler[i] = Handler;
+   }
+   
+   g_J1939PGNFiltersDirty = TRUE;   //filter handlers reloaded
+   
+   return(TRUE);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//J1939Unsubscribe()
+// Unsubscribes from a PDU2 PGN, once there are none every broadcast message
+// is received again.  Filters are reloaded by the next J1939ReceiveTask().
+//  Parameters: PGN - PDU2 Parameter Group Number
+//  Returns:    True - if PGN was subscribed to
+//              False - if PGN wasn't subscribed to
+////////////////////////////////////////////////////////////////////////////////
+int1 J1939Unsubscribe(uint32_t PGN)
+{
+   uint8_t i;
+   
+   for(i=0;i<g_J1939SubscribedCount;i++)
+   {
+      if(g_J1939SubscribedPGN[i] == PGN)
+      {
+         g_J1939SubscribedPGN[i] = g_J1939SubscribedPGN[--g_J1939SubscribedCount];  //last entry fills gap
+         g_J1939SubscribedHandler[i] = g_J1939SubscribedHandler[g_J1939SubscribedCount];
+         
+         g_J1939PGNFiltersDirty = TRUE;
+         
+         return(TRUE);
+      }
+   }
+   
+   return(FALSE);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//J1939Subscribed()
+// Checks if broadcast messages of a PGN are received.
+//  Parameters: PGN - PDU2 Parameter Group Number
+//  Returns:    True - if PGN is subscribed to or there are no subscriptions
+//              False - if PGN isn't subscribed to
+////////////////////////////////////////////////////////////////////////////////
+int1 J1939Subscribed(uint32_t PGN)
+{
+   uint8_t i;
+   
+   if(g_J1939SubscribedCount == 0)
+      return(TRUE);
+   
+   for(i=0;i<g_J1939SubscribedCount;i++)
+   {
+      if(g_J1939SubscribedPGN[i] == PGN)
+         return(TRUE);
+   }
+   
+   return(FALSE);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//J1939SubscribedHandler()
+// Finds the handler of a subscribed PGN.
+//  Parameters: PGN - PDU2 Parameter Group Number
+//  Returns:    J1939_PGN_HANDLER - handler of PGN, 0 if it has none or isn't
+//                                  subscribed to
+////////////////////////////////////////////////////////////////////////////////
+J1939_PGN_HANDLER J1939SubscribedHandler(uint32_t PGN)
+{
+   uint8_t i;
+   
+   for(i=0;i<g_J1939SubscribedCount;i++)
+   {
+      if(g_J1939SubscribedPGN[i] == PGN)
+         return(g_J1939SubscribedHandler[i]);
+   }
+   
+   return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//J1939LoadPGNFilters()
+// Loads Mask 1 and its filters, filters 2 to 5 and on PIC18 with ECAN Mode 1
+// spare filters after those used for addresses, so every subscribed PGN is
+// accepted.  When all subscribed PGNs fit Mask 1 looks at the whole PGN,
+// otherwise Mask 1 bits are cleared one at a time, each time the bit that
+// merges the most PGNs into the same filter value, until the filter values
+// fit.  That keeps the number of other PGNs accepted low, J1939ReceiveTask()
+// drops them.  With no subscriptions Mask 1 only looks at the upper nibble of
+// PDU Format so every broadcast message is accepted.  When Mask 1 looks at
+// the whole PGN the handler of each filter's PGN is put in
+// g_J1939FilterHandler[].
+//  Parameters: None
+//  Returns:    Nothing
+////////////////////////////////////////////////////////////////////////////////
+void J1939LoadPGNFilters(void)
+{
+  #if J1939_PGN_FILTERS > 0
+   uint16_t Key[J1939_SUBSCRIBED_PGNS];
+   uint16_t Value[J1939_PGN_FILTERS];
+   uint16_t Mask, Try, BestMask;
+   uint8_t Count, Best;
+   uint8_t i, j;
+   uint8_t Filter;
+  #endif
+   
+   g_J1939PGNFiltersDirty = FALSE;
+   
+  #if J1939_PGN_FILTERS > 0
+   for(i=0;i<g_J1939SubscribedCount;i++)
+      Key[i] = J1939PGNKey(g_J1939SubscribedPGN[i]);   //keys worked out once, not for every mask tried
+   
+   if(g_J1939SubscribedCount == 0)
+      Mask = 0;
+   else
+      Mask = J1939_PGN_KEY_MASK;
+   
+   while(J1939PGNFilterCount(Key, Mask, 255) > J1939_PGN_FILTERS)
+   {
+      Best = 255;
+      
+      for(i=0;i<14;i++)
+      {
+         if(bit_test(Mask,i))
+         {
+            Try = Mask;
+            bit_clear(Try,i);
+            
+            Count = J1939PGNFilterCount(Key, Try, Best);
+            
+            if(Count < Best)
+            {
+               Best = Count;
+               BestMask = Try;
+            }
+         }
+      }
+      
+      Mask = BestMask;
+   }
+   
+   Count = 0;
+   
+   for(i=0;i<g_J1939SubscribedCount;i++)
+   {
+      Try = Key[i] & Mask;
+      
+      for(j=0;j<Count;j++)
+      {
+         if(Value[j] == Try)
+            break;
+      }
+      
+      if(j == Count)
+         Value[Count++] = Try;
+   }
+   
+   if(Count == 0)
+      Value[Count++] = 0;     //Broadcast messages PDU 240 to 255
+   
+   for(;Count<J1939_PGN_FILTERS;Count++)
+      Value[Count] = Value[0];   //filters not needed repeat first value
+   
+   can_set_mode(CAN_OP_CONFIG);  //put CAN in Config mode
+   
+   can_set_id(RX1MASK, J1939PGNKeyId(Mask), CAN_USE_EXTENDED_ID);       //Set Mask 1 to look at upper nibble of PDU Format and bits of PGN kept
+   
+   memset(g_J1939FilterHandler,0,sizeof(g_J1939FilterHandler));
+   
+   for(i=0;i<J1939_PGN_FILTERS;i++)
+   {
+     #if J1939_PGN_FILTERS > 4
+      if(i >= 4)
+      {
+         Filter = J1939_PGN_FILTER_FIRST + i - 4;
+         can_set_id((int *)g_J1939FilterRegister[Filter - 6], J1939PGNKeyId(Value[i]), CAN_USE_EXTENDED_ID);
+      }
+      else
+     #endif
+      {
+         Filter = i + 2;
+         can_set_id((int *)g_J1939PGNFilterRegister[i], J1939PGNKeyId(Value[i]), CAN_USE_EXTENDED_ID);
+      }
+      
+      if((Mask == J1939_PGN_KEY_MASK) && (g_J1939SubscribedCount > 0))    //filters hold one PGN each, in subscribed order
+      {
+         if(i < g_J1939SubscribedCount)
+            g_J1939FilterHandler[Filter] = g_J1939SubscribedHandler[i];
+         else
+            g_J1939FilterHandler[Filter] = g_J1939SubscribedHandler[0];    //filter repeats first PGN
+      }
+   }
+   
+   can_set_mode(CAN_OP_NORMAL);  //put CAN in Normal mode
+  #endif
+}
+
+#if J1939_PGN_FILTERS > 0
+////////////////////////////////////////////////////////////////////////////////
+//J1939PGNFilterCount()
+// Counts filters needed to accept every subscribed PGN with a Mask 1 value.
+//  Parameters: Key - pointer to key of each subscribed PGN, see J1939PGNKey()
+//              Mask - PGN key bits Mask 1 looks at
+//              Limit - count to stop at, a mask needing this many filters
+//                      is no better than one already tried
+//  Returns:    uint8_t - number of different filter values, Limit if there
+//                        are that many or more
+////////////////////////////////////////////////////////////////////////////////
+uint8_t J1939PGNFilterCount(uint16_t *Key, uint16_t Mask, uint8_t Limit)
+{
+   uint16_t Value;
+   uint8_t i, j;
+   uint8_t Count;
+   
+   Count = 0;
+   
+   for(i=0;i<g_J1939SubscribedCount;i++)
+   {
+      Value = Key[i] & Mask;
+      
+      for(j=0;j<i;j++)
+      {
+         if((Key[j] & Mask) == Value)
+            break;
+      }
+      
+      if(j == i)
+      {
+         if(++Count >= Limit)    //first PGN with this filter value
+            return(Limit);
+      }
+   }
+   
+   return(Count);
+}
+#endif
+#endif
+
+////////////////////////////////////////////////////////////////////////////////  Software Accept
+#if J1939_ACCEPT_FILTER == TRUE
+
+////////////////////////////////////////////////////////////////////////////////
+//J1939AcceptFormat()
+// Sets if messages of a PDU Format are put in the J1939 receive buffer,
+// PDU Specific values accepted with J1939Accept() are forgotten.  Every PDU
+// Format is accepted after J1939Init().  Address Claim and Transport Protocol
+// messages are handled by the driver either way.  Messages of a dropped PDU2
+// Format are dropped before subscribed and Fast Packet PGNs are looked up, so
+// they don't reach a subscribed handler or Fast Packet reassembly either.
+//  Parameters: PF - PDU Format
+//              Accept - TRUE to accept all messages of PDU Format, FALSE to
+//                       drop them
+//  Returns:    Nothing
+////////////////////////////////////////////////////////////////////////////////
+void J1939AcceptFormat(uint8_t PF, int1 Accept)
+{
+   if(Accept)
+      J1939AcceptSet(PF, J1939_ACCEPT_ALL);
+   else
+      J1939AcceptSet(PF, J1939_ACCEPT_NONE);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//J1939Accept()
+// Accepts messages of a PDU Format with one PDU Specific value, the
+// Destination Address of PDU1 or the Group Extension of PDU2.  Other PDU
+// Specific values of PDU Format are dropped, unless they are accepted too.
+// Accepting a PDU Format that was dropped uses one of J1939_ACCEPT_MAPS maps.
+//  Parameters: PF - PDU Format
+//              PS - PDU Specific
+//  Returns:    True - if messages are accepted
+//              False - if all J1939_ACCEPT_MAPS maps are in use
+////////////////////////////////////////////////////////////////////////////////
+int1 J1939Accept(uint8_t PF, uint8_t PS)
+{
+   uint8_t i;
+   
+   switch(J1939AcceptState(PF))
+   {
+      case J1939_ACCEPT_ALL:
+         return(TRUE);
+      case J1939_ACCEPT_MAP:
+         for(i=0;i<J1939_ACCEPT_MAPS;i++)
+         {
+            if(g_J1939AcceptMapPF[i] == PF)
+               break;
+         }
+         break;
+      default:
+         for(i=0;i<J1939_ACCEPT_MAPS;i++)
+         {
+            if(J1939AcceptState(g_J1939AcceptMapPF[i]) != J1939_ACCEPT_MAP)
+               break;   //map is free
+         }
+         
+         if(i >= J1939_ACCEPT_MAPS)
+            return(FALSE);
+         
+         memset(g_J1939AcceptMap[i],0,32);
+         g_J1939AcceptMapPF[i] = PF;
+         J1939AcceptSet(PF, J1939_ACCEPT_MAP);
+         break;
+   }
+   
+   bit_set(g_J1939AcceptMap[i][PS >> 3], PS & 0x07);
+   
+   return(TRUE);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//J1939AcceptSet()
+// Sets the 2 bit accept state of a PDU Format.
+//  Parameters: PF - PDU Format
+//              State - J1939_ACCEPT_NONE, J1939_ACCEPT_MAP or J1939_ACCEPT_ALL
+//  Returns:    Nothing
+////////////////////////////////////////////////////////////////////////////////
+void J1939AcceptSet(uint8_t PF, uint8_t State)
+{
+   uint8_t Shift;
+   
+   Shift = (PF & 0x03) << 1;
+   
+   g_J1939AcceptPF[PF >> 2] = (g_J1939AcceptPF[PF >> 2] & ~(0x03 << Shift)) | (State << Shift);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//J1939Accepted()
+// Checks if messages of a PDU Format with a PDU Specific value are put in the
+// J1939 receive buffer.
+//  Parameters: PF - PDU Format
+//              PS - PDU Specific
+//  Returns:    True - if message is accepted
+//              False - if message is dropped
+////////////////////////////////////////////////////////////////////////////////
+int1 J1939Accepted(uint8_t PF, uint8_t PS)
+{
+   uint8_t i;
+   
+   switch(J1939AcceptState(PF))
+   {
+      case J1939_ACCEPT_ALL:
+         return(TRUE);
+      case J1939_ACCEPT_MAP:
+         for(i=0;i<J1939_ACCEPT_MAPS;i++)
+         {
+            if(g_J1939AcceptMapPF[i] == PF)
+               return(bit_test(g_J1939AcceptMap[i][PS >> 3], PS & 0x07));
+         }
+   }
+   
+   return(FALSE);
+}
+#endif
+
+////////////////////////////////////////////////////////////////////////////////  Fast Packet
+#if J1939_FP_PGNS > 0
+
+////////////////////////////////////////////////////////////////////////////////
+//J1939FPRegister()
+// Registers a PDU2 PGN as Fast Packet.  Received frames of the PGN are
+// reassembled into a session the same as a Transport Protocol message, and are
+// retrieved with J1939TPGetMessage() or streamed to the sink registered for the
+// PGN.  Messages sent with J1939FPPutMessage() use the PGN's sequence counter.
+// A PGN subscribed with a handler can't be registered.
+//  Parameters: PGN - PDU2 Parameter Group Number
+//  Returns:    True - if PGN is registered
+//              False - if PGN isn't PDU2, all J1939_FP_PGNS entries are in
+//                      use or PGN has a subscribed handler
+////////////////////////////////////////////////////////////////////////////////
+int1 J1939FPRegister(uint32_t PGN)
+{
+   uint8_t i;
+   
+   if(make8(PGN,1) < 240)
+      return(FALSE);
+   
+  #if J1939_SUBSCRIBED_PGNS > 0
+   if(J1939SubscribedHandler(PGN) != 0)
+      return(FALSE);    //frames would be passed to the handler by filter hit before they're reassembled
+  #endif
+   
+   if(J1939FPFind(PGN) != J1939_FP_NONE)
+      return(TRUE);
+   
+   for(i=0;i<J1939_FP_PGNS;i++)
+   {
+      if(g_J1939FPPGN[i].PGN == 0)
+      {
+         g_J1939FPPGN[i].PGN = PGN;
+         g_J1939FPPGN[i].Sequence = 0;
+         return(TRUE);
+      }
+   }
+   
+   return(FALSE);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//J1939FPUnregister()
+// Unregisters a Fast Packet PGN, its frames are put in the J1939 receive buffer
+// again.  Messages of the PGN already being received are finished.
+//  Parameters: PGN - PDU2 Parameter Group Number
+//  Returns:    True - if PGN was registered
+//              False - if PGN wasn't registered
+////////////////////////////////////////////////////////////////////////////////
+int1 J1939FPUnregister(uint32_t PGN)
+{
+   uint8_t i;
+   
+   i = J1939FPFind(PGN);
+   
+   if(i == J1939_FP_NONE)
+      return(FALSE);
+   
+   g_J1939FPPGN[i].PGN = 0;
+   
+   return(TRUE);
+}
+
+#if J1939_TP_BLOCKS > 0
+////////////////////////////////////////////////////////////////////////////////
+//J1939FPPutMessage()
+// Loads a Fast Packet message into a session, the message is copied into the
+// Transport Protocol pool and sent one frame at a time by J1939XmitTask() as
+// room in the J1939 transmit buffer allows.
+//  Parameters: PDU - the PDU of message, PGN must be registered with
+//                    J1939FPRegister()
+//              Data - pointer to data of message
+//              Length - number of bytes in message, 1 to 223
+//  Returns:    True - if message was loaded
+//              False - if PGN isn't registered, Length is out of range or
+//                      there isn't a free session or enough free blocks
+////////////////////////////////////////////////////////////////////////////////
+int1 J1939FPPutMessage(J1939_PDU_STRUCT PDU, uint8_t *Data, uint8_t Length)
+{
+   J1939_TP_SESSION_STRUCT *Session;
+   uint8_t i;
+   
+   i = J1939FPFind(J1939GetPGN(PDU));
+   
+   if((i == J1939_FP_NONE) || (Length == 0) || (Length > J1939_FP_MAX_SIZE))
+      return(FALSE);
+   
+   if((((uint16_t)Length + (J1939_TP_BLOCK_SIZE - 1)) / J1939_TP_BLOCK_SIZE) > (J1939_TP_BLOCKS - g_J1939TPPoolUsed - g_J1939TPPoolReserved))
+      return(FALSE);
+   
+   Session = J1939TPIdleSession();
+   
+   if(Session == 0)
+      return(FALSE);
+   
+   memcpy(&Session->PDU,&PDU,sizeof(J1939_PDU_STRUCT));
+   Session->PGN = g_J1939FPPGN[i].PGN;
+   Session->Destination = J1939_GLOBAL_ADDRESS;
+   Session->Size = Length;
+   Session->Count = 0;
+   Session->Packets = g_J1939FPPGN[i].Sequence;
+   Session->NextSequence = 0;
+  #if J1939_TP_SINKS > 0
+   Session->Sink = J1939_TP_NO_SINK;
+  #endif
+   
+   J1939TPAppend(Session,Data,Length);    //can't fail, free blocks were checked
+   
+   Session->State = J1939_TP_STATE_FAST_XMIT;
+   
+   g_J1939FPPGN[i].Sequence = (g_J1939FPPGN[i].Sequence + 1) & 0x07;
+   
+   return(TRUE);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//J1939FPXmitTask()
+// Loads the next frames of a Fast Packet message into the J1939 transmit
+// buffer while there is room.  One message is sent at a time so frames of
+// different messages aren't mixed, the session is closed after its last frame.
+//  Parameters: None
+//  Returns:    Nothing
+////////////////////////////////////////////////////////////////////////////////
+void J1939FPXmitTask(void)
+{
+   J1939_TP_SESSION_STRUCT *Session;
+   uint8_t Frame[8];
+   uint8_t i;
+   uint8_t Length;
+   uint16_t Offset;
+   
+   while(g_J1939Flags.XmitBufferCount < J1939_TRANSMIT_BUFFERS)
+   {
+      if(g_J1939FPXmitSession == J1939_FP_NONE)
+      {
+         for(i=0;i<J1939_TP_SESSIONS;i++)
+         {
+            if(g_J1939TPSession[i].State == J1939_TP_STATE_FAST_XMIT)
+               break;
+         }
+         
+         if(i >= J1939_TP_SESSIONS)
+            return;
+         
+         g_J1939FPXmitSession = i;
+      }
+      
+      Session = &g_J1939TPSession[g_J1939FPXmitSession];
+      
+     #if J1939_CONTROLLER_APPS == 1
+      Session->PDU.SourceAddress = g_MyJ1939Address;
+     #endif
+      
+      if(J1939SourceClaimed(Session->PDU.SourceAddress) == FALSE)
+         return;
+      
+      memset(Frame,0xFF,8);      //unused bytes of last frame are 0xFF
+      
+      Frame[0] = (Session->Packets << 5) | Session->NextSequence;
+      
+      if(Session->NextSequence == 0)
+      {
+         Frame[1] = Session->Size;
+         Offset = 0;
+         Length = 6;
+         i = 2;
+      }
+      else
+      {
+         Offset = ((uint16_t)Session->NextSequence * 7) - 1;
+         Length = 7;
+         i = 1;
+      }
+      
+      if((Session->Size - Offset) < Length)
+         Length = Session->Size - Offset;
+      
+      J1939TPCopy(Session,Offset,&Frame[i],Length);
+      
+      J1939PutMessage(Session->PDU,Frame,8);
+      
+      Session->NextSequence++;
+      
+      if((Offset + Length) >= Session->Size)
+      {
+         J1939TPCloseSession(Session);
+         g_J1939FPXmitSession = J1939_FP_NONE;
+      }
+   }
+}
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//J1939FPFind()
+// Finds the entry of a Fast Packet PGN.  Only PDU2 PGNs can be registered, a
+// PDU1 PGN such as 0 of PDU Format 0 never matches an unused entry.
+//  Parameters: PGN - Parameter Group Number
+//  Returns:    uint8_t - index into g_J1939FPPGN, J1939_FP_NONE if PGN isn't
+//                        registered
+////////////////////////////////////////////////////////////////////////////////
+uint8_t J1939FPFind(uint32_t PGN)
+{
+   uint8_t i;
+   
+   if(make8(PGN,1) < 240)
+      return(J1939_FP_NONE);     //unused entries have PGN 0
+   
+   for(i=0;i<J1939_FP_PGNS;i++)
+   {
+      if(g_J1939FPPGN[i].PGN == PGN)
+         return(i);
+   }
+   
+   return(J1939_FP_NONE);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//J1939FPReceive()
+// Handles a received frame of a Fast Packet PGN.  The first frame (frame
+// counter 0) opens a session, replacing an unfinished message of the same PGN
+// from the same node, following frames must have the same sequence counter and
+// the next frame counter or the message is dropped.  Frames of a message must
+// be received within T1 of each other.
+//  Parameters: ReceivedPDU - the PDU of received frame
+//              Data - pointer to the 8 data bytes of received frame
+//  Returns:    Nothing
+////////////////////////////////////////////////////////////////////////////////
+void J1939FPReceive(J1939_PDU_STRUCT ReceivedPDU, uint8_t *Data)
+{
+   J1939_TP_SESSION_STRUCT *Session;
+   uint32_t PGN;
+   uint8_t Frame;
+   uint8_t Length;
+   uint8_t i;
+  #if J1939_TP_SINKS > 0
+   uint8_t Sink;
+  #endif
+   
+   PGN = J1939GetPGN(ReceivedPDU);
+   Frame = Data[0] & 0x1F;
+   
+   Session = J1939FPFindSession(ReceivedPDU.SourceAddress, PGN);
+   
+   if(Frame == 0)
+   {
+      if(Session != 0)
+         J1939TPCloseSession(Session);
+      else
+         Session = J1939TPIdleSession();
+      
+      if((Session == 0) || (Data[1] == 0) || (Data[1] > J1939_FP_MAX_SIZE))
+         return;
+      
+     #if J1939_TP_SINKS > 0
+      Sink = J1939TPFindSink(PGN);
+      
+     #if J1939_TP_BLOCKS == 0
+      if(Sink == J1939_TP_NO_SINK)     //no pool to store message in
+         return;
+     #endif
+      
+      Session->Sink = Sink;
+     #endif
+      
+      memcpy(&Session->PDU,&ReceivedPDU,sizeof(J1939_PDU_STRUCT));
+      Session->PGN = PGN;
+      Session->Destination = J1939_GLOBAL_ADDRESS;
+      Session->Size = Data[1];
+      Session->Count = 0;
+      Session->Packets = Data[0] >> 5;
+      Session->NextSequence = 0;
+      Session->State = J1939_TP_STATE_FAST;
+      
+      J1939TPIndexInsert(Session, J1939FPIndexKey(PGN));
+      
+      Length = 6;
+      i = 2;
+   }
+   else
+   {
+      if(Session == 0)
+         return;
+      
+      if((Frame != Session->NextSequence) || ((Data[0] >> 5) != Session->Packets))
+      {
+         J1939TPCloseSession(Session);    //missed a frame
+         return;
+      }
+      
+      Length = 7;
+      i = 1;
+   }
+   
+   if((Session->Size - Session->Count) < Length)
+      Length = Session->Size - Session->Count;
+   
+   if(J1939TPStore(Session,&Data[i],Length) == FALSE)
+   {
+      J1939TPCloseSession(Session);
+      return;
+   }
+   
+   Session->NextSequence++;
+   
+   if(Session->Count >= Session->Size)
+      J1939TPComplete(Session);
+   else
+      J1939TimerStart(Session->Timer, J1939_TP_T1, J1939TPTimeout);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//J1939FPFindSession()
+// Finds the session of a Fast Packet message being received in the session
+// index.
+//  Parameters: SourceAddress - Source Address of received frame
+//              PGN - Parameter Group Number of received frame
+//  Returns:    pointer to session, 0 if there is no session
+////////////////////////////////////////////////////////////////////////////////
+J1939_TP_SESSION_STRUCT *J1939FPFindSession(uint8_t SourceAddress, uint32_t PGN)
+{
+   J1939_TP_SESSION_STRUCT *Session;
+   uint8_t Slot;
+   uint8_t i;
+   
+   Slot = J1939TPIndexHash(SourceAddress, J1939FPIndexKey(PGN));
+   
+   for(i=0;i<J1939_TP_INDEX_SIZE;i++)
+   {
+      if(g_J1939TPIndex[Slot] == J1939_TP_INDEX_EMPTY)
+         break;
+      
+      Session = &g_J1939TPSession[g_J1939TPIndex[Slot]];
+      
+      if((Session->State == J1939_TP_STATE_FAST) && (Session->PDU.SourceAddress == SourceAddress) && (Session->PGN == PGN))
+         return(Session);
+      
+      Slot = (Slot + 1) & (J1939_TP_INDEX_SIZE - 1);
+   }
+   
+   return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//J1939FPIndexKey()
+// Gets the key a Fast Packet session is hashed by in the session index.
+//  Parameters: PGN - Parameter Group Number of Fast Packet message
+//  Returns:    uint8_t - key, PDU Format and Group Extension combined
+////////////////////////////////////////////////////////////////////////////////
+uint8_t J1939FPIndexKey(uint32_t PGN)
+{
+   return(make8(PGN,0) ^ make8(PGN,1));
+}
+#endif
+
+#endif
      
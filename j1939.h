@@ -39,15 +39,296 @@
 #define J1939_TRANSMIT_BUFFERS   1
 #endif
 
+#ifndef J1939_TP_SESSIONS
+#define J1939_TP_SESSIONS        0  //number of Transport Protocol sessions that can be received at same time, 0 puts TP.CM and TP.DT messages in receive buffer
+#endif
+
+#ifndef J1939_TP_BLOCK_SIZE
+#define J1939_TP_BLOCK_SIZE      16 //size of each block in Transport Protocol buffer pool, power of 2 recommended
+#endif
+
+#ifndef J1939_TP_BLOCKS
+#define J1939_TP_BLOCKS          (J1939_TP_SESSIONS * 8)  //number of blocks in Transport Protocol buffer pool, 0 if all packeted messages are streamed to sinks
+#endif
+
+#if J1939_TP_BLOCKS > 254
+#undef J1939_TP_BLOCKS
+#define J1939_TP_BLOCKS          254   //block indexes are 8-bit, 255 is used to mark end of chain
+#endif
+
+#ifndef J1939_TP_SINKS
+#define J1939_TP_SINKS           0  //number of PGNs that can have a sink registered with J1939TPRegisterSink()
+#endif
+
+#if (J1939_TP_SESSIONS > 0) && (J1939_TP_BLOCKS == 0) && (J1939_TP_SINKS == 0)
+ #error J1939_TP_BLOCKS or J1939_TP_SINKS must be set to receive Transport Protocol messages
+#endif
+
+#ifndef J1939_TP_CTS_PACKETS
+#define J1939_TP_CTS_PACKETS     8  //maximum number of packets requested with each TP.CM_CTS
+#endif
+
+#ifndef J1939_TP_INDEX_SIZE   //slots in hashed session index, power of 2 larger than J1939_TP_SESSIONS
+ #if J1939_TP_SESSIONS <= 2
+  #define J1939_TP_INDEX_SIZE    4
+ #elif J1939_TP_SESSIONS <= 4
+  #define J1939_TP_INDEX_SIZE    8
+ #elif J1939_TP_SESSIONS <= 8
+  #define J1939_TP_INDEX_SIZE    16
+ #elif J1939_TP_SESSIONS <= 16
+  #define J1939_TP_INDEX_SIZE    32
+ #else
+  #define J1939_TP_INDEX_SIZE    64
+ #endif
+#endif
+
+#if (J1939_TP_SESSIONS > 0) && (J1939_TP_INDEX_SIZE <= J1939_TP_SESSIONS)
+ #error J1939_TP_INDEX_SIZE must be larger than J1939_TP_SESSIONS
+#endif
+
+#ifndef J1939_FP_PGNS
+#define J1939_FP_PGNS            0  //number of PDU2 PGNs that can be registered as Fast Packet with J1939FPRegister()
+#endif
+
+#if (J1939_FP_PGNS > 0) && (J1939_TP_SESSIONS == 0)
+ #error J1939_TP_SESSIONS must be set to send and receive Fast Packet messages
+#endif
+
+#ifndef J1939_ADDRESS_TABLE_SIZE
+#define J1939_ADDRESS_TABLE_SIZE 0  //number of other nodes kept in address table, up to 128, 0 puts Address Claimed messages in receive buffer instead, 8 fits PIC18F4580 RAM
+#endif
+
+#if J1939_ADDRESS_TABLE_SIZE > 128
+#undef J1939_ADDRESS_TABLE_SIZE
+#define J1939_ADDRESS_TABLE_SIZE    128   //index slots are 8-bit and must be at least twice the entries
+#endif
+
+#if J1939_ADDRESS_TABLE_SIZE <= 4      //slots in each address table index, power of 2 at least twice J1939_ADDRESS_TABLE_SIZE
+ #define J1939_ADDRESS_INDEX_SIZE   8
+#elif J1939_ADDRESS_TABLE_SIZE <= 8
+ #define J1939_ADDRESS_INDEX_SIZE   16
+#elif J1939_ADDRESS_TABLE_SIZE <= 16
+ #define J1939_ADDRESS_INDEX_SIZE   32
+#elif J1939_ADDRESS_TABLE_SIZE <= 32
+ #define J1939_ADDRESS_INDEX_SIZE   64
+#elif J1939_ADDRESS_TABLE_SIZE <= 64
+ #define J1939_ADDRESS_INDEX_SIZE   128
+#else
+ #define J1939_ADDRESS_INDEX_SIZE   256
+#endif
+
+#ifndef J1939_USER_TIMERS
+#define J1939_USER_TIMERS        0  //number of timers reserved for application, started with J1939TimerStart()
+#endif
+
+#ifndef J1939_TIMER_RESOLUTION
+#define J1939_TIMER_RESOLUTION   ((J1939_TICKS_PER_SECOND + 99) / 100)  //ticks per timer wheel slot, default 10ms, must be at least 1
+#endif
+
+#ifndef J1939_CONTROLLER_APPS
+#define J1939_CONTROLLER_APPS    1  //number of controller applications, each with its own Name, address and Address Claim
+#endif
+
+#if (J1939_CONTROLLER_APPS > 11) && (USE_INTERNAL_CAN == TRUE) && defined(__PCH__)
+ #error J1939_CONTROLLER_APPS cannot be more than 11, each needs one of filters 1 and 6 to 15
+#endif
+
+#ifndef J1939_CLAIM_STATS
+#define J1939_CLAIM_STATS        FALSE    //TRUE counts Address Claim traffic of each controller application, see J1939GetClaimStats()
+#endif
+
+#ifndef J1939_STAGED_FILTERS
+#define J1939_STAGED_FILTERS     0  //PIC18 ECAN filters pre-loaded with candidate addresses, 0 reprograms filter 1 in config mode on every claim
+#endif
+
+#if J1939_STAGED_FILTERS > 10
+#undef J1939_STAGED_FILTERS
+#define J1939_STAGED_FILTERS     10    //only filters 6 to 15 are spare
+#endif
+
+#if (J1939_STAGED_FILTERS > 0) && ((USE_INTERNAL_CAN == FALSE) || defined(__PCD__) || (J1939_CONTROLLER_APPS > 1))
+#undef J1939_STAGED_FILTERS
+#define J1939_STAGED_FILTERS     0     //staged filters need ECAN Mode 1 of PIC18 internal CAN, and filters 6 to 15 for themselves
+#endif
+
+#ifndef J1939_SUBSCRIBED_PGNS
+#define J1939_SUBSCRIBED_PGNS    0  //number of PDU2 PGNs that can be subscribed to with J1939Subscribe(), 0 receives every broadcast PGN
+#endif
+
+#ifndef J1939_ACCEPT_FILTER
+#define J1939_ACCEPT_FILTER      FALSE    //TRUE drops messages application didn't accept with J1939AcceptFormat() or J1939Accept() before they're put in receive buffer
+#endif
+
+#ifndef J1939_ACCEPT_MAPS
+#define J1939_ACCEPT_MAPS        4  //number of PDU Formats that can accept only some PDU Specific values, 32 bytes each
+#endif
+
+#ifndef J1939_ECAN_FIFO
+#define J1939_ECAN_FIFO          FALSE    //TRUE puts PIC18 ECAN in Mode 2, J1939ReceiveTask() reads receive buffers in order from FIFO pointer
+#endif
+
+#if (J1939_ECAN_FIFO == TRUE) && ((USE_INTERNAL_CAN == FALSE) || !defined(__PCH__))
+#undef J1939_ECAN_FIFO
+#define J1939_ECAN_FIFO          FALSE    //FIFO is only on PIC18 ECAN
+#endif
+
+#ifndef J1939_AUTOBAUD
+#define J1939_AUTOBAUD           FALSE    //TRUE has J1939Init() find bit rate of bus, 250k, 500k or 1M, before going on the bus
+#endif
+
+#if (J1939_AUTOBAUD == TRUE) && ((USE_INTERNAL_CAN == FALSE) || !defined(__PCH__))
+#undef J1939_AUTOBAUD
+#define J1939_AUTOBAUD           FALSE    //autobaud is only in PIC18 ECAN driver
+#endif
+
+//With autobaud J1939Init() blocks until a frame is received, for up to
+//CAN_AUTOBAUD_ROUNDS x 3 x CAN_AUTOBAUD_TIME ms, 3 seconds by default, and
+//can_init() leaves CAN in Config mode so it isn't on the bus at CAN_BITRATE
+//before the bit rate is found
+#if J1939_AUTOBAUD == TRUE
+#define CAN_INIT_NORMAL          FALSE
+#endif
+
+#ifndef J1939_BUS_MONITOR
+#define J1939_BUS_MONITOR        FALSE    //TRUE has J1939ReceiveTask() watch CAN error state and recover from bus-off
+#endif
+
+#if (J1939_BUS_MONITOR == TRUE) && ((USE_INTERNAL_CAN == FALSE) || !defined(__PCH__))
+#undef J1939_BUS_MONITOR
+#define J1939_BUS_MONITOR        FALSE    //error state is only read from PIC18 ECAN
+#endif
+
+#define J1939_TIMESTAMP_NONE     0
+#define J1939_TIMESTAMP_TICK     1
+#define J1939_TIMESTAMP_CAPTURE  2
+
+#ifndef J1939_TIMESTAMP
+#define J1939_TIMESTAMP          J1939_TIMESTAMP_NONE   //TICK stamps received messages with J1939GetTick(), CAPTURE also with CCP1 CAN capture
+#endif
+
+#if (J1939_TIMESTAMP == J1939_TIMESTAMP_CAPTURE) && ((USE_INTERNAL_CAN == FALSE) || !defined(__PCH__))
+#undef J1939_TIMESTAMP
+#define J1939_TIMESTAMP          J1939_TIMESTAMP_TICK   //CAN capture is only on PIC18 ECAN
+#endif
+
+#if J1939_TIMESTAMP == J1939_TIMESTAMP_CAPTURE
+#define CAN_ENABLE_CAN_CAPTURE   1        //CCP1 captures start of each received frame, CCP1 must be setup in capture mode
+#endif
+
+#ifndef J1939_BUS_OFF_BACKOFF
+#define J1939_BUS_OFF_BACKOFF    ((J1939_TICK_TYPE)J1939_TICKS_PER_SECOND/20)  //50ms off the bus before first recovery, doubled each bus-off in a row
+#endif
+
+#ifndef J1939_BUS_OFF_BACKOFF_MAX
+#define J1939_BUS_OFF_BACKOFF_MAX ((J1939_TICK_TYPE)J1939_TICKS_PER_SECOND*2)  //longest wait before recovery, also error-active time that ends a bus-off run
+#endif
+
+#ifndef J1939_PASSIVE_PRIORITY
+#define J1939_PASSIVE_PRIORITY   6        //while error-passive, messages of this priority or lower are rate-limited
+#endif
+
+#ifndef J1939_PASSIVE_INTERVAL
+#define J1939_PASSIVE_INTERVAL   ((J1939_TICK_TYPE)J1939_TICKS_PER_SECOND/100) //10ms between rate-limited messages while error-passive
+#endif
+
+#if (USE_INTERNAL_CAN == TRUE) && defined(__PCH__) && ((J1939_STAGED_FILTERS > 0) || (J1939_CONTROLLER_APPS > 1) || (J1939_SUBSCRIBED_PGNS > 4) || (J1939_ECAN_FIFO == TRUE))
+ #define J1939_ECAN_MODE1        TRUE     //PIC18 ECAN put in Mode 1, or Mode 2 with J1939_ECAN_FIFO, for filters 6 to 15
+#else
+ #define J1939_ECAN_MODE1        FALSE
+#endif
+
+#if (J1939_SUBSCRIBED_PGNS > 0) && (USE_INTERNAL_CAN == TRUE) && defined(__PCH__)
+ #if J1939_STAGED_FILTERS > 0
+  #define J1939_PGN_FILTER_FIRST (6 + J1939_STAGED_FILTERS)    //first of filters 6 to 15 spare for subscribed PGNs
+ #else
+  #define J1939_PGN_FILTER_FIRST (5 + J1939_CONTROLLER_APPS)
+ #endif
+ #if (J1939_ECAN_MODE1 == TRUE) && (J1939_PGN_FILTER_FIRST < 16)
+  #define J1939_PGN_FILTERS      (20 - J1939_PGN_FILTER_FIRST)   //filters 2 to 5 and spare filters of Mode 1 look for subscribed PGNs
+  #define J1939_PGN_FILTER_ENABLE ((uint16_t)0xFFFF << J1939_PGN_FILTER_FIRST)
+ #else
+  #define J1939_PGN_FILTERS      4     //filters 2 to 5 look for subscribed PGNs
+ #endif
+#else
+ #define J1939_PGN_FILTERS       0     //subscribed PGNs only checked by J1939ReceiveTask()
+#endif
+
+#ifndef J1939_PGN_FILTER_ENABLE
+ #define J1939_PGN_FILTER_ENABLE 0
+#endif
+
+#if (USE_INTERNAL_CAN == TRUE) && defined(__PCH__) && (J1939_STAGED_FILTERS == 0)
+ #define J1939_FILTER_TASK       TRUE     //J1939FilterTask() reloads address filters without waiting for Config mode
+#else
+ #define J1939_FILTER_TASK       FALSE
+#endif
+
+#if (USE_INTERNAL_CAN == TRUE) && defined(__PCH__)
+ #define J1939_MODE_TASK         TRUE     //J1939ModeTask() asks for Normal mode again if CAN didn't reach it
+#else
+ #define J1939_MODE_TASK         FALSE
+#endif
+
+#if (J1939_CONTROLLER_APPS > 1) && ((USE_INTERNAL_CAN == FALSE) || defined(__PCD__))
+ #define J1939_DESTINATION_MASK  0x00000000    //filters 0 and 1 accept all destinations, J1939ReceiveTask() drops ones no controller application owns
+#else
+ #define J1939_DESTINATION_MASK  0x0000FF00    //filter 0 accepts Global Address, filter 1 unit's address
+#endif
+
+//#define J1939_EEPROM_ADDRESS   0  //data EEPROM location last claimed address and used addresses are saved at, not defined doesn't save them
+
+#ifdef J1939_EEPROM_ADDRESS
+ #define J1939_EEPROM_SIZE       (33 + J1939_CONTROLLER_APPS)    //used address bitmap, last claimed addresses and signature
+ #if getenv("DATA_EEPROM") < (J1939_EEPROM_ADDRESS + J1939_EEPROM_SIZE)
+  #error Device data EEPROM is too small for J1939_EEPROM_ADDRESS
+ #endif
+#endif
+
 ////////////////////////////////////////////////////////////////////////////////  Global variables
 
-//global variables containing unit's J1939 Address and Name
-uint8_t g_MyJ1939Address;
-uint8_t g_J1939Name[8];
+//J1939 Controller Application Structure
+typedef struct _J1939_CA_STRUCT {
+   uint8_t Address;              //Address of controller application, preferred address until one is claimed
+   uint8_t Name[8];              //J1939 Name of controller application
+   uint8_t ClaimState;           //Address Claim state, see J1939_CLAIM_xxx defines
+   int1 ClaimPending;            //Address Claimed or Cannot Claim Address waiting to be sent, see J1939ClaimXmitTask()
+} J1939_CA_STRUCT;
+
+//global controller applications of unit, J1939InitAddress() and J1939InitName()
+//set Address and Name of each
+J1939_CA_STRUCT g_J1939CA[J1939_CONTROLLER_APPS];
+
+//unit's J1939 Address and Name, those of controller application 0
+#define g_MyJ1939Address   g_J1939CA[0].Address
+#define g_J1939Name        g_J1939CA[0].Name
+
+#define J1939_CA_NONE      255   //address isn't one of unit's controller applications
+
+//J1939 Name fields, Name[0] is least significant byte of 64 bit Name and Name[7]
+//most significant, lowest Name value has priority in Address Claim
+#define J1939NameIdentity(Name)         make32(0, Name[2] & 0x1F, Name[1], Name[0])        //21 bit Identity Number
+#define J1939NameManufacturer(Name)     (((uint16_t)Name[3] << 3) | (Name[2] >> 5))       //11 bit Manufacturer Code
+#define J1939NameECUInstance(Name)      (Name[4] & 0x07)                                   //3 bit ECU Instance
+#define J1939NameFunctionInstance(Name) (Name[4] >> 3)                                     //5 bit Function Instance
+#define J1939NameFunction(Name)         (Name[5])                                          //8 bit Function
+#define J1939NameVehicleSystem(Name)    (Name[6] >> 1)                                     //7 bit Vehicle System
+#define J1939NameSystemInstance(Name)   (Name[7] & 0x0F)                                   //4 bit Vehicle System Instance
+#define J1939NameIndustryGroup(Name)    ((Name[7] >> 4) & 0x07)                            //3 bit Industry Group
+#define J1939NameArbitrary(Name)        bit_test(Name[7],7)                                //Arbitrary Address Capable
+
+#if J1939_CONTROLLER_APPS > 1
+//global lookup of controller application using each address, J1939_CA_NONE if none
+uint8_t g_J1939AddressCA[256];
+
+#define J1939AddressCA(Address)     (g_J1939AddressCA[Address])
+#define J1939SourceClaimed(Address) J1939OwnAddress(Address)
+#else
+#define J1939AddressCA(Address)     (((Address) == g_MyJ1939Address) ? 0 : J1939_CA_NONE)
+#define J1939SourceClaimed(Address) J1939AddressClaimed(0)    //messages are sent from the only controller application
+#endif
 
 //global J1939 tick variables
 
-J1939_TICK_TYPE g_J1939CurrentClaimTick, g_J1939PreviousClaimTick;
 J1939_TICK_TYPE g_J1939PreviousCannotClaimTick;
 J1939_TICK_TYPE g_J1939CannotClaimDelay;
 
@@ -62,6 +343,16 @@ typedef struct _J1939_PDU_STRUCT {
    uint8_t unused7_5:3;          //unused bits don't do anything with them
 } J1939_PDU_STRUCT;
 
+#if J1939_TIMESTAMP != J1939_TIMESTAMP_NONE
+//J1939 Timestamp Structure
+typedef struct _J1939_TIMESTAMP_STRUCT {
+   J1939_TICK_TYPE Tick;         //J1939GetTick() when J1939ReceiveTask() read message
+  #if J1939_TIMESTAMP == J1939_TIMESTAMP_CAPTURE
+   uint16_t Capture;             //CCP1 timer value captured at start of frame, of latest frame when several were waiting
+  #endif
+} J1939_TIMESTAMP_STRUCT;
+#endif
+
 //J1939 Message Structure
 typedef struct _J1939_MESSAGE_STRUCT {
    J1939_PDU_STRUCT PDU;
@@ -69,8 +360,26 @@ typedef struct _J1939_MESSAGE_STRUCT {
    uint8_t Data[8];
 } J1939_MESSAGE_STRUCT;
 
+#if J1939_TIMESTAMP != J1939_TIMESTAMP_NONE
+//J1939 Received Message Structure, a J1939_MESSAGE_STRUCT with the time it was
+//received so only the receive buffer grows
+typedef struct _J1939_RECEIVED_STRUCT {
+   J1939_PDU_STRUCT PDU;
+   uint8_t Length;
+   uint8_t Data[8];
+   J1939_TIMESTAMP_STRUCT Time;  //Time message was received
+} J1939_RECEIVED_STRUCT;
+#endif
+
 //global J1939 Receive and Transmit buffers
+#if J1939_TIMESTAMP != J1939_TIMESTAMP_NONE
+J1939_RECEIVED_STRUCT g_J1939ReceiveBuffer[J1939_RECEIVE_BUFFERS];
+#else
 J1939_MESSAGE_STRUCT g_J1939ReceiveBuffer[J1939_RECEIVE_BUFFERS];
+#endif
+#if J1939_TIMESTAMP != J1939_TIMESTAMP_NONE
+J1939_TIMESTAMP_STRUCT g_J1939ReceiveTime;   //Time message J1939ReceiveTask() is handling was received
+#endif
 J1939_MESSAGE_STRUCT g_J1939XmitBuffer[J1939_TRANSMIT_BUFFERS];
 
 //global J1939 variable for indexing J1939 Receive and Transmit buffers
@@ -81,11 +390,6 @@ static uint8_t g_J1939XmitNextOut;
 
 //J1939 Flag structure
 typedef struct _J1939_FLAGS_STRUCT {
-   int1    AddressClaimed;       //Unit Successfully claimed an address
-   int1    AddressClaimSent;     //Unit has sent a claim request
-   int1    AddressNewClaim;      //Used to specify if claim request is for a new address
-   int1    AddressCannotClaim;   //If not arbitrary address capable, is set if unit can't claim address
-   uint8_t unused4_1:4;
    uint8_t ReceiveBufferCount;   //Keep track of number of stored messages in receive buffer
    uint8_t XmitBufferCount;      //Keep track of number of messages that still need transmitted
 } J1939_FLAGS_STRUCT;
@@ -93,9 +397,292 @@ typedef struct _J1939_FLAGS_STRUCT {
 //global J1939 Flag structure variable
 J1939_FLAGS_STRUCT g_J1939Flags;
 
+//J1939 Address Claim states
+#define J1939_CLAIM_IDLE            0  //no Address Claimed sent yet
+#define J1939_CLAIM_CLAIMING        1  //Address Claimed for controller application's address waiting in transmit buffer
+#define J1939_CLAIM_CONTENDING      2  //Address Claimed sent, waiting J1939_ADDRESS_CLAIM_TIME for contending claims
+#define J1939_CLAIM_CLAIMED         3  //controller application owns its address
+#define J1939_CLAIM_CANNOT_CLAIM    4  //lost address and not Arbitrary Address Capable, Cannot Claim Address sent
+#define J1939_CLAIM_STATES          5
+
+//J1939 Address Claim events
+#define J1939_CLAIM_EV_CLAIM        0  //J1939ClaimAddress() queued Address Claimed
+#define J1939_CLAIM_EV_SENT         1  //Address Claimed for unit's address put on bus
+#define J1939_CLAIM_EV_SENT_NOW     2  //same, for an address that may be used without waiting for contending claims
+#define J1939_CLAIM_EV_TIMEOUT      3  //J1939_ADDRESS_CLAIM_TIME elapsed
+#define J1939_CLAIM_EV_LOST         4  //higher priority Name claimed address, new arbitrary address queued
+#define J1939_CLAIM_EV_LOST_CANNOT  5  //higher priority Name claimed address, unit isn't Arbitrary Address Capable
+#define J1939_CLAIM_EVENTS          6
+
+//J1939 Address Claim state transitions, next state indexed by [state][event]
+const uint8_t g_J1939ClaimTransition[J1939_CLAIM_STATES][J1939_CLAIM_EVENTS] = {
+//  EV_CLAIM                EV_SENT                   EV_SENT_NOW               EV_TIMEOUT                EV_LOST                   EV_LOST_CANNOT
+   {J1939_CLAIM_CLAIMING,   J1939_CLAIM_IDLE,         J1939_CLAIM_IDLE,         J1939_CLAIM_IDLE,         J1939_CLAIM_IDLE,         J1939_CLAIM_IDLE},           //IDLE
+   {J1939_CLAIM_CLAIMING,   J1939_CLAIM_CONTENDING,   J1939_CLAIM_CLAIMED,      J1939_CLAIM_CLAIMING,     J1939_CLAIM_CLAIMING,     J1939_CLAIM_CANNOT_CLAIM},   //CLAIMING
+   {J1939_CLAIM_CLAIMING,   J1939_CLAIM_CONTENDING,   J1939_CLAIM_CLAIMED,      J1939_CLAIM_CLAIMED,      J1939_CLAIM_CLAIMING,     J1939_CLAIM_CANNOT_CLAIM},   //CONTENDING
+   {J1939_CLAIM_CLAIMING,   J1939_CLAIM_CLAIMED,      J1939_CLAIM_CLAIMED,      J1939_CLAIM_CLAIMED,      J1939_CLAIM_CLAIMING,     J1939_CLAIM_CANNOT_CLAIM},   //CLAIMED
+   {J1939_CLAIM_CLAIMING,   J1939_CLAIM_CANNOT_CLAIM, J1939_CLAIM_CANNOT_CLAIM, J1939_CLAIM_CANNOT_CLAIM, J1939_CLAIM_CANNOT_CLAIM, J1939_CLAIM_CANNOT_CLAIM}    //CANNOT_CLAIM
+};
+
+#define J1939AddressClaimed(CA)  (g_J1939CA[CA].ClaimState == J1939_CLAIM_CLAIMED)
+
+#if J1939_CLAIM_STATS == TRUE
+//J1939 Address Claim Statistics Structure
+typedef struct _J1939_CLAIM_STATS_STRUCT {
+   uint16_t ClaimsSent;          //Address Claimed messages put on bus
+   uint16_t ClaimsLost;          //addresses lost to a higher priority Name
+   uint16_t ClaimsDefended;      //claims of controller application's address it won
+   uint16_t CannotClaim;         //times controller application ended in Cannot Claim
+   J1939_TICK_TYPE StartTick;    //Tick J1939ClaimAddress() last started claiming
+   J1939_TICK_TYPE ClaimTime;    //Ticks from StartTick to owning an address, lost claims included
+} J1939_CLAIM_STATS_STRUCT;
+
+//global J1939 Address Claim statistics of each controller application
+J1939_CLAIM_STATS_STRUCT g_J1939ClaimStats[J1939_CONTROLLER_APPS];
+#endif
+
 //global variable used in generating pseudo-random 8-bit number
 uint8_t rand_seed;
 
+//global bitmap of addresses other nodes were seen using since power up, bit
+//(address & 7) of byte (address >> 3)
+uint8_t g_J1939AddressUsed[32];
+
+//global state of arbitrary address generator, seeded from unit's Name so units
+//draw different addresses
+uint16_t g_J1939AddressSeed;
+
+#ifdef J1939_EEPROM_ADDRESS
+//global J1939 data EEPROM state
+int1 g_J1939EepromValid;         //EEPROM held saved addresses at power up
+int1 g_J1939EepromDirty;         //EEPROM differs from g_J1939AddressUsed or claimed address
+uint8_t g_J1939EepromNext;       //Next EEPROM byte J1939EepromTask() checks
+#endif
+
+//J1939 Commanded Address Structure, a Commanded Address BAM is received here
+//instead of in the Transport Protocol pool, so it works with J1939_TP_SESSIONS
+//or J1939_TP_BLOCKS set to 0
+typedef struct _J1939_COMMANDED_STRUCT {
+   uint8_t Source;               //Sender of BAM being received, J1939_NULL_ADDRESS if none
+   uint8_t Packets;              //TP.DT packets received
+   J1939_TICK_TYPE Tick;         //Tick last packet was received at
+   uint8_t Data[14];             //Data of both TP.DT packets
+} J1939_COMMANDED_STRUCT;
+
+//global J1939 Commanded Address BAM
+J1939_COMMANDED_STRUCT g_J1939Commanded;
+
+#if J1939_ADDRESS_TABLE_SIZE > 0
+//J1939 Address Table Entry Structure
+typedef struct _J1939_ADDRESS_ENTRY_STRUCT {
+   uint8_t Address;              //Address claimed by node, J1939_NULL_ADDRESS if entry is unused
+   uint8_t Name[8];              //J1939 Name of node
+   J1939_TICK_TYPE LastSeen;     //Tick of last message received from node
+} J1939_ADDRESS_ENTRY_STRUCT;
+
+//global J1939 address table of other nodes on network, built from received
+//Address Claimed messages.  Entries are found through two hashed indexes, by
+//address and by Name, with linear probing, each index slot is an entry number
+//or J1939_ADDRESS_NONE.
+J1939_ADDRESS_ENTRY_STRUCT g_J1939AddressTable[J1939_ADDRESS_TABLE_SIZE];
+uint8_t g_J1939AddressIndex[2][J1939_ADDRESS_INDEX_SIZE];
+#endif
+
+//J1939 Timer Callback, called with the expired timer
+typedef void (*J1939_TIMER_CALLBACK)(uint8_t Timer);
+
+//J1939 Timer Structure, running timers are linked into a slot of the timer wheel
+typedef struct _J1939_TIMER_STRUCT {
+   uint16_t Expiry;              //Timer wheel slot count that timer expires at
+   uint8_t  Slot;                //Timer wheel slot timer is linked into, J1939_TIMER_STOPPED if not running
+   uint8_t  Next;                //Next timer in slot
+   uint8_t  Prev;                //Previous timer in slot
+   J1939_TIMER_CALLBACK Callback;   //Function called when timer expires
+} J1939_TIMER_STRUCT;
+
+//Timers used by driver, application timers follow
+#define J1939_TIMER_TP              0                          //first Transport Protocol session timer
+#define J1939_TIMER_ADDRESS_CLAIM   J1939_TP_SESSIONS          //Address Claim timer of first controller application
+#define J1939_TIMER_USER            (J1939_TP_SESSIONS + J1939_CONTROLLER_APPS)    //first application timer
+#define J1939_TIMERS                (J1939_TP_SESSIONS + J1939_CONTROLLER_APPS + J1939_USER_TIMERS)
+
+//Timer wheel has two levels, each level 0 slot is one J1939_TIMER_RESOLUTION,
+//each level 1 slot spans all of level 0.  Timers longer than the wheel are
+//cascaded again until they expire.
+#define J1939_TIMER_SLOTS0       32    //level 0 slots, must be power of 2
+#define J1939_TIMER_SLOTS1       16    //level 1 slots, must be power of 2
+#define J1939_TIMER_SHIFT        5     //log2 of J1939_TIMER_SLOTS0
+#define J1939_TIMER_STOPPED      255   //timer isn't linked into the wheel
+#define J1939_TIMER_NONE         255   //marks end of a slot's list of timers
+
+//global J1939 timers and timer wheel
+J1939_TIMER_STRUCT g_J1939Timer[J1939_TIMERS];
+uint8_t g_J1939TimerWheel[J1939_TIMER_SLOTS0 + J1939_TIMER_SLOTS1];  //First timer of each slot
+static uint16_t g_J1939TimerNow;             //Timer wheel slot count, advanced every J1939_TIMER_RESOLUTION ticks
+static J1939_TICK_TYPE g_J1939TimerTick;     //Tick that g_J1939TimerNow was last advanced at
+
+#if J1939_STAGED_FILTERS > 0
+#define J1939_FILTER_FIRST       6     //ECAN filter loaded with first staged address
+#define J1939_FILTER_NONE        255   //no staged filter is accepting frames
+
+//global J1939 staged address filters
+uint8_t g_J1939StagedAddress[J1939_STAGED_FILTERS];   //Address each staged filter is loaded with
+uint8_t g_J1939StagedNext;       //Next staged address to use when unit loses its address
+uint8_t g_J1939StagedActive;     //Staged filter accepting frames to unit's address, J1939_FILTER_NONE until address is claimed
+#endif
+
+#if J1939_FILTER_TASK == TRUE
+//global address filters waiting for CAN to be in Config mode
+uint8_t g_J1939FilterAddress[J1939_CONTROLLER_APPS];  //Address to load in filter of each controller application
+uint16_t g_J1939FilterPending;                        //Bit of each controller application whose filter is waiting
+J1939_TICK_TYPE g_J1939ModeStart;                     //Tick Config mode was requested at
+J1939_TICK_TYPE g_J1939ModeTime;                      //Ticks last filter reload waited for Config mode
+#endif
+
+#if J1939_AUTOBAUD == TRUE
+uint32_t g_J1939BaudRate;     //Bit rate J1939Init() found, 0 if no frame was received at any rate
+#endif
+
+#if J1939_BUS_MONITOR == TRUE
+//J1939 Bus Callback, called with the new CAN error state, CAN_ERROR_ACTIVE,
+//CAN_ERROR_WARNING, CAN_ERROR_PASSIVE or CAN_ERROR_BUS_OFF
+typedef void (*J1939_BUS_CALLBACK)(uint8_t State);
+
+//global CAN error state monitor
+J1939_BUS_CALLBACK g_J1939BusCallback;   //Function called when error state changes, 0 if none
+uint8_t g_J1939BusState;                 //Error state last read from CAN
+J1939_TICK_TYPE g_J1939BusStateTick;     //Tick error state last changed at
+J1939_TICK_TYPE g_J1939BusBackoff;       //Ticks to stay off the bus before next recovery
+J1939_TICK_TYPE g_J1939PassiveXmitTick;  //Tick last rate-limited message was sent at
+uint16_t g_J1939BusOffs;                 //Times CAN went bus-off
+uint8_t g_J1939BusRecover;               //Step of bus-off recovery, see J1939_BUS_RECOVER defines
+uint16_t g_J1939BusPending;              //CAN transmit buffers to send again once recovered
+J1939_TICK_TYPE g_J1939BusRecoverTick;   //Tick bus-off recovery started at
+
+//Defines used with bus-off recovery
+#define J1939_BUS_RECOVER_NONE      0  //not recovering
+#define J1939_BUS_RECOVER_CONFIG    1  //Config mode requested to reset error counters
+#define J1939_BUS_RECOVER_NORMAL    2  //Normal mode requested, transmit buffers sent again once reached
+#endif
+
+#if J1939_SUBSCRIBED_PGNS > 0
+//Handler messages of a subscribed PGN are passed to instead of being put in receive buffer
+typedef void (*J1939_PGN_HANDLER)(J1939_PDU_STRUCT *PDU, uint8_t *Data, uint8_t Length);
+
+//global PDU2 PGNs subscribed to with J1939Subscribe(), other broadcast PGNs are
+//dropped, all are received if there are none
+uint32_t g_J1939SubscribedPGN[J1939_SUBSCRIBED_PGNS];
+J1939_PGN_HANDLER g_J1939SubscribedHandler[J1939_SUBSCRIBED_PGNS];   //Handler of each subscribed PGN, 0 if none
+static uint8_t g_J1939SubscribedCount;       //Number of entries of g_J1939SubscribedPGN in use
+static int1 g_J1939PGNFiltersDirty;          //Subscriptions changed since filters were loaded
+
+ #if J1939_PGN_FILTERS > 0
+//global handler of each ECAN filter, by filter hit of received message, set for
+//filters loaded with exactly one subscribed PGN that has a handler
+J1939_PGN_HANDLER g_J1939FilterHandler[16];
+ #endif
+
+//PGN key of Mask 1 filters, lower nibble of PDU Format and PDU Specific in bits 0 to 11
+//and Data Page and Extended Data Page in bits 12 and 13, upper nibble of PDU Format is
+//always 15 for PDU2 PGNs
+#define J1939_PGN_KEY_MASK       0x3FFF
+#define J1939PGNKey(PGN)         ((make16(make8(PGN,1),make8(PGN,0)) & 0x0FFF) | ((uint16_t)(make8(PGN,2) & 0x03) << 12))
+#define J1939PGNKeyId(Key)       (0x00F00000 | ((uint32_t)((Key) & 0x0FFF) << 8) | ((uint32_t)((Key) >> 12) << 24))
+#endif
+
+#if J1939_ACCEPT_FILTER == TRUE
+#define J1939_ACCEPT_NONE        0     //messages of PDU Format dropped
+#define J1939_ACCEPT_MAP         1     //messages of PDU Format accepted if PDU Specific is set in PDU Format's map
+#define J1939_ACCEPT_ALL         3     //messages of PDU Format accepted
+
+//global software accept stage, 2 bits for each PDU Format and a map of accepted
+//PDU Specific values, Destination Address or Group Extension, for a few of them
+uint8_t g_J1939AcceptPF[64];
+uint8_t g_J1939AcceptMap[J1939_ACCEPT_MAPS][32];
+uint8_t g_J1939AcceptMapPF[J1939_ACCEPT_MAPS];        //PDU Format using map, map is free if PDU Format isn't J1939_ACCEPT_MAP
+
+#define J1939AcceptState(PF)     ((g_J1939AcceptPF[(PF) >> 2] >> (((PF) & 0x03) << 1)) & 0x03)
+#endif
+
+#if J1939_TP_SESSIONS > 0
+//J1939 Transport Protocol Session Structure
+typedef struct _J1939_TP_SESSION_STRUCT {
+   J1939_PDU_STRUCT PDU;         //PDU of packeted message, returned with message by J1939TPGetMessage()
+   uint32_t PGN;                 //Parameter Group Number of packeted message
+   uint8_t  Destination;         //Destination Address of session, Global Address 255 for BAM
+   uint8_t  State;               //Session state, see J1939_TP_STATE defines
+   uint16_t Size;                //Total number of bytes in packeted message
+   uint16_t Count;               //Number of bytes received
+   uint8_t  Packets;             //Total number of packets in packeted message, sequence counter of Fast Packet message
+   uint8_t  NextSequence;        //Sequence number of next expected TP.DT packet, frame counter of next Fast Packet frame
+   uint8_t  WindowSize;          //Maximum number of packets to request with each TP.CM_CTS
+   uint8_t  WindowEnd;           //Sequence number of last packet requested with TP.CM_CTS
+   uint8_t  FirstBlock;          //First block of session's chain in Transport Protocol pool
+   uint8_t  LastBlock;           //Last block of session's chain in Transport Protocol pool
+   uint8_t  Blocks;              //Number of blocks in session's chain
+   uint8_t  Reserved;            //Number of blocks reserved for RTS/CTS session still to be allocated
+   uint8_t  Timer;               //Timer of session, running while session is open
+   uint8_t  Index;               //Slot of session in g_J1939TPIndex, J1939_TP_NOT_INDEXED if not being received
+  #if J1939_TP_SINKS > 0
+   uint8_t  Sink;                //Index into g_J1939TPSink of sink packets are streamed to, J1939_TP_NO_SINK if stored in pool
+  #endif
+} J1939_TP_SESSION_STRUCT;
+
+//global J1939 Transport Protocol sessions, also used for Fast Packet messages
+J1939_TP_SESSION_STRUCT g_J1939TPSession[J1939_TP_SESSIONS];
+
+//global J1939 Transport Protocol session index, sessions being received are
+//hashed by Source Address and Destination Address (Fast Packet by PGN) with
+//linear probing, each slot is a session number or J1939_TP_INDEX_EMPTY
+uint8_t g_J1939TPIndex[J1939_TP_INDEX_SIZE];
+
+#if J1939_TP_BLOCKS > 0
+//global J1939 Transport Protocol buffer pool, blocks are linked into a chain for
+//each session and unused blocks are linked into the free list
+uint8_t g_J1939TPPool[J1939_TP_BLOCKS][J1939_TP_BLOCK_SIZE];
+uint8_t g_J1939TPPoolLink[J1939_TP_BLOCKS];  //Next block in chain or free list
+static uint8_t g_J1939TPPoolFree;            //First block of free list
+static uint8_t g_J1939TPPoolUsed;            //Number of blocks currently allocated
+static uint8_t g_J1939TPPoolPeak;            //Highest number of blocks allocated at same time
+static uint8_t g_J1939TPPoolReserved;        //Number of free blocks reserved for RTS/CTS sessions
+#endif
+
+//global J1939 Transport Protocol TP.CM messages that didn't fit in transmit
+//buffer, sent by J1939XmitTask() ahead of transmit buffer
+J1939_MESSAGE_STRUCT g_J1939TPCMBuffer[J1939_TP_SESSIONS];
+static uint8_t g_J1939TPCMNextOut;
+static uint8_t g_J1939TPCMCount;
+
+#if J1939_TP_SINKS > 0
+//J1939 Transport Protocol Sink, called with each in order TP.DT packet of a
+//packeted message.  Offset is the position of Data in the packeted message,
+//message is complete when Offset + Length equals Session->Size.  Called with
+//Length 0 if session is aborted or times out.
+typedef void (*J1939_TP_SINK)(J1939_TP_SESSION_STRUCT *Session, uint16_t Offset, uint8_t *Data, uint8_t Length);
+
+//J1939 Transport Protocol Sink Structure
+typedef struct _J1939_TP_SINK_STRUCT {
+   uint32_t PGN;                 //Parameter Group Number streamed to Sink
+   J1939_TP_SINK Sink;           //Sink function, 0 if entry is unused
+} J1939_TP_SINK_STRUCT;
+
+//global J1939 Transport Protocol sinks
+J1939_TP_SINK_STRUCT g_J1939TPSink[J1939_TP_SINKS];
+#endif
+
+#if J1939_FP_PGNS > 0
+//J1939 Fast Packet PGN Structure
+typedef struct _J1939_FP_PGN_STRUCT {
+   uint32_t PGN;                 //PDU2 Parameter Group Number sent and received as Fast Packet, 0 if entry is unused
+   uint8_t  Sequence;            //Sequence counter of next Fast Packet message sent with PGN
+} J1939_FP_PGN_STRUCT;
+
+//global J1939 Fast Packet PGNs
+J1939_FP_PGN_STRUCT g_J1939FPPGN[J1939_FP_PGNS];
+static uint8_t g_J1939FPXmitSession;         //Session currently being sent by J1939XmitTask(), J1939_FP_NONE if none
+#endif
+#endif
+
 //////////////////////////////////////////////////////////////////////////////// J1939 Defines
 
 //PDU Format Defines
@@ -111,6 +698,9 @@ uint8_t rand_seed;
 #define J1939_PF_ADDR_CLAIMED       238
 #define J1939_PF_ADDR_CANNOT_CLAIM  238
 
+#define J1939_PGN_COMMANDED_ADDRESS 65240   //Name of node and new address, sent with Transport Protocol
+#define J1939_COMMANDED_ADDRESS_SIZE 9
+
 //PDU Default Priorities Defines
 #define J1939_CONTROL_PRIORITY         3
 #define J1939_REQUEST_PRIORITY         6
@@ -123,23 +713,74 @@ uint8_t rand_seed;
 #define J1939_TP_DT_PRIORITY           7
 
 //Defines used with Transport Protocol Messages (refer to J1939-21 for spec)
-#define J1939_TP_CM_CTS          16
-#define J1939_TP_CM_DTS          17
+#define J1939_TP_CM_RTS          16
+#define J1939_TP_CM_CTS          17
+#define J1939_TP_CM_DTS          17    //kept for compatibility, same as J1939_TP_CM_CTS
 #define J1939_TP_CM_EOF          19
 #define J1939_TP_CM_ABORT        255
 #define J1939_TP_CM_BAM          32
 
+#define J1939_TP_MAX_SIZE        1785  //maximum number of bytes in a packeted message
+#define J1939_TP_NO_BLOCK        255   //marks end of a chain in Transport Protocol pool
+#define J1939_TP_NO_SINK         255   //session is not streamed to a sink
+#define J1939_TP_INDEX_EMPTY     255   //index slot isn't used, ends a probe
+#define J1939_TP_NOT_INDEXED     255   //session isn't in index
+
+//Gets session number of a session from its timer
+#define J1939TPSessionNumber(Session)  ((Session)->Timer - J1939_TIMER_TP)
+
+//Transport Protocol Connection Abort Reasons
+#define J1939_TP_ABORT_BUSY      1     //already in one or more connection managed sessions
+#define J1939_TP_ABORT_RESOURCES 2     //system resources needed for another task
+#define J1939_TP_ABORT_TIMEOUT   3     //a timeout occurred
+#define J1939_TP_ABORT_SEQUENCE  7     //bad sequence number
+
+//Transport Protocol Session States
+#define J1939_TP_STATE_IDLE      0     //session not in use
+#define J1939_TP_STATE_BAM       1     //receiving a BAM packeted message
+#define J1939_TP_STATE_RTS       2     //receiving a RTS/CTS packeted message
+#define J1939_TP_STATE_COMPLETE  3     //packeted message received, waiting for J1939TPGetMessage()
+#define J1939_TP_STATE_FAST      4     //receiving a Fast Packet message
+#define J1939_TP_STATE_FAST_XMIT 5     //sending a Fast Packet message
+
+//Defines used with Fast Packet Messages (refer to NMEA 2000 and ISO 11783-3)
+#define J1939_FP_MAX_SIZE        223   //maximum number of bytes in a Fast Packet message
+#define J1939_FP_NONE            255   //PGN isn't registered as Fast Packet
+
+//Transport Protocol Timeouts
+#define J1939_TP_T1              ((J1939_TICK_TYPE)J1939_TICKS_PER_SECOND*3/4)  //750ms between TP.DT packets
+#define J1939_TP_T2              ((J1939_TICK_TYPE)J1939_TICKS_PER_SECOND*5/4)  //1250ms after sending TP.CM_CTS
+
+//Address Claim Timeout
+#define J1939_ADDRESS_CLAIM_TIME ((J1939_TICK_TYPE)J1939_TICKS_PER_SECOND/4)    //250ms after sending Address Claimed before address is ours
+
+//J1939 data EEPROM layout, from J1939_EEPROM_ADDRESS
+#define J1939_EEPROM_USED        0     //32 byte bitmap of addresses used by other nodes
+#define J1939_EEPROM_CLAIMED     32    //last address each controller application claimed
+#define J1939_EEPROM_SIGNATURE   (32 + J1939_CONTROLLER_APPS)   //J1939_EEPROM_VALID once layout has been written
+#define J1939_EEPROM_VALID       0xA5
+
 //J1939 Address Defines
 #define J1939_NULL_ADDRESS       254
 #define J1939_GLOBAL_ADDRESS     255
 
+//Defines used with Address Table
+#define J1939_ADDRESS_NONE       255   //no entry, also marks unused index slot
+#define J1939_INDEX_ADDRESS      0     //index of g_J1939AddressIndex by address
+#define J1939_INDEX_NAME         1     //index of g_J1939AddressIndex by Name
+
 //////////////////////////////////////////////////////////////////////////////// J1939 Baud Rate
 
 #ifndef J1939_BAUD_RATE
 #define J1939_BAUD_RATE 250000
 #endif
 
-#ifndef CAN_BRG_PRESCALAR
+#ifndef CAN_BITRATE
+#define CAN_BITRATE J1939_BAUD_RATE    //PIC18 ECAN driver solves bit timing for it when no Set_xxxK_Baud is defined
+#endif
+
+//PIC18 ECAN driver solves bit timing for CAN_BITRATE itself with can_set_bit_timing(), so no table
+#if !defined(CAN_BRG_PRESCALAR) && !((USE_INTERNAL_CAN == TRUE) && defined(__PCH__))
  #if USE_INTERNAL_CAN == TRUE
   #if getenv("CLOCK") == 8000000
    #if J1939_BAUD_RATE == 250000
@@ -343,21 +984,157 @@ uint8_t rand_seed;
 
 //////////////////////////////////////////////////////////////////////////////// Prototypes
 
-void J1939Init(void);
+int1 J1939Init(void);
 #separate
 void J1939ReceiveTask(void);
 #separate
 void J1939XmitTask(void);
 int1 J1939Kbhit(void);
 int1 J1939GetMessage(J1939_PDU_STRUCT &PDU, uint8_t *Data, uint8_t &Length);
+#if J1939_TIMESTAMP != J1939_TIMESTAMP_NONE
+int1 J1939GetMessage(J1939_PDU_STRUCT &PDU, uint8_t *Data, uint8_t &Length, J1939_TIMESTAMP_STRUCT &Time);
+#endif
 int1 J1939PutMessage(J1939_PDU_STRUCT PDU, uint8_t *Data, uint8_t Bytes);
 void J1939RequestAddress(uint8_t address);
-void J1939ClaimAddress(void);
+#if J1939_CLAIM_STATS == TRUE
+void J1939GetClaimStats(uint8_t CA, J1939_CLAIM_STATS_STRUCT *Stats);
+#endif
+#if J1939_SUBSCRIBED_PGNS > 0
+int1 J1939Subscribe(uint32_t PGN);
+int1 J1939SubscribeHandler(uint32_t PGN, J1939_PGN_HANDLER Handler);
+int1 J1939Unsubscribe(uint32_t PGN);
+#endif
+#if J1939_ACCEPT_FILTER == TRUE
+void J1939AcceptFormat(uint8_t PF, int1 Accept);
+int1 J1939Accept(uint8_t PF, uint8_t PS);
+#endif
+void J1939ClaimAddress(uint8_t CA);
 int1 J1939CheckName(uint8_t *data);
+int1 J1939CompareName(uint8_t CA, uint8_t *data);
+int1 J1939OwnAddress(uint8_t Address);
+#if J1939_CONTROLLER_APPS > 1
+void J1939AddressCAUpdate(void);
+#endif
+void J1939XmitFlush(uint8_t Address);
+void J1939ClaimXmitTask(void);
 void J1939HandleAddressRequest(J1939_PDU_STRUCT PDU);
 void J1939LoadReceiveBuffer(J1939_PDU_STRUCT ReceivedPDU,uint8_t *Data,uint8_t length);
 void J1939HandleAddressClaim(J1939_PDU_STRUCT ReceivedPDU, uint8_t *Name);
-void J1939SetCANFilter(uint8_t address);
+void J1939HandleCommandedAddress(uint8_t *Data);
+int1 J1939CommandedReceive(J1939_PDU_STRUCT ReceivedPDU, uint8_t *Data);
+void J1939SetCANFilter(uint8_t CA, uint8_t address);
+#if J1939_FILTER_TASK == TRUE
+void J1939FilterTask(void);
+#endif
+#if J1939_MODE_TASK == TRUE
+int1 J1939ModeTask(void);
+#endif
+#if J1939_BUS_MONITOR == TRUE
+void J1939SetBusCallback(J1939_BUS_CALLBACK Callback);
+void J1939BusTask(void);
+#endif
+uint8_t J1939ArbitraryAddress(void);
+uint8_t J1939RandomAddress(void);
+void J1939AddressSeedInit(void);
+uint8_t J1939AddressRandom(void);
+void J1939AddressUse(uint8_t Address);
+int1 J1939AddressTaken(uint8_t Address);
+#ifdef J1939_EEPROM_ADDRESS
+void J1939EepromLoad(void);
+void J1939EepromTask(void);
+#endif
+#if J1939_STAGED_FILTERS > 0
+void J1939StageFilters(uint8_t address);
+uint8_t J1939StagedFilter(uint8_t address);
+#endif
+void J1939AddressClaimTimeout(uint8_t Timer);
+void J1939ClaimEvent(uint8_t CA, uint8_t Event);
+#if J1939_ACCEPT_FILTER == TRUE
+void J1939AcceptSet(uint8_t PF, uint8_t State);
+int1 J1939Accepted(uint8_t PF, uint8_t PS);
+#endif
+#if J1939_SUBSCRIBED_PGNS > 0
+int1 J1939Subscribed(uint32_t PGN);
+J1939_PGN_HANDLER J1939SubscribedHandler(uint32_t PGN);
+void J1939LoadPGNFilters(void);
+ #if J1939_PGN_FILTERS > 0
+uint8_t J1939PGNFilterCount(uint16_t *Key, uint16_t Mask, uint8_t Limit);
+ #endif
+#endif
 uint8_t xor8(void);
+uint32_t J1939GetPGN(J1939_PDU_STRUCT PDU);
+
+#if J1939_ADDRESS_TABLE_SIZE > 0
+int1 J1939LookupAddress(uint8_t Address, uint8_t *Name, J1939_TICK_TYPE &LastSeen);
+uint8_t J1939LookupName(uint8_t *Name);
+void J1939AddressTableInit(void);
+void J1939AddressTableClaim(uint8_t Address, uint8_t *Name);
+void J1939AddressTableSeen(uint8_t Address);
+uint8_t J1939AddressTableFindAddress(uint8_t Address);
+uint8_t J1939AddressTableFindName(uint8_t *Name);
+uint8_t J1939AddressTableHome(uint8_t Index, uint8_t Entry);
+void J1939AddressTableLink(uint8_t Entry);
+void J1939AddressTableUnlink(uint8_t Entry);
+uint8_t J1939AddressHash(uint8_t Address);
+uint8_t J1939NameHash(uint8_t *Name);
+#endif
+
+void J1939TimerStart(uint8_t Timer, J1939_TICK_TYPE Ticks, J1939_TIMER_CALLBACK Callback);
+void J1939TimerStop(uint8_t Timer);
+int1 J1939TimerRunning(uint8_t Timer);
+void J1939TimerInit(void);
+void J1939TimerTask(void);
+void J1939TimerLink(uint8_t Timer);
+void J1939TimerUnlink(uint8_t Timer);
+
+#if J1939_TP_SESSIONS > 0
+ #if J1939_FP_PGNS > 0
+int1 J1939FPRegister(uint32_t PGN);
+int1 J1939FPUnregister(uint32_t PGN);
+  #if J1939_TP_BLOCKS > 0
+int1 J1939FPPutMessage(J1939_PDU_STRUCT PDU, uint8_t *Data, uint8_t Length);
+  #endif
+ #endif
+ #if J1939_TP_BLOCKS > 0
+int1 J1939TPKbhit(void);
+int1 J1939TPGetMessage(J1939_PDU_STRUCT &PDU, uint8_t *Data, uint16_t MaxLength, uint16_t &Length);
+uint8_t J1939TPPoolPeak(void);
+ #endif
+ #if J1939_TP_SINKS > 0
+int1 J1939TPRegisterSink(uint32_t PGN, J1939_TP_SINK Sink);
+uint8_t J1939TPFindSink(uint32_t PGN);
+ #endif
+void J1939TPInit(void);
+void J1939TPTimeout(uint8_t Timer);
+void J1939TPReceive(J1939_PDU_STRUCT ReceivedPDU, uint8_t *Data);
+void J1939TPReceiveCM(J1939_PDU_STRUCT ReceivedPDU, uint8_t *Data);
+void J1939TPReceiveDT(J1939_PDU_STRUCT ReceivedPDU, uint8_t *Data);
+void J1939TPSendCM(uint8_t SourceAddress, uint8_t DestinationAddress, uint32_t PGN, uint8_t *Data);
+void J1939TPSendCTS(J1939_TP_SESSION_STRUCT *Session);
+void J1939TPCMXmitTask(void);
+void J1939TPAbort(J1939_TP_SESSION_STRUCT *Session, uint8_t Reason);
+J1939_TP_SESSION_STRUCT *J1939TPFindSession(uint8_t SourceAddress, uint8_t Destination);
+J1939_TP_SESSION_STRUCT *J1939TPOpenSession(J1939_PDU_STRUCT ReceivedPDU, uint8_t *Data);
+J1939_TP_SESSION_STRUCT *J1939TPIdleSession(void);
+uint8_t J1939TPIndexHash(uint8_t SourceAddress, uint8_t Key);
+void J1939TPIndexInsert(J1939_TP_SESSION_STRUCT *Session, uint8_t Key);
+void J1939TPIndexRemove(J1939_TP_SESSION_STRUCT *Session);
+uint8_t J1939TPIndexKey(J1939_TP_SESSION_STRUCT *Session);
+void J1939TPCloseSession(J1939_TP_SESSION_STRUCT *Session);
+int1 J1939TPStore(J1939_TP_SESSION_STRUCT *Session, uint8_t *Data, uint8_t Length);
+void J1939TPComplete(J1939_TP_SESSION_STRUCT *Session);
+ #if J1939_TP_BLOCKS > 0
+uint8_t J1939TPAllocBlock(J1939_TP_SESSION_STRUCT *Session);
+int1 J1939TPAppend(J1939_TP_SESSION_STRUCT *Session, uint8_t *Data, uint8_t Length);
+void J1939TPCopy(J1939_TP_SESSION_STRUCT *Session, uint16_t Offset, uint8_t *Data, uint16_t Length);
+ #endif
+ #if J1939_FP_PGNS > 0
+uint8_t J1939FPFind(uint32_t PGN);
+void J1939FPReceive(J1939_PDU_STRUCT ReceivedPDU, uint8_t *Data);
+void J1939FPXmitTask(void);
+J1939_TP_SESSION_STRUCT *J1939FPFindSession(uint8_t SourceAddress, uint32_t PGN);
+uint8_t J1939FPIndexKey(uint32_t PGN);
+ #endif
+#endif
 
 #endif
@@ -0,0 +1,125 @@
+////////////////////////////////////////////////////////////////////////////////
+////                             can-mcp251x.c                              ////
+////                                                                        ////
+//// Stub of the external CAN controller driver for the claim simulator.    ////
+//// Frames go to the simulated bus of sim_bus.h instead of an MCP2515.     ////
+//// Masks and filters work like the MCP2515's, mask 0 with filters 0 and   ////
+//// 1, mask 1 with filters 2 to 5, extended IDs only.  Bit timing and      ////
+//// error counters aren't simulated.                                       ////
+////                                                                        ////
+////////////////////////////////////////////////////////////////////////////////
+
+enum CAN_OP_MODE {CAN_OP_CONFIG=4, CAN_OP_LISTEN=3, CAN_OP_LOOPBACK=2, CAN_OP_SLEEP=1, CAN_OP_NORMAL=0};
+
+#define RX0MASK      0
+#define RX1MASK      1
+#define RX0FILTER0   2
+#define RX0FILTER1   3
+#define RX1FILTER2   4
+#define RX1FILTER3   5
+#define RX1FILTER4   6
+#define RX1FILTER5   7
+
+#define CAN_USE_EXTENDED_ID   TRUE
+
+struct rx_stat {
+   int1 err_ovfl;    //buffer overflow
+   uint8_t filthit;  //filter that allowed the frame into the buffer
+   uint8_t buffer;   //receive buffer
+   int1 rtr;         //rtr requested
+   int1 ext;         //extended id
+   int1 inv;         //invalid id?
+};
+
+uint32_t can_id[8];     //masks 0 and 1 then filters 0 to 5, indexed by RX0MASK to RX1FILTER5
+CAN_OP_MODE can_mode;
+
+////////////////////////////////////////////////////////////////////////////////
+//can_pdu_id()
+// Makes 29-bit CAN ID of a PDU, the layout CCS gives J1939_PDU_STRUCT.
+//  Parameters: PDU - the PDU
+//  Returns:    uint32_t - CAN ID
+////////////////////////////////////////////////////////////////////////////////
+uint32_t can_pdu_id(J1939_PDU_STRUCT &PDU)
+{
+   return(((uint32_t)PDU.Priority << 26) | ((uint32_t)PDU.ExtendedDataPage << 25) | ((uint32_t)PDU.DataPage << 24) |
+          ((uint32_t)PDU.PDUFormat << 16) | ((uint32_t)PDU.DestinationAddress << 8) | PDU.SourceAddress);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//can_accept()
+// Checks a CAN ID against the masks and filters, the bus only puts accepted
+// frames in receive buffers.
+//  Parameters: id - CAN ID
+//  Returns:    True - if a filter accepts it
+//              False - if none does
+////////////////////////////////////////////////////////////////////////////////
+int1 can_accept(uint32_t id)
+{
+   uint8_t i;
+
+   for(i=RX0FILTER0;i<=RX1FILTER5;i++)
+   {
+      uint32_t Mask = can_id[(i <= RX0FILTER1) ? RX0MASK : RX1MASK];
+
+      if((id & Mask) == (can_id[i] & Mask))
+         return(TRUE);
+   }
+
+   return(FALSE);
+}
+
+void can_init(void)
+{
+   memset(can_id,0,sizeof(can_id));      //receive everything until filters are set
+   can_mode = CAN_OP_NORMAL;
+}
+
+void can_set_mode(CAN_OP_MODE mode)
+{
+   can_mode = mode;
+}
+
+void can_set_id(uint8_t addr, uint32_t id, int1 ext)
+{
+   can_id[addr] = id & 0x1FFFFFFF;
+}
+
+int1 can_tbe(void)
+{
+   return((can_mode == CAN_OP_NORMAL) && SimTxFree(NODE_INDEX));
+}
+
+int1 can_putd(J1939_PDU_STRUCT PDU, uint8_t *data, uint8_t len, uint8_t priority, int1 ext, int1 rtr)
+{
+   if(can_mode != CAN_OP_NORMAL)
+      return(FALSE);
+
+   return(SimPut(NODE_INDEX, can_pdu_id(PDU), data, len));
+}
+
+int1 can_kbhit(void)
+{
+   return(SimKbhit(NODE_INDEX));
+}
+
+int1 can_getd(J1939_PDU_STRUCT &PDU, uint8_t *data, uint8_t &len, struct rx_stat &stat)
+{
+   uint32_t id;
+
+   memset(&stat,0,sizeof(stat));
+
+   if(SimGet(NODE_INDEX, &id, data, &len) == FALSE)
+      return(FALSE);
+
+   PDU.SourceAddress = make8(id,0);
+   PDU.DestinationAddress = make8(id,1);
+   PDU.PDUFormat = make8(id,2);
+   PDU.DataPage = bit_test(id,24);
+   PDU.ExtendedDataPage = bit_test(id,25);
+   PDU.Priority = (id >> 26) & 7;
+
+   stat.ext = TRUE;
+
+   return(TRUE);
+}
@@ -0,0 +1,45 @@
+////////////////////////////////////////////////////////////////////////////////
+////                               ccs_host.h                               ////
+////                                                                        ////
+//// CCS C built-ins and tick timer macros the J1939 Driver uses, for       ////
+//// building it on a PC, see sim/Makefile.  Each node is built in its own  ////
+//// namespace, NODE_NS, with NODE_INDEX its number on the bus.             ////
+////                                                                        ////
+////////////////////////////////////////////////////////////////////////////////
+#ifndef _CCS_HOST_H
+#define _CCS_HOST_H
+
+#include <stdint.h>
+#include <string.h>
+
+typedef bool int1;
+
+#ifndef TRUE
+#define TRUE   1
+#define FALSE  0
+#endif
+
+#define make8(var,offset)        ((uint8_t)((uint32_t)(var) >> ((offset) * 8)))
+#define make16(hi,lo)            ((uint16_t)(((uint16_t)(uint8_t)(hi) << 8) | (uint8_t)(lo)))
+#define make32(b3,b2,b1,b0)      (((uint32_t)(uint8_t)(b3) << 24) | ((uint32_t)(uint8_t)(b2) << 16) | \
+                                  ((uint32_t)(uint8_t)(b1) << 8) | (uint32_t)(uint8_t)(b0))
+#define bit_test(var,bit)        ((((var) >> (bit)) & 1) != 0)
+#define bit_set(var,bit)         ((var) |= (1UL << (bit)))
+#define bit_clear(var,bit)       ((var) &= ~(1UL << (bit)))
+
+#include "sim_bus.h"
+
+//tick timer of every node is the simulated bus time in ms
+#define J1939GetTick()                 SimGetTick()
+#define J1939GetTickDifference(a,b)    ((uint32_t)((a) - (b)))
+#define J1939_TICKS_PER_SECOND         1000
+#define J1939_TICK_TYPE                uint32_t
+
+#define J1939InitAddress()    (g_MyJ1939Address = SimNodeAddress(NODE_INDEX))
+#define J1939InitName()       SimNodeName(NODE_INDEX, g_J1939Name)
+
+#define USE_INTERNAL_CAN      FALSE    //stub external CAN controller, sim/can-mcp251x.c
+#define CAN_BRG_PRESCALAR     0        //bit timing isn't simulated
+#define J1939_CLAIM_STATS     TRUE
+
+#endif
@@ -0,0 +1,460 @@
+////////////////////////////////////////////////////////////////////////////////
+////                             claim_sim.cpp                              ////
+////                                                                        ////
+//// Address Claim storm benchmark.  Runs copies of the J1939 Driver on a   ////
+//// simulated 250 kbit/s CAN bus, every node powered on at a random time   ////
+//// within the skew with a random Name, and prints for each run:           ////
+////                                                                        ////
+////   claimed_ms  - time from first power on until every node owns an      ////
+////                 address or has sent Cannot Claim Address, and the bus  ////
+////                 is idle                                                ////
+////   claims      - Address Claimed frames put on the bus                  ////
+////   cannot      - Cannot Claim Address frames put on the bus             ////
+////                                                                        ////
+//// Usage: claim_sim [-n nodes] [-r runs] [-s seed] [-k skew ms]           ////
+////                  [-a address] [-f fixed]                               ////
+////                                                                        ////
+////   nodes   - nodes on the bus, 1 to SIM_MAX_NODES (def: 16)             ////
+////   runs    - runs, each with new Names and power on times (def: 10)     ////
+////   seed    - seed of first run, each run adds 1 (def: 1)                ////
+////   skew    - power on times are spread over 0 to skew ms (def: 10)      ////
+////   address - preferred address of every node (def: 128)                 ////
+////   fixed   - nodes that aren't Arbitrary Address Capable (def: 0)       ////
+////                                                                        ////
+//// Frames are sent by lowest ID first.  Frames with the same ID, which    ////
+//// on a real bus collide and are retried, are won by the lowest data      ////
+//// here, like arbitration carried on into the data field.  Exit status    ////
+//// is 1 if a run didn't settle or two nodes own the same address.         ////
+////                                                                        ////
+////////////////////////////////////////////////////////////////////////////////
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sim_bus.h"
+
+#define SIM_STEP_US        50          //nodes are polled this often
+#define SIM_BIT_US         4           //250 kbit/s
+#define SIM_SETTLE_US      1000000     //bus must stay settled this long
+#define SIM_LIMIT_US       30000000    //run is given up after this
+
+#define SIM_PF_ADDR_CLAIMED   238
+#define SIM_NULL_ADDRESS      254
+
+typedef struct _SIM_FRAME {
+   uint32_t Id;
+   uint8_t Data[8];
+   uint8_t Length;
+   uint32_t Seq;                 //order frame was loaded in, older goes first with same ID
+} SIM_FRAME;
+
+typedef struct _SIM_NODE {
+   const SIM_NODE_OPS *Ops;
+   bool Powered;
+   uint32_t PowerOn;             //power on time, us
+   uint8_t Address;              //preferred address
+   uint8_t Name[8];
+   bool TxUsed[SIM_TX_BUFFERS];
+   SIM_FRAME Tx[SIM_TX_BUFFERS];
+   SIM_FRAME Rx[SIM_RX_BUFFERS];
+   uint8_t RxCount;
+   uint8_t RxNextOut;
+} SIM_NODE;
+
+typedef struct _SIM_RESULT {
+   bool Settled;
+   uint32_t ClaimedUs;
+   uint32_t Claims;
+   uint32_t Cannot;
+   uint32_t Collisions;          //frames that had the same ID as another node's
+   uint32_t Overruns;            //frames dropped by full receive buffers
+   bool Duplicate;
+} SIM_RESULT;
+
+static SIM_NODE g_Node[SIM_MAX_NODES];
+static uint8_t g_Nodes;
+static uint32_t g_TimeUs;
+static uint32_t g_Seq;
+static uint64_t g_Random;
+
+////////////////////////////////////////////////////////////////////////////////  Node interface, sim_bus.h
+
+void SimRegisterNode(uint8_t Node, const SIM_NODE_OPS *Ops)
+{
+   g_Node[Node].Ops = Ops;
+}
+
+uint32_t SimGetTick(void)
+{
+   return(g_TimeUs / 1000);
+}
+
+uint8_t SimNodeAddress(uint8_t Node)
+{
+   return(g_Node[Node].Address);
+}
+
+void SimNodeName(uint8_t Node, uint8_t *Name)
+{
+   memcpy(Name, g_Node[Node].Name, 8);
+}
+
+bool SimTxFree(uint8_t Node)
+{
+   uint8_t i;
+
+   for(i=0;i<SIM_TX_BUFFERS;i++)
+   {
+      if(!g_Node[Node].TxUsed[i])
+         return(true);
+   }
+
+   return(false);
+}
+
+bool SimPut(uint8_t Node, uint32_t Id, const uint8_t *Data, uint8_t Length)
+{
+   SIM_NODE *N = &g_Node[Node];
+   uint8_t i;
+
+   for(i=0;i<SIM_TX_BUFFERS;i++)
+   {
+      if(N->TxUsed[i])
+         continue;
+
+      N->Tx[i].Id = Id;
+      memcpy(N->Tx[i].Data, Data, Length);
+      N->Tx[i].Length = Length;
+      N->Tx[i].Seq = g_Seq++;
+      N->TxUsed[i] = true;
+
+      return(true);
+   }
+
+   return(false);
+}
+
+bool SimKbhit(uint8_t Node)
+{
+   return(g_Node[Node].RxCount > 0);
+}
+
+bool SimGet(uint8_t Node, uint32_t *Id, uint8_t *Data, uint8_t *Length)
+{
+   SIM_NODE *N = &g_Node[Node];
+   SIM_FRAME *F;
+
+   if(N->RxCount == 0)
+      return(false);
+
+   F = &N->Rx[N->RxNextOut];
+   *Id = F->Id;
+   memcpy(Data, F->Data, F->Length);
+   *Length = F->Length;
+
+   N->RxNextOut = (N->RxNextOut + 1) % SIM_RX_BUFFERS;
+   N->RxCount--;
+
+   return(true);
+}
+
+////////////////////////////////////////////////////////////////////////////////  Bus
+
+static uint32_t SimRandom(void)
+{
+   g_Random ^= g_Random << 13;
+   g_Random ^= g_Random >> 7;
+   g_Random ^= g_Random << 17;
+
+   return((uint32_t)(g_Random >> 16));
+}
+
+//frame goes before other if it wins arbitration, lowest ID then lowest data
+static bool SimFrameWins(const SIM_FRAME *Frame, const SIM_FRAME *Other)
+{
+   int Compare;
+
+   if(Frame->Id != Other->Id)
+      return(Frame->Id < Other->Id);
+
+   Compare = memcmp(Frame->Data, Other->Data, (Frame->Length < Other->Length) ? Frame->Length : Other->Length);
+   if(Compare != 0)
+      return(Compare < 0);
+
+   return(Frame->Length < Other->Length);
+}
+
+//transmit buffer node's CAN controller sends next, -1 if none is loaded
+static int SimNextTx(SIM_NODE *N)
+{
+   int Best = -1;
+   uint8_t i;
+
+   for(i=0;i<SIM_TX_BUFFERS;i++)
+   {
+      if(!N->TxUsed[i])
+         continue;
+
+      if((Best < 0) || (N->Tx[i].Id < N->Tx[Best].Id) ||
+         ((N->Tx[i].Id == N->Tx[Best].Id) && (N->Tx[i].Seq < N->Tx[Best].Seq)))
+         Best = i;
+   }
+
+   return(Best);
+}
+
+//extended data frame with 3 bit interframe space, and about half the worst case stuff bits
+static uint32_t SimFrameUs(uint8_t Length)
+{
+   return((67 + (8 * Length) + ((54 + (8 * Length)) / 8)) * SIM_BIT_US);
+}
+
+static void SimDeliver(uint8_t From, const SIM_FRAME *Frame, SIM_RESULT *Result)
+{
+   SIM_NODE *N;
+   uint8_t i;
+
+   if(((Frame->Id >> 16) & 0xFF) == SIM_PF_ADDR_CLAIMED)
+   {
+      if((Frame->Id & 0xFF) == SIM_NULL_ADDRESS)
+         Result->Cannot++;
+      else
+         Result->Claims++;
+   }
+
+   for(i=0;i<g_Nodes;i++)
+   {
+      N = &g_Node[i];
+
+      if((i == From) || !N->Powered || !N->Ops->Accept(Frame->Id))
+         continue;
+
+      if(N->RxCount >= SIM_RX_BUFFERS)
+      {
+         Result->Overruns++;
+         continue;
+      }
+
+      N->Rx[(N->RxNextOut + N->RxCount) % SIM_RX_BUFFERS] = *Frame;
+      N->RxCount++;
+   }
+}
+
+static bool SimSettled(SIM_RESULT *Result)
+{
+   uint8_t Address;
+   uint8_t Owner[256];
+   uint8_t State;
+   uint8_t i;
+
+   memset(Owner, 0xFF, sizeof(Owner));
+   Result->Duplicate = false;
+
+   for(i=0;i<g_Nodes;i++)
+   {
+      if(!g_Node[i].Powered || (SimNextTx(&g_Node[i]) >= 0))
+         return(false);
+
+      State = g_Node[i].Ops->ClaimState(&Address);
+
+      if(State == SIM_CLAIM_BUSY)
+         return(false);
+
+      if(State == SIM_CLAIM_CANNOT)
+         continue;
+
+      if(Owner[Address] != 0xFF)
+         Result->Duplicate = true;
+      else
+         Owner[Address] = i;
+   }
+
+   return(true);
+}
+
+static void SimRun(uint32_t Seed, uint32_t SkewUs, uint8_t Address, uint8_t Fixed, SIM_RESULT *Result)
+{
+   SIM_NODE *N;
+   SIM_FRAME Frame;
+   bool Busy = false;
+   bool Settled = false;
+   uint32_t BusyEnd = 0;
+   uint32_t SettledUs = 0;
+   uint8_t From = 0;
+   int Winner;
+   int Tx;
+   uint8_t i, j;
+
+   memset(Result, 0, sizeof(SIM_RESULT));
+   g_Random = 0x9E3779B97F4A7C15ULL ^ Seed;
+   g_TimeUs = 0;
+   g_Seq = 0;
+
+   for(i=0;i<g_Nodes;i++)
+   {
+      N = &g_Node[i];
+      N->Powered = false;
+      N->PowerOn = (i == 0) ? 0 : (SimRandom() % (SkewUs + 1));
+      N->Address = Address;
+      for(j=0;j<8;j++)
+         N->Name[j] = (uint8_t)SimRandom();
+      if(i < Fixed)
+         N->Name[7] &= 0x7F;     //not Arbitrary Address Capable
+      else
+         N->Name[7] |= 0x80;
+      memset(N->TxUsed, 0, sizeof(N->TxUsed));
+      N->RxCount = 0;
+      N->RxNextOut = 0;
+   }
+
+   for(g_TimeUs=0;g_TimeUs<SIM_LIMIT_US;g_TimeUs+=SIM_STEP_US)
+   {
+      for(i=0;i<g_Nodes;i++)
+      {
+         N = &g_Node[i];
+
+         if(!N->Powered && (g_TimeUs >= N->PowerOn))
+         {
+            N->Powered = true;
+            N->Ops->Init();
+         }
+      }
+
+      if(Busy && (g_TimeUs >= BusyEnd))
+      {
+         SimDeliver(From, &Frame, Result);
+         Busy = false;
+      }
+
+      for(i=0;i<g_Nodes;i++)
+      {
+         if(g_Node[i].Powered)
+            g_Node[i].Ops->Poll();
+      }
+
+      if(!Busy)
+      {
+         Winner = -1;
+
+         for(i=0;i<g_Nodes;i++)
+         {
+            Tx = SimNextTx(&g_Node[i]);
+
+            if((Tx >= 0) && ((Winner < 0) || SimFrameWins(&g_Node[i].Tx[Tx], &Frame)))
+            {
+               Frame = g_Node[i].Tx[Tx];
+               From = i;
+               Winner = Tx;
+            }
+         }
+
+         if(Winner >= 0)
+         {
+            for(i=0;i<g_Nodes;i++)
+            {
+               Tx = SimNextTx(&g_Node[i]);
+
+               if((i != From) && (Tx >= 0) && (g_Node[i].Tx[Tx].Id == Frame.Id))
+               {
+                  Result->Collisions++;
+                  break;
+               }
+            }
+
+            g_Node[From].TxUsed[Winner] = false;   //controller has it, buffer is free once frame is on the bus
+            Busy = true;
+            BusyEnd = g_TimeUs + SimFrameUs(Frame.Length);
+         }
+      }
+
+      if(!Busy && SimSettled(Result))
+      {
+         if(!Settled)
+         {
+            Settled = true;
+            SettledUs = g_TimeUs;
+         }
+         else if((g_TimeUs - SettledUs) >= SIM_SETTLE_US)
+            break;
+      }
+      else if(!Busy)
+         Settled = false;
+   }
+
+   Result->Settled = Settled && (g_TimeUs < SIM_LIMIT_US);
+   Result->ClaimedUs = SettledUs;
+}
+
+static void SimUsage(void)
+{
+   fprintf(stderr, "usage: claim_sim [-n nodes] [-r runs] [-s seed] [-k skew ms] [-a address] [-f fixed]\n");
+   exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+   SIM_RESULT Result;
+   uint32_t Runs = 10;
+   uint32_t Seed = 1;
+   uint32_t Skew = 10;
+   uint32_t Address = 128;
+   uint32_t Fixed = 0;
+   uint32_t Nodes = 16;
+   uint32_t Run;
+   uint64_t SumUs = 0, SumClaims = 0, SumCannot = 0;
+   uint32_t MaxUs = 0;
+   int Failed = 0;
+   int Option;
+
+   while((Option = getopt(argc, argv, "n:r:s:k:a:f:")) != -1)
+   {
+      switch(Option)
+      {
+         case 'n': Nodes = strtoul(optarg, NULL, 0); break;
+         case 'r': Runs = strtoul(optarg, NULL, 0); break;
+         case 's': Seed = strtoul(optarg, NULL, 0); break;
+         case 'k': Skew = strtoul(optarg, NULL, 0); break;
+         case 'a': Address = strtoul(optarg, NULL, 0); break;
+         case 'f': Fixed = strtoul(optarg, NULL, 0); break;
+         default: SimUsage();
+      }
+   }
+
+   if((Nodes < 1) || (Nodes > SIM_MAX_NODES) || (Runs < 1) || (Address > 253) || (Fixed > Nodes))
+      SimUsage();
+
+   g_Nodes = Nodes;
+
+   printf("nodes %u, skew %u ms, address %u, fixed %u\n", Nodes, Skew, Address, Fixed);
+   printf("%5s %10s %8s %8s %10s %8s\n", "seed", "claimed_ms", "claims", "cannot", "collisions", "overruns");
+
+   for(Run=0;Run<Runs;Run++)
+   {
+      SimRun(Seed + Run, Skew * 1000, Address, Fixed, &Result);
+
+      printf("%5u %10.1f %8u %8u %10u %8u", Seed + Run, Result.ClaimedUs / 1000.0, Result.Claims, Result.Cannot,
+             Result.Collisions, Result.Overruns);
+
+      if(!Result.Settled)
+         printf("  didn't settle");
+      else if(Result.Duplicate)
+         printf("  duplicate address");
+
+      printf("\n");
+
+      if(!Result.Settled || Result.Duplicate)
+         Failed = 1;
+
+      SumUs += Result.ClaimedUs;
+      SumClaims += Result.Claims;
+      SumCannot += Result.Cannot;
+      if(Result.ClaimedUs > MaxUs)
+         MaxUs = Result.ClaimedUs;
+   }
+
+   printf("%5s %10.1f %8.1f %8.1f\n", "avg", SumUs / 1000.0 / Runs, (double)SumClaims / Runs, (double)SumCannot / Runs);
+   printf("%5s %10.1f\n", "max", MaxUs / 1000.0);
+
+   return(Failed);
+}
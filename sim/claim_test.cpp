@@ -0,0 +1,420 @@
+////////////////////////////////////////////////////////////////////////////////
+////                             claim_test.cpp                             ////
+////                                                                        ////
+//// Tests of the Address Claim state machine, g_J1939ClaimTransition and   ////
+//// J1939ClaimEvent().  One copy of the J1939 Driver is driven through     ////
+//// claim, timeout, defend, lose and cannot claim paths with frames put    ////
+//// in its receive buffer, and the frames it sends are checked.            ////
+//// J1939CompareName() and the Name field macros are checked against a     ////
+//// table of Names.                                                        ////
+////                                                                        ////
+//// Prints each failed check, exit status is 1 if any failed.              ////
+////                                                                        ////
+////////////////////////////////////////////////////////////////////////////////
+#include <stdio.h>
+
+#include "ccs_host.h"
+
+namespace NODE_NS {
+#include "j1939.c"
+}
+
+using namespace NODE_NS;
+
+#define TEST_FRAMES        64
+
+typedef struct _TEST_FRAME {
+   uint32_t Id;
+   uint8_t Data[8];
+   uint8_t Length;
+} TEST_FRAME;
+
+static uint32_t g_TestTick;
+static uint8_t g_TestAddress;
+static uint8_t g_TestName[8];
+static TEST_FRAME g_TestSent[TEST_FRAMES];
+static uint8_t g_TestSentCount;
+static TEST_FRAME g_TestReceived;
+static bool g_TestReceivedFull;
+static int g_TestFailed;
+
+#define CHECK(cond)     do { if(!(cond)) { printf("%s:%d: %s failed\n", __FILE__, __LINE__, #cond); g_TestFailed = 1; } } while(0)
+
+////////////////////////////////////////////////////////////////////////////////  Bus of the one node, sim_bus.h
+
+uint32_t SimGetTick(void)
+{
+   return(g_TestTick);
+}
+
+uint8_t SimNodeAddress(uint8_t Node)
+{
+   return(g_TestAddress);
+}
+
+void SimNodeName(uint8_t Node, uint8_t *Name)
+{
+   memcpy(Name, g_TestName, 8);
+}
+
+bool SimTxFree(uint8_t Node)
+{
+   return(g_TestSentCount < TEST_FRAMES);
+}
+
+bool SimPut(uint8_t Node, uint32_t Id, const uint8_t *Data, uint8_t Length)
+{
+   TEST_FRAME *F;
+
+   if(g_TestSentCount >= TEST_FRAMES)
+      return(false);
+
+   F = &g_TestSent[g_TestSentCount++];
+   F->Id = Id;
+   memcpy(F->Data, Data, Length);
+   F->Length = Length;
+
+   return(true);
+}
+
+bool SimKbhit(uint8_t Node)
+{
+   return(g_TestReceivedFull);
+}
+
+bool SimGet(uint8_t Node, uint32_t *Id, uint8_t *Data, uint8_t *Length)
+{
+   if(!g_TestReceivedFull)
+      return(false);
+
+   *Id = g_TestReceived.Id;
+   memcpy(Data, g_TestReceived.Data, g_TestReceived.Length);
+   *Length = g_TestReceived.Length;
+   g_TestReceivedFull = false;
+
+   return(true);
+}
+
+////////////////////////////////////////////////////////////////////////////////  Helpers
+
+//runs J1939ReceiveTask() and J1939XmitTask() once every ms for ms
+static void TestRun(uint32_t ms)
+{
+   while(ms--)
+   {
+      J1939ReceiveTask();
+      J1939XmitTask();
+      g_TestTick++;
+   }
+}
+
+//powers node on with Name whose byte 7 is Top and preferred address
+static void TestPowerOn(uint8_t Top, uint8_t Address)
+{
+   uint8_t i;
+
+   for(i=0;i<7;i++)
+      g_TestName[i] = 0x11 * (i + 1);
+   g_TestName[7] = Top;
+   g_TestAddress = Address;
+   g_TestSentCount = 0;
+   g_TestReceivedFull = false;
+
+   J1939Init();
+}
+
+//another node's Address Claimed for address, with our Name but byte 7 Top
+static void TestReceiveClaim(uint8_t Address, uint8_t Top)
+{
+   g_TestReceived.Id = ((uint32_t)J1939_REQUEST_PRIORITY << 26) | ((uint32_t)J1939_PF_ADDR_CLAIMED << 16) |
+                       ((uint32_t)J1939_GLOBAL_ADDRESS << 8) | Address;
+   memcpy(g_TestReceived.Data, g_TestName, 8);
+   g_TestReceived.Data[7] = Top;
+   g_TestReceived.Length = 8;
+   g_TestReceivedFull = true;
+
+   TestRun(1);
+}
+
+//frame of 8 data bytes from another node
+static void TestReceiveFrame(uint32_t Id, const uint8_t *Data)
+{
+   g_TestReceived.Id = Id;
+   memcpy(g_TestReceived.Data, Data, 8);
+   g_TestReceived.Length = 8;
+   g_TestReceivedFull = true;
+
+   TestRun(1);
+}
+
+//number of Address Claimed or Cannot Claim Address sent with source address, from frame First on
+static uint8_t TestClaimsSent(uint8_t First, uint8_t Address)
+{
+   uint8_t Count = 0;
+   uint8_t i;
+
+   for(i=First;i<g_TestSentCount;i++)
+   {
+      if((make8(g_TestSent[i].Id,2) == J1939_PF_ADDR_CLAIMED) && (make8(g_TestSent[i].Id,0) == Address) &&
+         (memcmp(g_TestSent[i].Data, g_TestName, 8) == 0))
+         Count++;
+   }
+
+   return(Count);
+}
+
+static uint8_t TestState(void)
+{
+   return(g_J1939CA[0].ClaimState);
+}
+
+////////////////////////////////////////////////////////////////////////////////  Tests
+
+//events that don't apply in a state leave it there
+static void TestIgnoredEvents(void)
+{
+   TestPowerOn(0x90, 128);
+   TestRun(300);
+   CHECK(TestState() == J1939_CLAIM_CLAIMED);
+
+   J1939ClaimEvent(0, J1939_CLAIM_EV_TIMEOUT);
+   J1939ClaimEvent(0, J1939_CLAIM_EV_SENT);
+   CHECK(TestState() == J1939_CLAIM_CLAIMED);
+
+   g_J1939CA[0].ClaimState = J1939_CLAIM_IDLE;
+   J1939ClaimEvent(0, J1939_CLAIM_EV_SENT);
+   J1939ClaimEvent(0, J1939_CLAIM_EV_TIMEOUT);
+   J1939ClaimEvent(0, J1939_CLAIM_EV_LOST);
+   CHECK(TestState() == J1939_CLAIM_IDLE);
+   CHECK(J1939TimerRunning(J1939_TIMER_ADDRESS_CLAIM) == FALSE);
+}
+
+//Address Claimed is sent, no contending claim in 250ms and address is ours
+static void TestClaimTimeout(void)
+{
+   J1939_CLAIM_STATS_STRUCT Stats;
+
+   TestPowerOn(0x90, 128);
+   CHECK(TestState() == J1939_CLAIM_CLAIMING);
+
+   TestRun(1);
+   CHECK(TestState() == J1939_CLAIM_CONTENDING);
+   CHECK(TestClaimsSent(0, 128) == 1);
+   CHECK(J1939TimerRunning(J1939_TIMER_ADDRESS_CLAIM));
+
+   TestRun(J1939_ADDRESS_CLAIM_TIME - 20);
+   CHECK(TestState() == J1939_CLAIM_CONTENDING);
+
+   TestRun(40);
+   CHECK(TestState() == J1939_CLAIM_CLAIMED);
+   CHECK(J1939TimerRunning(J1939_TIMER_ADDRESS_CLAIM) == FALSE);
+   CHECK(can_id[RX0FILTER1] == ((uint32_t)128 << 8));    //messages to address are received
+   CHECK(TestClaimsSent(0, 128) == 1);
+
+   J1939GetClaimStats(0, &Stats);
+   CHECK(Stats.ClaimsSent == 1);
+   CHECK((Stats.ClaimTime >= J1939_ADDRESS_CLAIM_TIME) && (Stats.ClaimTime <= J1939_ADDRESS_CLAIM_TIME + 20));
+}
+
+//lower priority Name claims our address, we keep it and claim it again
+static void TestDefend(void)
+{
+   J1939_CLAIM_STATS_STRUCT Stats;
+   uint8_t Sent;
+
+   TestPowerOn(0x90, 128);
+   TestRun(300);
+   Sent = g_TestSentCount;
+
+   TestReceiveClaim(128, 0xA0);
+   TestRun(1);
+   CHECK(TestState() == J1939_CLAIM_CLAIMED);
+   CHECK(g_MyJ1939Address == 128);
+   CHECK(TestClaimsSent(Sent, 128) == 1);
+
+   J1939GetClaimStats(0, &Stats);
+   CHECK(Stats.ClaimsDefended == 1);
+   CHECK(Stats.ClaimsLost == 0);
+}
+
+//higher priority Name claims our address, Arbitrary Address Capable node claims another one
+static void TestLoseArbitrary(void)
+{
+   J1939_CLAIM_STATS_STRUCT Stats;
+   uint8_t Sent;
+
+   TestPowerOn(0x90, 128);
+   TestRun(300);
+   Sent = g_TestSentCount;
+
+   TestReceiveClaim(128, 0x80);
+   CHECK(g_MyJ1939Address != 128);
+   CHECK((g_MyJ1939Address >= 128) && (g_MyJ1939Address <= 247));
+   CHECK(can_id[RX0FILTER1] == ((uint32_t)J1939_GLOBAL_ADDRESS << 8));   //address isn't ours anymore
+   CHECK(TestState() == J1939_CLAIM_CONTENDING);
+   CHECK(TestClaimsSent(Sent, 128) == 0);
+   CHECK(TestClaimsSent(Sent, g_MyJ1939Address) == 1);
+
+   TestRun(J1939_ADDRESS_CLAIM_TIME + 20);
+   CHECK(TestState() == J1939_CLAIM_CLAIMED);
+   CHECK(can_id[RX0FILTER1] == ((uint32_t)g_MyJ1939Address << 8));
+
+   J1939GetClaimStats(0, &Stats);
+   CHECK(Stats.ClaimsLost == 1);
+   CHECK(Stats.ClaimsSent == 2);
+}
+
+//address is lost while waiting for contending claims, claim timer starts over for new address
+static void TestLoseContending(void)
+{
+   TestPowerOn(0x90, 128);
+   TestRun(100);
+   CHECK(TestState() == J1939_CLAIM_CONTENDING);
+
+   TestReceiveClaim(128, 0x80);
+   CHECK(g_MyJ1939Address != 128);
+
+   TestRun(J1939_ADDRESS_CLAIM_TIME - 20);
+   CHECK(TestState() == J1939_CLAIM_CONTENDING);
+
+   TestRun(40);
+   CHECK(TestState() == J1939_CLAIM_CLAIMED);
+}
+
+//node that isn't Arbitrary Address Capable loses its address and sends Cannot Claim Address
+static void TestCannotClaim(void)
+{
+   J1939_CLAIM_STATS_STRUCT Stats;
+   uint8_t Sent;
+
+   TestPowerOn(0x10, 128);
+   TestRun(300);
+   CHECK(TestState() == J1939_CLAIM_CLAIMED);
+   Sent = g_TestSentCount;
+
+   TestReceiveClaim(128, 0x00);
+   CHECK(TestState() == J1939_CLAIM_CANNOT_CLAIM);
+   CHECK(can_id[RX0FILTER1] == ((uint32_t)J1939_GLOBAL_ADDRESS << 8));
+
+   TestRun(150);      //sent after random delay of up to 135ms
+   CHECK(TestClaimsSent(Sent, J1939_NULL_ADDRESS) == 1);
+   CHECK(TestClaimsSent(Sent, 128) == 0);
+
+   TestReceiveClaim(128, 0xA0);     //lower priority Name doesn't give address back
+   TestRun(300);
+   CHECK(TestState() == J1939_CLAIM_CANNOT_CLAIM);
+
+   J1939GetClaimStats(0, &Stats);
+   CHECK(Stats.CannotClaim == 1);
+
+   J1939ClaimAddress(0);            //application tries again
+   CHECK(TestState() == J1939_CLAIM_CLAIMING);
+
+   TestRun(J1939_ADDRESS_CLAIM_TIME + 20);
+   CHECK(TestState() == J1939_CLAIM_CLAIMED);
+   CHECK(TestClaimsSent(Sent, 128) == 1);
+}
+
+//address below 128 of a node that isn't Arbitrary Address Capable is used once its claim is sent
+static void TestSentNow(void)
+{
+   TestPowerOn(0x10, 10);
+   TestRun(1);
+   CHECK(TestState() == J1939_CLAIM_CLAIMED);
+   CHECK(TestClaimsSent(0, 10) == 1);
+   CHECK(J1939TimerRunning(J1939_TIMER_ADDRESS_CLAIM) == FALSE);
+}
+
+//Name of controller application 0 against received Name, most significant byte decides
+static void TestCompareName(void)
+{
+   static const struct {
+      uint8_t Ours[8];
+      uint8_t Theirs[8];
+      int1 Priority;       //J1939CompareName() result, ours has priority
+   } Cases[] = {
+      {{0x01, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88}, {0x02, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88}, TRUE},     //byte 0 only
+      {{0x02, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88}, {0x01, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88}, FALSE},
+      {{0xFF, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x10}, {0x00, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x20}, TRUE},     //lower byte greater, higher byte smaller
+      {{0x00, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x20}, {0xFF, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x10}, FALSE},
+      {{0x11, 0xFF, 0xFF, 0xFF, 0x00, 0x66, 0x77, 0x88}, {0x11, 0x00, 0x00, 0x00, 0x01, 0x66, 0x77, 0x88}, TRUE},     //byte 4 decides over bytes 1 to 3
+      {{0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88}, {0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88}, TRUE},     //equal
+   };
+   const uint64_t Value = 0xEA8A819DB47ABCDEULL;
+   uint8_t Name[8];
+   unsigned i;
+
+   for(i=0;i<sizeof(Cases)/sizeof(Cases[0]);i++)
+   {
+      memcpy(g_J1939CA[0].Name, Cases[i].Ours, 8);
+      if(J1939CompareName(0, (uint8_t *)Cases[i].Theirs) != Cases[i].Priority)
+      {
+         printf("%s:%d: J1939CompareName() case %u failed\n", __FILE__, __LINE__, i);
+         g_TestFailed = 1;
+      }
+   }
+
+   for(i=0;i<8;i++)
+      Name[i] = (uint8_t)(Value >> (i * 8));   //Name[0] is least significant byte
+
+   CHECK(J1939NameIdentity(Name) == 0x1ABCDE);
+   CHECK(J1939NameManufacturer(Name) == 0x5A3);
+   CHECK(J1939NameECUInstance(Name) == 5);
+   CHECK(J1939NameFunctionInstance(Name) == 0x13);
+   CHECK(J1939NameFunction(Name) == 0x81);
+   CHECK(J1939NameVehicleSystem(Name) == 0x45);
+   CHECK(J1939NameSystemInstance(Name) == 0x0A);
+   CHECK(J1939NameIndustryGroup(Name) == 6);
+   CHECK(J1939NameArbitrary(Name));
+}
+
+//Commanded Address BAM moves node to new address, with no Transport Protocol sessions
+static void TestCommandedAddress(void)
+{
+   const uint32_t CM = ((uint32_t)7 << 26) | ((uint32_t)J1939_PF_PT_CM << 16) | ((uint32_t)J1939_GLOBAL_ADDRESS << 8) | 0x20;
+   const uint32_t DT = ((uint32_t)7 << 26) | ((uint32_t)J1939_PF_PT_DT << 16) | ((uint32_t)J1939_GLOBAL_ADDRESS << 8) | 0x20;
+   const uint8_t BAM[8] = {J1939_TP_CM_BAM, J1939_COMMANDED_ADDRESS_SIZE, 0, 2, 0xFF, 0xD8, 0xFE, 0x00};
+   uint8_t Packet1[8];
+   uint8_t Packet2[8] = {2, 0, 140, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+   uint8_t Sent;
+
+   TestPowerOn(0x90, 128);
+   TestRun(300);
+   Sent = g_TestSentCount;
+
+   Packet1[0] = 1;
+   memcpy(&Packet1[1], g_TestName, 7);
+   Packet2[1] = g_TestName[7];
+
+   TestReceiveFrame(CM, BAM);
+   TestReceiveFrame(DT, Packet2);      //out of sequence, BAM is dropped
+   TestReceiveFrame(DT, Packet1);
+   CHECK(g_MyJ1939Address == 128);
+
+   TestReceiveFrame(CM, BAM);
+   TestReceiveFrame(DT, Packet1);
+   TestReceiveFrame(DT, Packet2);
+   CHECK(g_MyJ1939Address == 140);
+
+   TestRun(J1939_ADDRESS_CLAIM_TIME + 20);
+   CHECK(TestState() == J1939_CLAIM_CLAIMED);
+   CHECK(TestClaimsSent(Sent, 140) == 1);
+   CHECK(can_id[RX0FILTER1] == ((uint32_t)140 << 8));
+}
+
+int main(void)
+{
+   TestCompareName();
+   TestIgnoredEvents();
+   TestClaimTimeout();
+   TestDefend();
+   TestLoseArbitrary();
+   TestLoseContending();
+   TestCannotClaim();
+   TestSentNow();
+   TestCommandedAddress();
+
+   printf("claim_test: %s\n", g_TestFailed ? "FAILED" : "passed");
+
+   return(g_TestFailed);
+}
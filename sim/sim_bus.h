@@ -0,0 +1,42 @@
+////////////////////////////////////////////////////////////////////////////////
+////                               sim_bus.h                                ////
+////                                                                        ////
+//// Simulated CAN bus the host builds of the J1939 Driver run on.  Stub    ////
+//// CAN driver, sim/can-mcp251x.c, puts and gets frames of node NODE_INDEX ////
+//// through these functions, each program in sim/ supplies them.  Nodes of ////
+//// the claim simulator register their driver functions with it.           ////
+////                                                                        ////
+////////////////////////////////////////////////////////////////////////////////
+#ifndef _SIM_BUS_H
+#define _SIM_BUS_H
+
+#include <stdint.h>
+
+#define SIM_MAX_NODES      32    //copies of the J1939 Driver built, see Makefile
+#define SIM_TX_BUFFERS     3     //transmit buffers of each node's CAN controller
+#define SIM_RX_BUFFERS     2     //receive buffers of each node's CAN controller
+
+#define SIM_CLAIM_BUSY     0     //claim of controller application 0 isn't settled
+#define SIM_CLAIM_CLAIMED  1     //owns its address
+#define SIM_CLAIM_CANNOT   2     //sent Cannot Claim Address
+
+//Functions of one node's copy of the J1939 Driver
+typedef struct _SIM_NODE_OPS {
+   bool (*Init)(void);
+   bool (*Accept)(uint32_t Id);                 //CAN acceptance filters pass frame
+   void (*Poll)(void);                          //J1939ReceiveTask(), J1939XmitTask() and empty receive buffer
+   uint8_t (*ClaimState)(uint8_t *Address);     //SIM_CLAIM_xxx of controller application 0 and its address
+} SIM_NODE_OPS;
+
+void SimRegisterNode(uint8_t Node, const SIM_NODE_OPS *Ops);
+
+uint32_t SimGetTick(void);
+uint8_t SimNodeAddress(uint8_t Node);
+void SimNodeName(uint8_t Node, uint8_t *Name);
+
+bool SimTxFree(uint8_t Node);
+bool SimPut(uint8_t Node, uint32_t Id, const uint8_t *Data, uint8_t Length);
+bool SimKbhit(uint8_t Node);
+bool SimGet(uint8_t Node, uint32_t *Id, uint8_t *Data, uint8_t *Length);
+
+#endif
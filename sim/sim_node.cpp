@@ -0,0 +1,56 @@
+////////////////////////////////////////////////////////////////////////////////
+////                              sim_node.cpp                              ////
+////                                                                        ////
+//// One node of the claim simulator, the J1939 Driver built in namespace   ////
+//// NODE_NS so every node has its own globals.  Makefile builds it once    ////
+//// for each NODE_INDEX from 0 to SIM_MAX_NODES - 1.                       ////
+////                                                                        ////
+////////////////////////////////////////////////////////////////////////////////
+#include "ccs_host.h"
+
+namespace NODE_NS {
+
+#include "j1939.c"
+
+static bool SimInit(void)
+{
+   return(J1939Init());
+}
+
+static bool SimAccept(uint32_t Id)
+{
+   return((can_mode == CAN_OP_NORMAL) && can_accept(Id));
+}
+
+static void SimPoll(void)
+{
+   J1939_PDU_STRUCT PDU;
+   uint8_t Data[8];
+   uint8_t Length;
+
+   J1939ReceiveTask();
+   J1939XmitTask();
+
+   while(J1939Kbhit())
+      J1939GetMessage(PDU, Data, Length);    //application messages aren't looked at
+}
+
+static uint8_t SimClaimState(uint8_t *Address)
+{
+   *Address = g_MyJ1939Address;
+
+   if(g_J1939CA[0].ClaimState == J1939_CLAIM_CLAIMED)
+      return(SIM_CLAIM_CLAIMED);
+   if(g_J1939CA[0].ClaimState == J1939_CLAIM_CANNOT_CLAIM)
+      return(SIM_CLAIM_CANNOT);
+
+   return(SIM_CLAIM_BUSY);
+}
+
+static const SIM_NODE_OPS SimOps = {SimInit, SimAccept, SimPoll, SimClaimState};
+
+static struct SimRegister {
+   SimRegister() { SimRegisterNode(NODE_INDEX, &SimOps); }
+} SimRegistered;
+
+}
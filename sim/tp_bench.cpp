@@ -0,0 +1,341 @@
+////////////////////////////////////////////////////////////////////////////////
+////                              tp_bench.cpp                              ////
+////                                                                        ////
+//// Transport Protocol session index benchmark.  One copy of the J1939    ////
+//// Driver, built with J1939_TP_SESSIONS 8, receives 4 BAM and 4 RTS/CTS   ////
+//// sessions at the same time, from random source addresses, with their   ////
+//// TP.DT frames interleaved.  Prints, over all address sets:              ////
+////                                                                        ////
+////   probes    - session index slots J1939TPFindSession() looks at per    ////
+////               lookup, against sessions a linear scan of the session    ////
+////               array compares                                           ////
+////   lookup ns - host time of J1939TPFindSession() and of a linear scan   ////
+////   frame ns  - host time J1939ReceiveTask() takes per TP.DT frame       ////
+////                                                                        ////
+//// Probes are what the index saves on a PIC18, host times are only for    ////
+//// comparing runs on the same PC.                                         ////
+////                                                                        ////
+//// Usage: tp_bench [-r address sets] [-s seed]                            ////
+////                                                                        ////
+//// Exit status is 1 if a message wasn't received whole.                   ////
+////                                                                        ////
+////////////////////////////////////////////////////////////////////////////////
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <chrono>
+
+#include "ccs_host.h"
+
+#define J1939_TP_SESSIONS     8
+
+namespace NODE_NS {
+#include "j1939.c"
+}
+
+using namespace NODE_NS;
+
+#define BENCH_ADDRESS      128      //address of node, RTS/CTS sessions are sent to it
+#define BENCH_SIZE         49       //bytes of each message, 7 TP.DT frames
+#define BENCH_PACKETS      ((BENCH_SIZE + 6) / 7)
+#define BENCH_BAM_PGN      0x00FEEC
+#define BENCH_RTS_PGN      0x00EF00
+#define BENCH_LOOKUPS      1000     //lookups of each session timed per address set
+
+typedef struct _BENCH_SESSION {
+   uint8_t SourceAddress;
+   uint8_t Destination;
+   uint32_t PGN;
+} BENCH_SESSION;
+
+static uint32_t g_BenchTick;
+static uint32_t g_BenchId;
+static uint8_t g_BenchData[8];
+static bool g_BenchFull;
+static uint64_t g_Random;
+
+////////////////////////////////////////////////////////////////////////////////  Bus of the one node, sim_bus.h
+
+uint32_t SimGetTick(void)
+{
+   return(g_BenchTick);
+}
+
+uint8_t SimNodeAddress(uint8_t Node)
+{
+   return(BENCH_ADDRESS);
+}
+
+void SimNodeName(uint8_t Node, uint8_t *Name)
+{
+   static const uint8_t BenchName[8] = {0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x80};
+
+   memcpy(Name, BenchName, 8);
+}
+
+bool SimTxFree(uint8_t Node)
+{
+   return(true);
+}
+
+bool SimPut(uint8_t Node, uint32_t Id, const uint8_t *Data, uint8_t Length)
+{
+   return(true);     //TP.CM_CTS and TP.CM_EndOfMsgAck aren't looked at
+}
+
+bool SimKbhit(uint8_t Node)
+{
+   return(g_BenchFull);
+}
+
+bool SimGet(uint8_t Node, uint32_t *Id, uint8_t *Data, uint8_t *Length)
+{
+   if(!g_BenchFull)
+      return(false);
+
+   *Id = g_BenchId;
+   memcpy(Data, g_BenchData, 8);
+   *Length = 8;
+   g_BenchFull = false;
+
+   return(true);
+}
+
+////////////////////////////////////////////////////////////////////////////////  Helpers
+
+static uint32_t BenchRandom(void)
+{
+   g_Random ^= g_Random << 13;
+   g_Random ^= g_Random >> 7;
+   g_Random ^= g_Random << 17;
+
+   return((uint32_t)(g_Random >> 16));
+}
+
+//receives a frame of session, J1939ReceiveTask() and J1939XmitTask() run once
+static void BenchReceive(BENCH_SESSION *S, uint8_t PDUFormat, const uint8_t *Data)
+{
+   g_BenchId = ((uint32_t)J1939_TP_CM_PRIORITY << 26) | ((uint32_t)PDUFormat << 16) | ((uint32_t)S->Destination << 8) | S->SourceAddress;
+   memcpy(g_BenchData, Data, 8);
+   g_BenchFull = true;
+
+   J1939ReceiveTask();
+   J1939XmitTask();
+}
+
+static void BenchAnnounce(BENCH_SESSION *S)
+{
+   uint8_t Data[8];
+
+   Data[0] = (S->Destination == J1939_GLOBAL_ADDRESS) ? J1939_TP_CM_BAM : J1939_TP_CM_RTS;
+   Data[1] = make8(BENCH_SIZE,0);
+   Data[2] = make8(BENCH_SIZE,1);
+   Data[3] = BENCH_PACKETS;
+   Data[4] = 0xFF;
+   Data[5] = make8(S->PGN,0);
+   Data[6] = make8(S->PGN,1);
+   Data[7] = make8(S->PGN,2);
+
+   BenchReceive(S, J1939_PF_PT_CM, Data);
+}
+
+//byte of message of session at offset
+static uint8_t BenchByte(BENCH_SESSION *S, uint16_t Offset)
+{
+   return((uint8_t)((S->SourceAddress * 31) + Offset));
+}
+
+static void BenchPacket(BENCH_SESSION *S, uint8_t Sequence)
+{
+   uint8_t Data[8];
+   uint16_t Offset;
+   uint8_t i;
+
+   Data[0] = Sequence;
+
+   for(i=0;i<7;i++)
+   {
+      Offset = ((Sequence - 1) * 7) + i;
+      Data[i + 1] = (Offset < BENCH_SIZE) ? BenchByte(S, Offset) : 0xFF;
+   }
+
+   BenchReceive(S, J1939_PF_PT_DT, Data);
+}
+
+//session array position of an open session plus 1, sessions a linear scan compares
+static uint8_t BenchLinearCompares(BENCH_SESSION *S)
+{
+   uint8_t i;
+
+   for(i=0;i<J1939_TP_SESSIONS;i++)
+   {
+      if(((g_J1939TPSession[i].State == J1939_TP_STATE_BAM) || (g_J1939TPSession[i].State == J1939_TP_STATE_RTS)) &&
+         (g_J1939TPSession[i].PDU.SourceAddress == S->SourceAddress) && (g_J1939TPSession[i].Destination == S->Destination))
+         return(i + 1);
+   }
+
+   return(J1939_TP_SESSIONS);
+}
+
+//lookup the session index replaced, kept to compare against
+static J1939_TP_SESSION_STRUCT *BenchLinearFind(uint8_t SourceAddress, uint8_t Destination)
+{
+   uint8_t i;
+
+   for(i=0;i<J1939_TP_SESSIONS;i++)
+   {
+      if(((g_J1939TPSession[i].State == J1939_TP_STATE_BAM) || (g_J1939TPSession[i].State == J1939_TP_STATE_RTS)) &&
+         (g_J1939TPSession[i].PDU.SourceAddress == SourceAddress) && (g_J1939TPSession[i].Destination == Destination))
+         return(&g_J1939TPSession[i]);
+   }
+
+   return(0);
+}
+
+static double BenchNs(std::chrono::steady_clock::time_point Start, uint32_t Count)
+{
+   return(std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - Start).count() / Count);
+}
+
+int main(int argc, char *argv[])
+{
+   BENCH_SESSION Session[J1939_TP_SESSIONS];
+   J1939_TP_SESSION_STRUCT *Found;
+   J1939_PDU_STRUCT PDU;
+   uint8_t Data[BENCH_SIZE];
+   uint16_t Length;
+   uint32_t Sets = 1000;
+   uint32_t Seed = 1;
+   uint32_t Set, Lookup;
+   uint32_t Probes = 0, ProbesMax = 0, Compares = 0, ComparesMax = 0, Lookups = 0;
+   uint32_t Messages = 0, Bad = 0;
+   double IndexNs = 0, LinearNs = 0, FrameNs = 0;
+   uintptr_t Sink = 0;
+   uint8_t Used[256];
+   uint8_t Probe, Compare;
+   uint8_t i, j;
+   int Option;
+
+   while((Option = getopt(argc, argv, "r:s:")) != -1)
+   {
+      switch(Option)
+      {
+         case 'r': Sets = strtoul(optarg, NULL, 0); break;
+         case 's': Seed = strtoul(optarg, NULL, 0); break;
+         default:
+            fprintf(stderr, "usage: tp_bench [-r address sets] [-s seed]\n");
+            return(2);
+      }
+   }
+
+   if(Sets < 1)
+      Sets = 1;
+
+   g_Random = 0x9E3779B97F4A7C15ULL ^ Seed;
+
+   J1939Init();
+
+   for(g_BenchTick=0;g_BenchTick<300;g_BenchTick++)     //claim address, RTS/CTS sessions are only opened to it
+   {
+      J1939ReceiveTask();
+      J1939XmitTask();
+   }
+
+   for(Set=0;Set<Sets;Set++)
+   {
+      memset(Used, 0, sizeof(Used));
+      Used[BENCH_ADDRESS] = 1;
+
+      for(i=0;i<J1939_TP_SESSIONS;i++)
+      {
+         do
+            Session[i].SourceAddress = BenchRandom() % J1939_NULL_ADDRESS;
+         while(Used[Session[i].SourceAddress]);
+
+         Used[Session[i].SourceAddress] = 1;
+         Session[i].Destination = (i & 1) ? BENCH_ADDRESS : J1939_GLOBAL_ADDRESS;
+         Session[i].PGN = (i & 1) ? BENCH_RTS_PGN : BENCH_BAM_PGN;
+
+         BenchAnnounce(&Session[i]);
+      }
+
+      for(i=0;i<J1939_TP_SESSIONS;i++)
+      {
+         Found = J1939TPFindSession(Session[i].SourceAddress, Session[i].Destination);
+
+         if(Found == 0)
+         {
+            Bad++;
+            continue;
+         }
+
+         Probe = ((Found->Index - J1939TPIndexHash(Session[i].SourceAddress, Session[i].Destination)) & (J1939_TP_INDEX_SIZE - 1)) + 1;
+         Compare = BenchLinearCompares(&Session[i]);
+
+         Probes += Probe;
+         Compares += Compare;
+         Lookups++;
+         if(Probe > ProbesMax)
+            ProbesMax = Probe;
+         if(Compare > ComparesMax)
+            ComparesMax = Compare;
+      }
+
+      std::chrono::steady_clock::time_point Start = std::chrono::steady_clock::now();
+      for(Lookup=0;Lookup<BENCH_LOOKUPS;Lookup++)
+      {
+         for(i=0;i<J1939_TP_SESSIONS;i++)
+            Sink += (uintptr_t)J1939TPFindSession(Session[i].SourceAddress, Session[i].Destination);
+      }
+      IndexNs += BenchNs(Start, BENCH_LOOKUPS * J1939_TP_SESSIONS);
+
+      Start = std::chrono::steady_clock::now();
+      for(Lookup=0;Lookup<BENCH_LOOKUPS;Lookup++)
+      {
+         for(i=0;i<J1939_TP_SESSIONS;i++)
+            Sink += (uintptr_t)BenchLinearFind(Session[i].SourceAddress, Session[i].Destination);
+      }
+      LinearNs += BenchNs(Start, BENCH_LOOKUPS * J1939_TP_SESSIONS);
+
+      Start = std::chrono::steady_clock::now();
+      for(j=1;j<=BENCH_PACKETS;j++)
+      {
+         for(i=0;i<J1939_TP_SESSIONS;i++)
+            BenchPacket(&Session[i], j);      //TP.DT trains of all sessions interleaved
+      }
+      FrameNs += BenchNs(Start, BENCH_PACKETS * J1939_TP_SESSIONS);
+
+      while(J1939TPGetMessage(PDU, Data, sizeof(Data), Length))
+      {
+         for(i=0;i<J1939_TP_SESSIONS;i++)
+         {
+            if(PDU.SourceAddress == Session[i].SourceAddress)
+               break;
+         }
+
+         for(j=0;(i<J1939_TP_SESSIONS) && (j<BENCH_SIZE);j++)
+         {
+            if(Data[j] != BenchByte(&Session[i], j))
+               break;
+         }
+
+         if((i < J1939_TP_SESSIONS) && (Length == BENCH_SIZE) && (j == BENCH_SIZE))
+            Messages++;
+         else
+            Bad++;
+      }
+   }
+
+   printf("sessions %u (%u BAM, %u RTS/CTS), address sets %u, seed %u\n", J1939_TP_SESSIONS,
+          J1939_TP_SESSIONS / 2, J1939_TP_SESSIONS / 2, Sets, Seed);
+   printf("%-8s %10s %10s %10s\n", "lookup", "probes", "max", "ns");
+   printf("%-8s %10.2f %10u %10.1f\n", "index", (double)Probes / Lookups, ProbesMax, IndexNs / Sets);
+   printf("%-8s %10.2f %10u %10.1f\n", "linear", (double)Compares / Lookups, ComparesMax, LinearNs / Sets);
+   printf("TP.DT frame %.1f ns, messages %u of %u, pool peak %u blocks\n", FrameNs / Sets, Messages,
+          Sets * J1939_TP_SESSIONS, J1939TPPoolPeak());
+
+   if(Sink == 1)
+      printf("\n");     //keeps timed lookups from being optimized away
+
+   return((Bad != 0) || (Messages != Sets * J1939_TP_SESSIONS));
+}